@@ -34,6 +34,10 @@
 #include <stdarg.h>
 #include <syslog.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdatomic.h>
 
 #include "os/time.h"
 
@@ -41,6 +45,7 @@
 
 #include <sys/time.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <pthread.h>
 
@@ -48,47 +53,216 @@
 #include "debug_internal.h"
 
 /*
- * XXX TODO: these are likely global due to visibility by other
- * modules, but we could make them indirect through a singleton
- * later on.
+ * The default instance's level tables.  These stay global so the
+ * DEBUG() macros can check them inline.
  */
 char * debug_level_strs[DEBUG_SECTION_MAX];
 debug_mask_t debug_levels[DEBUG_TYPE_MAX][DEBUG_SECTION_MAX];
-static debug_mask_t default_lvl_print = DEBUG_LVL_INFO | DEBUG_LVL_CRIT | DEBUG_LVL_ERR;
-static debug_mask_t default_lvl_log = 0;
-static debug_mask_t default_lvl_syslog = 0;
+debug_mask_t debug_levels_any[DEBUG_SECTION_MAX];
+
+/* The levels new sections start with, for instances created after */
+static debug_mask_t debug_default_lvl[DEBUG_TYPE_MAX] = {
+	[DEBUG_TYPE_PRINT] = DEBUG_LVL_INFO | DEBUG_LVL_CRIT | DEBUG_LVL_ERR,
+};
 
 /*
- * XXX TODO: The locking is very simplistic for now.
- *
- * If there's a lot of logging going on then we will end up
- * lots of lock contention - which you can fix in a variety
- * of lock-free or lock-minimal ways.
+ * Entries are queued on a per-thread ring (see struct debug_thread)
+ * so the enqueue path doesn't take any locks.  debug_lock is now only
+ * used for the level tables and to put the logger thread to sleep.
  */
 
 static struct debug_instance debugInstance;
 
+/*
+ * The calling thread's ring for the instance it last logged to; its
+ * ring for any other instance is found through that instance's
+ * pthread key.  gen is unique to each instance (and each
+ * debug_shutdown()/debug_init() cycle) and kept here rather than read
+ * from the ring so a stale pointer is never followed.
+ */
+static __thread struct debug_thread *debug_thr_self;
+static __thread unsigned int debug_thr_self_gen;
+static unsigned int debug_instance_gen;
+
+/*
+ * Rate limiting state.  debug_tick_ns is a monotonic time kept up to
+ * date by the logger thread so a suppressing DEBUG_RATELIMIT() site
+ * doesn't read the clock itself.  Sites which have suppressed messages
+ * are pushed onto debug_ratelimit_sites; debug_ratelimit_active is set
+ * while any of them are suppressing, which keeps the logger ticking.
+ * Otherwise the logger may sleep for seconds and the tick goes stale,
+ * so sites read the clock instead.
+ */
+static uint64_t debug_tick_ns;
+static struct debug_ratelimit *debug_ratelimit_sites;
+static int debug_ratelimit_active;
+
+/*
+ * Recompute the combined mask DEBUG() checks after a section's
+ * levels have changed.  Registered sinks filter on one mask for
+ * every section, which is ORed in as sink_levels.  It's a single
+ * store so callers never see a half-updated value.
+ */
+static void
+debug_levels_any_update(struct debug_instance *ds, debug_section_t s)
+{
+
+	__atomic_store_n(&ds->hdr.levels_any[s],
+	    ds->levels[DEBUG_TYPE_PRINT][s] |
+	    ds->levels[DEBUG_TYPE_LOG][s] |
+	    ds->levels[DEBUG_TYPE_SYSLOG][s] | ds->sink_levels,
+	    __ATOMIC_RELAXED);
+}
+
+static void debug_instance_log_sync(struct debug_instance *ds,
+    debug_section_t section, debug_mask_t mask, const char *msg, int len,
+    int written, int kv);
+
+/*
+ * The section registry.  debug_section_lock protects the hash index,
+ * the section tree and the allocation of new sections of every
+ * instance; the level tables themselves are still protected by each
+ * instance's debug_lock.  Sections are never freed (until
+ * debug_shutdown()) so they're allocated densely from 0 to
+ * nsections - 1.
+ */
+static pthread_mutex_t debug_section_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct debug_section_node debug_sections[DEBUG_SECTION_MAX];
+static debug_section_t debug_section_hash[DEBUG_SECTION_HASH_SIZE];
+
+/*
+ * Point an instance at its tables: the globals for the default
+ * instance, else its own.
+ */
+static void
+debug_instance_tables_set(struct debug_instance *ds)
+{
+	struct debug_section_tables *t = ds->tables;
+
+	if (t == NULL) {
+		ds->hdr.levels_any = debug_levels_any;
+		ds->level_strs = debug_level_strs;
+		ds->levels = debug_levels;
+		ds->sections = debug_sections;
+		ds->section_hash = debug_section_hash;
+	} else {
+		ds->hdr.levels_any = t->levels_any;
+		ds->level_strs = t->strs;
+		ds->levels = t->levels;
+		ds->sections = t->sections;
+		ds->section_hash = t->hash;
+	}
+}
+
+static uint32_t
+debug_section_hash_str(const char *name, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) name[i];
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static debug_section_t
+debug_section_find_locked(struct debug_instance *ds, const char *name,
+    size_t len)
+{
+	debug_section_t s;
+	uint32_t h;
+
+	h = debug_section_hash_str(name, len);
+	s = ds->section_hash[h % DEBUG_SECTION_HASH_SIZE] - 1;
+	for (; s >= 0; s = ds->sections[s].hnext - 1) {
+		if (ds->sections[s].hash == h &&
+		    strncmp(ds->level_strs[s], name, len) == 0 &&
+		    ds->level_strs[s][len] == '\0')
+			return (s);
+	}
+	return (-1);
+}
+
+/*
+ * Find or allocate the section for the first len bytes of name,
+ * registering its dotted parents first.
+ */
+static debug_section_t
+debug_section_register_locked(struct debug_instance *ds, const char *name,
+    size_t len)
+{
+	struct debug_section_node *n;
+	debug_section_t s, parent = -1;
+	const char *dot;
+	char *str;
+
+	s = debug_section_find_locked(ds, name, len);
+	if (s >= 0)
+		return (s);
+
+	for (dot = name + len - 1; dot > name && *dot != '.'; dot--)
+		;
+	if (dot > name) {
+		parent = debug_section_register_locked(ds, name, dot - name);
+		if (parent < 0)
+			return (-1);
+	}
+
+	if (ds->nsections >= DEBUG_SECTION_MAX)
+		return (-1);
+	str = strndup(name, len);
+	if (str == NULL)
+		return (-1);
+	s = ds->nsections;
+
+	/* Default to logging info/err/crit to stderr */
+	ds->levels[DEBUG_TYPE_PRINT][s] = ds->default_lvl[DEBUG_TYPE_PRINT];
+	ds->levels[DEBUG_TYPE_LOG][s] = ds->default_lvl[DEBUG_TYPE_LOG];
+	ds->levels[DEBUG_TYPE_SYSLOG][s] = ds->default_lvl[DEBUG_TYPE_SYSLOG];
+	ds->levels[DEBUG_TYPE_TRACE][s] = ds->default_lvl[DEBUG_TYPE_TRACE];
+	debug_levels_any_update(ds, s);
+	ds->level_strs[s] = str;
+	if (ds == &debugInstance)
+		debug_trace_section_name(s, str);
+
+	n = &ds->sections[s];
+	n->hash = debug_section_hash_str(name, len);
+	n->hnext = ds->section_hash[n->hash % DEBUG_SECTION_HASH_SIZE];
+	ds->section_hash[n->hash % DEBUG_SECTION_HASH_SIZE] = s + 1;
+	n->parent = parent + 1;
+	n->child = 0;
+	n->sibling = 0;
+	if (parent >= 0) {
+		n->sibling = ds->sections[parent].child;
+		ds->sections[parent].child = s + 1;
+	}
+
+	ds->nsections++;
+	return (s);
+}
+
+/*
+ * Register a debug section, or return the existing section with
+ * the same name.  Dotted names ("net.tcp.retransmit") also register
+ * their parents ("net.tcp", "net") so debug_setmask_glob() can
+ * configure a whole subtree at once.
+ */
 debug_section_t
-debug_register(const char *dbgname)
+debug_instance_register(struct debug_instance *ds, const char *dbgname)
 {
-	int i;
+	debug_section_t s;
 
 	if (dbgname == NULL)
 		return (-1);
 
-	/* XXX locking */
-
-	for (i = 0; i < DEBUG_SECTION_MAX; i++) {
-		if (debug_level_strs[i] == NULL) {
-			debug_level_strs[i] = strdup(dbgname);
-			/* Default to logging info/err/crit to stderr */
-			debug_levels[DEBUG_TYPE_PRINT][i] = default_lvl_print;
-			debug_levels[DEBUG_TYPE_LOG][i] = default_lvl_log;
-			debug_levels[DEBUG_TYPE_SYSLOG][i] = default_lvl_syslog;
-
-			return (i);
-		}
-	}
+	(void) pthread_mutex_lock(&debug_section_lock);
+	s = debug_section_register_locked(ds, dbgname, strlen(dbgname));
+	(void) pthread_mutex_unlock(&debug_section_lock);
+	if (s >= 0)
+		return (s);
 
 	/*
 	 * XXX should log to say, log type 0 (which should be "debug")
@@ -99,24 +273,74 @@ debug_register(const char *dbgname)
 	return (-1);
 }
 
+debug_section_t
+debug_register(const char *dbgname)
+{
+
+	return (debug_instance_register(&debugInstance, dbgname));
+}
+
+static debug_section_t
+debug_section_lookup(struct debug_instance *ds, const char *dbgname)
+{
+	debug_section_t s;
+
+	(void) pthread_mutex_lock(&debug_section_lock);
+	s = debug_section_find_locked(ds, dbgname, strlen(dbgname));
+	(void) pthread_mutex_unlock(&debug_section_lock);
+	return (s);
+}
+
+/*
+ * Forget every section and clear the level tables.
+ */
+static void
+debug_section_reset(struct debug_instance *ds)
+{
+	int i;
+
+	(void) pthread_mutex_lock(&debug_section_lock);
+	for (i = 0; i < ds->nsections; i++) {
+		free(ds->level_strs[i]);
+		ds->level_strs[i] = NULL;
+	}
+	bzero(ds->sections, sizeof(*ds->sections) * DEBUG_SECTION_MAX);
+	bzero(ds->section_hash,
+	    sizeof(*ds->section_hash) * DEBUG_SECTION_HASH_SIZE);
+	ds->nsections = 0;
+	(void) pthread_mutex_unlock(&debug_section_lock);
+
+	bzero(ds->levels, sizeof(*ds->levels) * DEBUG_TYPE_MAX);
+	bzero(ds->hdr.levels_any, sizeof(*ds->hdr.levels_any) *
+	    DEBUG_SECTION_MAX);
+	ds->sink_levels = 0;
+}
+
+/*
+ * Set the levels sections registered from now on start with.  The
+ * global version sets them for the default instance and for instances
+ * created later.
+ */
 void
-debug_setlevel_default(debug_type_t t, debug_mask_t m)
+debug_instance_setlevel_default(struct debug_instance *ds, debug_type_t t,
+    debug_mask_t m)
 {
-	switch (t) {
-	case DEBUG_TYPE_PRINT:
-		default_lvl_print = m;
-		break;
-	case DEBUG_TYPE_LOG:
-		default_lvl_log = m;
-		break;
-	case DEBUG_TYPE_SYSLOG:
-		default_lvl_syslog = m;
-		break;
-	default:
+
+	if (t < 0 || t >= DEBUG_TYPE_MAX) {
 		fprintf(stderr, "%s: unknown debug type (%d)\n",
 		    __func__, t);
-		break;
+		return;
 	}
+	ds->default_lvl[t] = m;
+}
+
+void
+debug_setlevel_default(debug_type_t t, debug_mask_t m)
+{
+
+	debug_instance_setlevel_default(&debugInstance, t, m);
+	if (t >= 0 && t < DEBUG_TYPE_MAX)
+		debug_default_lvl[t] = m;
 }
 
 /*
@@ -124,23 +348,32 @@ debug_setlevel_default(debug_type_t t, debug_mask_t m)
  * destination type with an optional AND and OR to do some filtering.
  */
 void
-debug_setlevel_maskcopy(debug_type_t st, debug_type_t dt, debug_mask_t ma,
-    debug_mask_t mo)
+debug_instance_setlevel_maskcopy(struct debug_instance *ds, debug_type_t st,
+    debug_type_t dt, debug_mask_t ma, debug_mask_t mo)
 {
 	int i;
 	debug_mask_t m;
 
-	(void) pthread_mutex_lock(&debugInstance.debug_lock);
+	(void) pthread_mutex_lock(&ds->debug_lock);
 	for (i = 0; i < DEBUG_SECTION_MAX; i++) {
-		if (debug_level_strs[i] == NULL)
+		if (ds->level_strs[i] == NULL)
 			continue;
-		m = debug_levels[st][i];
+		m = ds->levels[st][i];
 		m &= ma;
 		m |= mo;
-		debug_levels[dt][i] = m;
+		ds->levels[dt][i] = m;
+		debug_levels_any_update(ds, i);
 	}
 
-	(void) pthread_mutex_unlock(&debugInstance.debug_lock);
+	(void) pthread_mutex_unlock(&ds->debug_lock);
+}
+
+void
+debug_setlevel_maskcopy(debug_type_t st, debug_type_t dt, debug_mask_t ma,
+    debug_mask_t mo)
+{
+
+	debug_instance_setlevel_maskcopy(&debugInstance, st, dt, ma, mo);
 }
 
 /*
@@ -148,41 +381,65 @@ debug_setlevel_maskcopy(debug_type_t st, debug_type_t dt, debug_mask_t ma,
  * This allows for globally adding/removing flags as appropriate.
  */
 void
-debug_setlevel_mask(debug_type_t st, debug_mask_t ma, debug_mask_t mo)
+debug_instance_setlevel_mask(struct debug_instance *ds, debug_type_t st,
+    debug_mask_t ma, debug_mask_t mo)
 {
 	int i;
 	debug_mask_t m;
 
-	(void) pthread_mutex_lock(&debugInstance.debug_lock);
+	(void) pthread_mutex_lock(&ds->debug_lock);
 	for (i = 0; i < DEBUG_SECTION_MAX; i++) {
-		if (debug_level_strs[i] == NULL)
+		if (ds->level_strs[i] == NULL)
 			continue;
-		m = debug_levels[st][i];
+		m = ds->levels[st][i];
 		m &= ma;
 		m |= mo;
-		debug_levels[st][i] = m;
+		ds->levels[st][i] = m;
+		debug_levels_any_update(ds, i);
 	}
 
-	(void) pthread_mutex_unlock(&debugInstance.debug_lock);
+	(void) pthread_mutex_unlock(&ds->debug_lock);
 }
+
 void
-debug_setlevel(debug_section_t s, debug_type_t t, debug_mask_t mask)
+debug_setlevel_mask(debug_type_t st, debug_mask_t ma, debug_mask_t mo)
+{
+
+	debug_instance_setlevel_mask(&debugInstance, st, ma, mo);
+}
+void
+debug_instance_setmask(struct debug_instance *ds, debug_section_t s,
+    debug_type_t t, debug_mask_t mask)
 {
 
-	if (t >= DEBUG_TYPE_MAX)
+	if (t >= DEBUG_TYPE_MAX || s < 0 || s >= DEBUG_SECTION_MAX)
 		return;
 
 	fprintf(stderr, "%s: setting section (%d) (type %d) = mask %llx\n",
 	    __func__, s, t, (long long) mask);
-	(void) pthread_mutex_lock(&debugInstance.debug_lock);
-	debug_levels[t][s] = mask;
-	(void) pthread_mutex_unlock(&debugInstance.debug_lock);
+	(void) pthread_mutex_lock(&ds->debug_lock);
+	ds->levels[t][s] = mask;
+	debug_levels_any_update(ds, s);
+	(void) pthread_mutex_unlock(&ds->debug_lock);
 }
 
 void
-debug_set_filename(const char *filename)
+debug_setlevel(debug_section_t s, debug_type_t t, debug_mask_t mask)
+{
+
+	debug_instance_setmask(&debugInstance, s, t, mask);
+}
+
+void
+debug_setmask(debug_section_t s, debug_type_t t, debug_mask_t mask)
+{
+
+	debug_instance_setmask(&debugInstance, s, t, mask);
+}
+
+void
+debug_instance_set_filename(struct debug_instance *ds, const char *filename)
 {
-	struct debug_instance *ds = &debugInstance;
 
 	(void) pthread_mutex_lock(&ds->debug_file_lock);
 	if (ds->debug_filename != NULL)
@@ -191,23 +448,32 @@ debug_set_filename(const char *filename)
 	(void) pthread_mutex_unlock(&ds->debug_file_lock);
 }
 
+void
+debug_set_filename(const char *filename)
+{
+
+	debug_instance_set_filename(&debugInstance, filename);
+}
+
 static void
 debug_file_open_locked(struct debug_instance *ds)
 {
+	int fd;
 
-	if (ds->debug_file != NULL) {
-		fclose(ds->debug_file);
-		ds->debug_file = NULL;
+	if (ds->file_sink.fd >= 0) {
+		debug_sink_detach(&ds->file_sink);
+		debug_logfile_close(&ds->logfile);
 	}
 
 	if (ds->debug_filename == NULL)
 		return;
 
-	ds->debug_file = fopen(ds->debug_filename, "a+");
+	fd = debug_logfile_open(&ds->logfile, ds->debug_filename);
+	ds->file_sink.fd = fd;
 
-	if (ds->debug_file == NULL) {
+	if (fd < 0) {
 		/* XXX should debuglog this! */
-		fprintf(stderr, "%s: fopen failed (%s): %s\n",
+		fprintf(stderr, "%s: open failed (%s): %s\n",
 		    __func__,
 		    ds->debug_filename,
 		    strerror(errno));
@@ -218,12 +484,11 @@ static void
 debug_file_close_locked(struct debug_instance *ds)
 {
 
-	if (ds->debug_file == NULL) {
+	if (ds->file_sink.fd < 0) {
 		return;
 	}
-	fflush(ds->debug_file);
-	fclose(ds->debug_file);
-	ds->debug_file = NULL;
+	debug_sink_detach(&ds->file_sink);
+	debug_logfile_close(&ds->logfile);
 }
 
 /*
@@ -231,13 +496,19 @@ debug_file_close_locked(struct debug_instance *ds)
  * * Opening a file is a potentially blocking operation.
  */
 void
-debug_file_open(void)
+debug_instance_file_open(struct debug_instance *ds)
 {
-	struct debug_instance *ds = &debugInstance;
 
-	(void) pthread_mutex_lock(&debugInstance.debug_file_lock);
+	(void) pthread_mutex_lock(&ds->debug_file_lock);
 	debug_file_open_locked(ds);
-	(void) pthread_mutex_unlock(&debugInstance.debug_file_lock);
+	(void) pthread_mutex_unlock(&ds->debug_file_lock);
+}
+
+void
+debug_file_open(void)
+{
+
+	debug_instance_file_open(&debugInstance);
 }
 
 /*
@@ -245,13 +516,19 @@ debug_file_open(void)
  * * Closing a file is a potentially blocking operation.
  */
 void
-debug_file_close(void)
+debug_instance_file_close(struct debug_instance *ds)
 {
-	struct debug_instance *ds = &debugInstance;
 
-	(void) pthread_mutex_lock(&debugInstance.debug_file_lock);
+	(void) pthread_mutex_lock(&ds->debug_file_lock);
 	debug_file_close_locked(ds);
-	(void) pthread_mutex_unlock(&debugInstance.debug_file_lock);
+	(void) pthread_mutex_unlock(&ds->debug_file_lock);
+}
+
+void
+debug_file_close(void)
+{
+
+	debug_instance_file_close(&debugInstance);
 }
 
 /*
@@ -259,442 +536,3044 @@ debug_file_close(void)
  * * Reopening a file is a potentially blocking operation.
  */
 void
-debug_file_reopen(void)
+debug_instance_file_reopen(struct debug_instance *ds)
 {
-	struct debug_instance *ds = &debugInstance;
 
-	(void) pthread_mutex_lock(&debugInstance.debug_file_lock);
+	(void) pthread_mutex_lock(&ds->debug_file_lock);
 	debug_file_close_locked(ds);
 	debug_file_open_locked(ds);
-	(void) pthread_mutex_unlock(&debugInstance.debug_file_lock);
+	(void) pthread_mutex_unlock(&ds->debug_file_lock);
 }
 
-/*
- * Create a debug entry to put debug contents in before queuing.
- * This will always attempt to allocate; it's up to the caller
- * to rate limit for now.
- *
- * This happens with no locks held, for the above reason.
- */
-static struct debug_entry *
-debug_entry_create(void)
+void
+debug_file_reopen(void)
 {
-	struct debug_entry *d;
 
-	d = malloc(sizeof(*d));
-	if (d == NULL) {
-		return (NULL);
-	}
-	bzero(&d->e, sizeof(d->e));
-	return (d);
+	debug_instance_file_reopen(&debugInstance);
+}
+
+static inline void
+debug_counter_inc(atomic_uint_fast64_t *c)
+{
+
+	/* Only the owning thread writes these, so no need for an RMW */
+	atomic_store_explicit(c,
+	    atomic_load_explicit(c, memory_order_relaxed) + 1,
+	    memory_order_relaxed);
+}
+
+static inline uint64_t
+debug_clock_read(const struct debug_clock *c)
+{
+
+	if (c->type == DEBUG_CLOCK_TSC)
+		return (OS_tsc_read());
+	return (OS_clock_gettime_ns(c->clk_id));
+}
+
+static inline struct debug_rec *
+debug_ring_rec(struct debug_thread *dt, unsigned int idx)
+{
+
+	return ((struct debug_rec *) (dt->ring + (idx & dt->ring_mask)));
 }
 
 /*
- * Free a debug entry that has already been consumed from
- * whichever list owns it.
+ * Free any heap spill buffer hanging off of a ring record.
  */
 static void
-debug_entry_free(struct debug_entry *d)
+debug_rec_free_spill(struct debug_rec *r)
 {
+	char *p;
 
-	free(d);
+	if (r->type != DEBUG_REC_SPILL)
+		return;
+	memcpy(&p, r->buf, sizeof(p));
+	free(p);
 }
 
 /*
- * Queue a debug entry.  This will always succeed.
- *
- * The lock must be held.
+ * Called via the pthread key destructor when a thread which has
+ * logged exits.  The ring can't be freed here as there may still
+ * be entries on it; the logger thread reaps it once it's empty.
  */
 static void
-debug_entry_queue_locked(struct debug_instance *ds, struct debug_entry *de)
+debug_thread_exit(void *arg)
 {
+	struct debug_thread *dt = arg;
 
-	TAILQ_INSERT_TAIL(&ds->list, de, e);
-	ds->nitems++;
+	atomic_store_explicit(&dt->dead, 1, memory_order_release);
 }
 
-#if 0
 /*
- * Dequeue a debug entry.  This will either succeed or return
- * NULL if there are no entries.
+ * Allocate and register a ring for the calling thread.
  *
- * The lock must be held.
+ * This is the only part of the enqueue path which takes a lock and
+ * it's only done once per thread.
  */
-static struct debug_entry *
-debug_entry_dequeue_locked(struct debug_instance *ds)
+static struct debug_thread *
+debug_thread_register(struct debug_instance *ds)
 {
-	struct debug_entry *de;
+	struct debug_thread *dt;
+	unsigned int n;
 
-	de = TAILQ_FIRST(&ds->list);
-	if (de == NULL)
+	if (posix_memalign((void **) &dt, DEBUG_CACHELINE_SIZE,
+	    sizeof(*dt)) != 0)
+		return (NULL);
+	bzero(dt, sizeof(*dt));
+
+	/* Round the byte limit up to a power of two */
+	for (n = DEBUG_RING_MIN_SIZE; n < ds->debug_queue_limit_bytes &&
+	    n < DEBUG_RING_MAX_SIZE; n <<= 1)
+		;
+	if (posix_memalign((void **) &dt->ring, DEBUG_CACHELINE_SIZE,
+	    n) != 0) {
+		free(dt);
 		return (NULL);
-	TAILQ_REMOVE(&ds->list, de, e);
-	ds->nitems--;
-	return (de);
+	}
+	dt->ring_size = n;
+	dt->ring_mask = n - 1;
+	dt->ds = ds;
+	dt->gen = ds->gen;
+
+	(void) pthread_mutex_lock(&ds->debug_thread_lock);
+	TAILQ_INSERT_TAIL(&ds->threads, dt, t);
+	(void) pthread_mutex_unlock(&ds->debug_thread_lock);
+
+	(void) pthread_setspecific(ds->debug_thread_key, dt);
+	debug_crash_thread_init();
+	debug_thr_self = dt;
+	debug_thr_self_gen = ds->gen;
+	return (dt);
 }
-#endif
 
-/*
- * This is a very racy check.  Later on it should turn into
- * a "reserve" API and a "queue" API so we can do lock-free
- * atomic debug queue list reservations before we grab the
- * lock to queue it.
- */
-static int
-debug_instance_can_queue(struct debug_instance *ds)
+static inline struct debug_thread *
+debug_thread_get(struct debug_instance *ds)
 {
+	struct debug_thread *dt;
 
-	if (ds->nitems > ds->debug_queue_limit)
-		return (0);
-	return (1);
+	if (debug_thr_self_gen == ds->gen)
+		return (debug_thr_self);
+
+	/* Switching instances; this thread may already have a ring */
+	dt = pthread_getspecific(ds->debug_thread_key);
+	if (dt != NULL && dt->gen == ds->gen) {
+		debug_thr_self = dt;
+		debug_thr_self_gen = ds->gen;
+		return (dt);
+	}
+	return (debug_thread_register(ds));
 }
 
 /*
- * Do an instance of writing a log entry.
- *
- * This for now does flushing but that kills performance!
- * Just keep that in mind!
- *
- * Return a bitmask showing which particular output streams
- * were written to, so appropriate flushing can occur.
+ * Free a thread ring.
  *
- * This must be called with the file_lock held.
+ * This is called by the logger thread (or at shutdown) once the
+ * owning thread has gone away.
  */
-static int
-debug_instance_log_entry_locked(struct debug_instance *ds, struct debug_entry *de)
+static void
+debug_thread_free(struct debug_instance *ds, struct debug_thread *dt)
 {
-	struct tm t, *tp;
-	time_t tt;
-	char tbuf[128];
-	char buf[128];
-	int ret = 0;
+	struct debug_rec *r;
+	unsigned int h, t;
+
+	/* Anything left over was never logged */
+	h = atomic_load_explicit(&dt->ring_head, memory_order_relaxed);
+	t = atomic_load_explicit(&dt->ring_tail, memory_order_acquire);
+	for (; h != t; h += r->len) {
+		r = debug_ring_rec(dt, h);
+		debug_rec_free_spill(r);
+	}
 
-	/* Generate debug timestamp string */
-	tt = de->tv.tv_sec;
-	tp = localtime_r(&tt, &t);
+	ds->retired_inline += atomic_load_explicit(&dt->nrec_inline,
+	    memory_order_relaxed);
+	ds->retired_spill += atomic_load_explicit(&dt->nrec_spill,
+	    memory_order_relaxed);
 
-	/* Normal HMS string */
-	strftime(buf, 128, "%Y-%m-%d %H:%M:%S", tp);
-	snprintf(tbuf, 128, "%s (%llu.%06llu)| ",
-	    buf,
-	    (unsigned long long) de->tv.tv_sec,
-	    (unsigned long long) de->tv.tv_usec);
+	free(dt->ring);
+	free(dt);
+}
 
-	/*
-	 * Ok, now that it's done, we can figure out where to
-	 * write it to.
-	 */
-	if (debug_levels[DEBUG_TYPE_PRINT][de->debug_section] & de->debug_mask) {
-		fprintf(stderr, "%s%s", tbuf, de->buf);
-		ret |= 1 << DEBUG_TYPE_PRINT;
-	}
-	if (ds->debug_file != NULL &&
-	    debug_levels[DEBUG_TYPE_LOG][de->debug_section] & de->debug_mask) {
-		fprintf(ds->debug_file, "%s%s", tbuf, de->buf);
-		ret |= 1 << DEBUG_TYPE_LOG;
-	}
-	if (ds->debug_syslog_enable == 1 &&
-	    debug_levels[DEBUG_TYPE_SYSLOG][de->debug_section] & de->debug_mask) {
-		/* XXX TODO should map these levels into syslog levels */
-		/* XXX TODO: syslog facility name, etc, etc */
-		syslog(LOG_DEBUG, "%s%s", tbuf, de->buf);
-		ret |= 1 << DEBUG_TYPE_SYSLOG;
-	}
+static inline void
+debug_drop_count(struct debug_instance *ds, debug_section_t section)
+{
 
-	return (ret);
+	if (section >= 0 && section < DEBUG_SECTION_MAX)
+		atomic_fetch_add_explicit(&ds->debug_drops[section], 1,
+		    memory_order_relaxed);
 }
 
+/*
+ * Move the ring head forward to the given index, unless it's
+ * already past it.  Both the logger and (when stealing) the
+ * producer do this.
+ */
 static void
-debug_instance_flush_locked(struct debug_instance *ds, int v)
+debug_ring_head_advance(struct debug_thread *dt, unsigned int to)
 {
+	unsigned int h;
 
-	/* XXX TODO: Yes, should delay this all.. */
-	if (v & (1 << DEBUG_TYPE_PRINT))
-		fflush(stderr);
-	if (v & (1 << DEBUG_TYPE_LOG))
-		fflush(ds->debug_file);
-
+	h = atomic_load_explicit(&dt->ring_head, memory_order_relaxed);
+	while ((int) (to - h) > 0 &&
+	    ! atomic_compare_exchange_weak_explicit(&dt->ring_head, &h, to,
+	    memory_order_release, memory_order_relaxed))
+		;
 }
 
 /*
- * Called to do actual debugging.
- *
- * The macro hilarity is done so that the arguments to the debug
- * statement aren't actually evaluated unless the debugging level
- * is matched.
+ * Is the ring still full?  need is the tail index the pending
+ * reservation needs, or 0 for the entry limit.
  */
-void
-do_debug(int section, debug_mask_t mask, const char *fmt, ...)
+static int
+debug_ring_full(struct debug_instance *ds, struct debug_thread *dt,
+    unsigned int need)
 {
-	va_list ap;
-	struct timeval tv;
-	struct debug_instance *ds = &debugInstance;
-	struct debug_entry *de;
+	unsigned int n;
 
-	/* XXX TODO: should log/count messages we've missed */
-	if (! debug_instance_can_queue(ds)) {
-		return;
+	if (need != 0) {
+		dt->ring_head_cache = atomic_load_explicit(&dt->ring_head,
+		    memory_order_acquire);
+		return (need - dt->ring_head_cache > dt->ring_size);
 	}
+	dt->nrec_head_cache = atomic_load_explicit(&dt->nrec_head,
+	    memory_order_acquire);
+	n = atomic_load_explicit(&dt->nrec_tail, memory_order_relaxed) -
+	    dt->nrec_head_cache -
+	    atomic_load_explicit(&dt->nrec_stolen, memory_order_relaxed);
+	return (n >= (unsigned int) atomic_load_explicit(&ds->debug_queue_limit,
+	    memory_order_relaxed));
+}
+
+/*
+ * DEBUG_OVERFLOW_DROP_OLDEST: throw away the oldest record the
+ * logger hasn't claimed.
+ *
+ * The space only comes back straight away if the logger isn't
+ * holding any of this ring's records; if it is, it'll be along
+ * shortly to free it, so the new message is dropped instead.
+ *
+ * Returns 0 if space was freed, -1 if not.
+ */
+static int
+debug_ring_steal(struct debug_instance *ds, struct debug_thread *dt)
+{
+	struct debug_rec *r;
+	unsigned int c, t;
 
-	/* Get wall clock timestamp */
-	(void) gettimeofday(&tv, NULL);
+	if (atomic_load_explicit(&dt->held, memory_order_seq_cst))
+		return (-1);
 
-	de = debug_entry_create();
-	if (de == NULL) {
-		/* XXX TODO: statistics */
-		return;
+	t = atomic_load_explicit(&dt->ring_tail, memory_order_relaxed);
+	c = atomic_load_explicit(&dt->ring_claim, memory_order_acquire);
+	do {
+		if (c == t)
+			return (-1);
+		r = debug_ring_rec(dt, c);
+	} while (! atomic_compare_exchange_strong_explicit(&dt->ring_claim,
+	    &c, c + r->len, memory_order_seq_cst, memory_order_acquire));
+
+	if (r->type != DEBUG_REC_PAD) {
+		debug_rec_free_spill(r);
+		debug_drop_count(ds, r->debug_section);
+		atomic_store_explicit(&dt->nrec_stolen,
+		    atomic_load_explicit(&dt->nrec_stolen,
+		    memory_order_relaxed) + 1, memory_order_relaxed);
+		/* So anything walking from the head skips it */
+		r->type = DEBUG_REC_PAD;
 	}
 
-	/* Log the message itself */
-	va_start(ap, fmt);
-	vsnprintf(de->buf, 512, fmt, ap);
-	va_end(ap);
+	/*
+	 * This pairs with the logger setting held before claiming;
+	 * if it's still clear then nothing before us is in use.
+	 */
+	if (atomic_load_explicit(&dt->held, memory_order_seq_cst))
+		return (-1);
+	debug_ring_head_advance(dt, c + r->len);
+	return (0);
+}
 
-	de->tv = tv;
+/*
+ * DEBUG_OVERFLOW_BLOCK: wait for the logger to free up some space,
+ * up to the overflow timeout for this message.
+ *
+ * Returns 0 to try again, -1 on timeout.
+ */
+static int
+debug_ring_wait(struct debug_instance *ds, struct debug_thread *dt,
+    unsigned int need)
+{
+	unsigned int ms;
+	int ret = 0;
 
-	/* XXX TODO: bounds check these */
-	de->debug_section = section;
-	de->debug_mask = mask;
+	if (! dt->wait_deadline_set) {
+		ms = ds->debug_overflow_timeout_ms;
+		clock_gettime(CLOCK_REALTIME, &dt->wait_deadline);
+		dt->wait_deadline.tv_sec += ms / 1000;
+		dt->wait_deadline.tv_nsec += (ms % 1000) * 1000000L;
+		if (dt->wait_deadline.tv_nsec >= 1000000000L) {
+			dt->wait_deadline.tv_sec++;
+			dt->wait_deadline.tv_nsec -= 1000000000L;
+		}
+		dt->wait_deadline_set = 1;
+	}
 
-	/* Queue entry, wakeup worker thread */
-	/* XXX TODO: yes, methodize this */
 	(void) pthread_mutex_lock(&ds->debug_lock);
-	debug_entry_queue_locked(ds, de);
+	atomic_fetch_add_explicit(&ds->space_waiters, 1, memory_order_seq_cst);
 	pthread_cond_signal(&ds->log_cond);
+	if (debug_ring_full(ds, dt, need))
+		ret = pthread_cond_timedwait(&ds->space_cond, &ds->debug_lock,
+		    &dt->wait_deadline);
+	atomic_fetch_sub_explicit(&ds->space_waiters, 1, memory_order_relaxed);
 	(void) pthread_mutex_unlock(&ds->debug_lock);
+
+	return (ret == ETIMEDOUT ? -1 : 0);
 }
 
 /*
- * debugging - warn() wrapper.
+ * The ring is full; try to make room according to the overflow
+ * policy.  Returns 0 to try again, -1 to give up on the message.
  */
-void
-do_debug_warn(int section, int xerrno, const char *fmt, ...)
+static int
+debug_ring_overflow(struct debug_instance *ds, struct debug_thread *dt,
+    unsigned int need)
 {
-	va_list ap;
-	struct timeval tv;
-	char buf[512];
-	debug_mask_t mask = DEBUG_LVL_ERR | DEBUG_LVL_CRIT;
-	struct debug_instance *ds = &debugInstance;
-	struct debug_entry *de;
 
-	/* XXX TODO: should log/count messages we've missed */
-	if (! debug_instance_can_queue(ds)) {
+	switch (ds->debug_overflow_policy) {
+	case DEBUG_OVERFLOW_DROP_OLDEST:
+		return (debug_ring_steal(ds, dt));
+	case DEBUG_OVERFLOW_BLOCK:
+		return (debug_ring_wait(ds, dt, need));
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * Check whether the given thread ring is under its entry limit,
+ * applying the overflow policy if it isn't.
+ *
+ * Only the producer calls this.  The cached head is only refreshed
+ * from the consumer's cache line when the ring looks full.
+ */
+static int
+debug_instance_can_queue(struct debug_instance *ds, struct debug_thread *dt)
+{
+	unsigned int t;
+
+	t = atomic_load_explicit(&dt->nrec_tail, memory_order_relaxed) -
+	    atomic_load_explicit(&dt->nrec_stolen, memory_order_relaxed);
+	if (t - dt->nrec_head_cache < (unsigned int)
+	    atomic_load_explicit(&ds->debug_queue_limit, memory_order_relaxed))
+		return (1);
+	while (debug_ring_full(ds, dt, 0)) {
+		if (debug_ring_overflow(ds, dt, 0) < 0)
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Reserve space for a record of the given length on the calling
+ * thread's ring.
+ *
+ * Records never wrap; if there isn't enough contiguous space at the
+ * end of the ring a pad record is put there and the record starts
+ * back at the beginning.
+ *
+ * Returns NULL if the ring doesn't have enough free space, once the
+ * overflow policy has had its go.
+ */
+static struct debug_rec *
+debug_ring_reserve(struct debug_instance *ds, struct debug_thread *dt,
+    unsigned int len)
+{
+	struct debug_rec *r;
+	unsigned int t, pad;
+
+	len = (len + DEBUG_REC_ALIGN - 1) & ~(DEBUG_REC_ALIGN - 1);
+
+	t = atomic_load_explicit(&dt->ring_tail, memory_order_relaxed);
+	pad = dt->ring_size - (t & dt->ring_mask);
+	if (pad >= len)
+		pad = 0;
+
+	if (t + pad + len - dt->ring_head_cache > dt->ring_size) {
+		while (debug_ring_full(ds, dt, t + pad + len)) {
+			if (debug_ring_overflow(ds, dt, t + pad + len) < 0)
+				return (NULL);
+		}
+	}
+
+	if (pad != 0) {
+		r = debug_ring_rec(dt, t);
+		r->len = pad;
+		r->type = DEBUG_REC_PAD;
+		t += pad;
+	}
+
+	r = debug_ring_rec(dt, t);
+	r->len = len;
+	r->flags = 0;
+	dt->ring_tail_next = t + len;
+	return (r);
+}
+
+/*
+ * Publish the record reserved by debug_ring_reserve() and wake up
+ * the logger thread if it's asleep.
+ */
+static void
+debug_ring_commit(struct debug_instance *ds, struct debug_thread *dt)
+{
+
+	atomic_store_explicit(&dt->nrec_tail,
+	    atomic_load_explicit(&dt->nrec_tail, memory_order_relaxed) + 1,
+	    memory_order_relaxed);
+
+	/*
+	 * This pairs with the logger setting debug_thr_sleeping and then
+	 * checking the rings; one of us is guaranteed to see the other.
+	 */
+	atomic_store_explicit(&dt->ring_tail, dt->ring_tail_next,
+	    memory_order_seq_cst);
+	if (atomic_load_explicit(&ds->debug_thr_sleeping,
+	    memory_order_seq_cst) == 0)
+		return;
+
+	(void) pthread_mutex_lock(&ds->debug_lock);
+	pthread_cond_signal(&ds->log_cond);
+	(void) pthread_mutex_unlock(&ds->debug_lock);
+}
+
+/*
+ * Format a message into buf if it fits, otherwise into a heap
+ * buffer which is large enough for the whole message.
+ *
+ * Returns the buffer used and the formatted length in *lenp,
+ * or NULL on a formatting error.
+ */
+static char *
+debug_vformat(char *buf, size_t buflen, int *lenp, const char *fmt,
+    va_list ap)
+{
+	va_list aq;
+	char *p;
+	int n;
+
+	va_copy(aq, ap);
+	n = vsnprintf(buf, buflen, fmt, aq);
+	va_end(aq);
+	if (n < 0)
+		return (NULL);
+	if ((size_t) n < buflen) {
+		*lenp = n;
+		return (buf);
+	}
+
+	p = malloc(n + 1);
+	if (p == NULL) {
+		/* Better a truncated message than none at all */
+		*lenp = buflen - 1;
+		return (buf);
+	}
+	vsnprintf(p, n + 1, fmt, ap);
+	*lenp = n;
+	return (p);
+}
+
+static char *
+debug_format(char *buf, size_t buflen, int *lenp, const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+
+	va_start(ap, fmt);
+	p = debug_vformat(buf, buflen, lenp, fmt, ap);
+	va_end(ap);
+	return (p);
+}
+
+/*
+ * Queue a formatted message on the calling thread's ring.
+ *
+ * Messages which fit are copied into the ring.  Oversized ones
+ * are queued as a spill record pointing at the heap buffer, which
+ * is then owned by the ring; msg must be a heap buffer in that case.
+ */
+static void
+debug_entry_queue(struct debug_instance *ds, struct debug_thread *dt,
+    uint64_t ts, debug_section_t section, debug_mask_t mask,
+    char *msg, int len, int msg_is_heap, int written)
+{
+	struct debug_rec *r;
+
+	if (sizeof(*r) + len + 1 <= dt->ring_size / DEBUG_RING_INLINE_DIV) {
+		r = debug_ring_reserve(ds, dt, sizeof(*r) + len + 1);
+		if (r == NULL)
+			goto drop;
+		r->type = DEBUG_REC_TEXT;
+		memcpy(r->buf, msg, len);
+		r->buf[len] = '\0';
+		if (msg_is_heap)
+			free(msg);
+		debug_counter_inc(&dt->nrec_inline);
+	} else {
+		/* Only heap buffers can get this large */
+		r = debug_ring_reserve(ds, dt, sizeof(*r) + sizeof(msg));
+		if (r == NULL)
+			goto drop;
+		r->type = DEBUG_REC_SPILL;
+		memcpy(r->buf, &msg, sizeof(msg));
+		debug_counter_inc(&dt->nrec_spill);
+	}
+
+	r->flags = written;
+	r->msglen = len;
+	r->ts = ts;
+	/* XXX TODO: bounds check these */
+	r->debug_section = section;
+	r->debug_mask = mask;
+
+	debug_ring_commit(ds, dt);
+	return;
+
+drop:
+	if (ds->debug_overflow_policy == DEBUG_OVERFLOW_SYNC)
+		debug_instance_log_sync(ds, section, mask, msg, len, written,
+		    0);
+	else if (written == 0)
+		debug_drop_count(ds, section);
+	if (msg_is_heap)
+		free(msg);
+}
+
+/*
+ * Order staged entries by timestamp, falling back to the order
+ * they were staged in so per-thread ordering is kept.
+ */
+static int
+debug_entry_cmp(const void *a, const void *b)
+{
+	const struct debug_entry *da = a, *db = b;
+
+	if (da->ts != db->ts)
+		return (da->ts < db->ts ? -1 : 1);
+	return (da->seq < db->seq ? -1 : (da->seq > db->seq));
+}
+
+/*
+ * Queue a deferred-format record for already captured arguments.
+ *
+ * Returns -1 if the record is too big for the ring, in which case the
+ * caller should format it itself.  A full ring counts as queued (and
+ * dropped) unless the overflow policy is DEBUG_OVERFLOW_SYNC, in which
+ * case the caller formats and writes it.
+ */
+static int
+debug_entry_queue_args(struct debug_instance *ds, struct debug_thread *dt,
+    uint64_t ts, debug_section_t section, debug_mask_t mask,
+    int xerrno, const char *fmt, const char *args, size_t n)
+{
+	struct debug_rec_deferred *d;
+	struct debug_rec *r;
+
+	if (sizeof(*r) + sizeof(*d) + n >
+	    dt->ring_size / DEBUG_RING_INLINE_DIV)
+		return (-1);
+	r = debug_ring_reserve(ds, dt, sizeof(*r) + sizeof(*d) + n);
+	if (r == NULL) {
+		if (ds->debug_overflow_policy == DEBUG_OVERFLOW_SYNC)
+			return (-1);
+		debug_drop_count(ds, section);
+		return (0);
+	}
+	r->type = DEBUG_REC_DEFERRED;
+	r->msglen = n;
+	r->ts = ts;
+	r->debug_section = section;
+	r->debug_mask = mask;
+	d = (struct debug_rec_deferred *) r->buf;
+	d->fmt = fmt;
+	d->xerrno = xerrno;
+	memcpy(d->args, args, n);
+	debug_counter_inc(&dt->nrec_inline);
+
+	debug_ring_commit(ds, dt);
+	return (0);
+}
+
+/*
+ * Queue a deferred-format record; only the format pointer, the
+ * timestamp and the raw arguments are copied.
+ *
+ * Returns -1 if the format can't be deferred, in which case the
+ * caller should format it itself; otherwise as for
+ * debug_entry_queue_args().
+ */
+static int
+debug_entry_queue_deferred(struct debug_instance *ds, struct debug_thread *dt,
+    uint64_t ts, debug_section_t section, debug_mask_t mask,
+    int xerrno, const char *fmt, va_list ap)
+{
+	char abuf[DEBUG_FORMAT_BUF_SIZE];
+	va_list aq;
+	int n;
+
+	va_copy(aq, ap);
+	n = debug_fmt_capture(abuf, sizeof(abuf), fmt, aq);
+	va_end(aq);
+	if (n < 0)
+		return (-1);
+	return (debug_entry_queue_args(ds, dt, ts, section, mask, xerrno,
+	    fmt, abuf, n));
+}
+
+/*
+ * Queue an encoded DEBUG_KV() line, args/len as from debug_kv_encode().
+ * Like debug_entry_queue(), lines which are too big for the ring are
+ * queued as a spill record pointing at args, which must then be a heap
+ * buffer and is owned by the ring; the record is flagged so the logger
+ * knows to render it.
+ */
+static void
+debug_entry_queue_kv(struct debug_instance *ds, struct debug_thread *dt,
+    uint64_t ts, debug_section_t section, debug_mask_t mask,
+    char *args, int len, int args_is_heap, int written)
+{
+	struct debug_fmt_buf fb = { NULL, 0, 0 };
+	struct debug_rec *r;
+	int json;
+
+	if (sizeof(*r) + len <= dt->ring_size / DEBUG_RING_INLINE_DIV) {
+		r = debug_ring_reserve(ds, dt, sizeof(*r) + len);
+		if (r == NULL)
+			goto drop;
+		r->type = DEBUG_REC_KV;
+		memcpy(r->buf, args, len);
+		if (args_is_heap)
+			free(args);
+		r->flags = written;
+		debug_counter_inc(&dt->nrec_inline);
+	} else {
+		r = debug_ring_reserve(ds, dt, sizeof(*r) + sizeof(args));
+		if (r == NULL)
+			goto drop;
+		r->type = DEBUG_REC_SPILL;
+		memcpy(r->buf, &args, sizeof(args));
+		r->flags = written | DEBUG_REC_F_KV;
+		debug_counter_inc(&dt->nrec_spill);
+	}
+
+	r->msglen = len;
+	r->ts = ts;
+	r->debug_section = section;
+	r->debug_mask = mask;
+
+	debug_ring_commit(ds, dt);
+	return;
+
+drop:
+	if (ds->debug_overflow_policy == DEBUG_OVERFLOW_SYNC) {
+		json = ds->debug_output_format == DEBUG_OUTPUT_JSON;
+		if (debug_kv_render(&fb, args, len, json) == 0)
+			debug_instance_log_sync(ds, section, mask, fb.buf,
+			    fb.len, written, json);
+		free(fb.buf);
+	} else if (written == 0)
+		debug_drop_count(ds, section);
+	if (args_is_heap)
+		free(args);
+}
+
+/*
+ * Grab the next free slot in the staging array.
+ */
+static struct debug_entry *
+debug_instance_stage(struct debug_instance *ds)
+{
+	struct debug_entry *n;
+	int sz;
+
+	if (ds->nstaging == ds->staging_size) {
+		sz = ds->staging_size ? ds->staging_size * 2 :
+		    DEBUG_STAGING_INIT_SIZE;
+		n = realloc(ds->staging, sz * sizeof(*n));
+		if (n == NULL)
+			return (NULL);
+		ds->staging = n;
+		ds->staging_size = sz;
+	}
+	n = &ds->staging[ds->nstaging];
+	n->seq = ds->nstaging++;
+	n->fmt = NULL;
+	n->kv = 0;
+	n->written = 0;
+	return (n);
+}
+
+/*
+ * Walk the per-thread rings and build the staging array of entries
+ * pointing at the queued records.  The records stay on the rings
+ * until debug_instance_release() is called.
+ *
+ * Each ring's pending records are claimed by moving ring_claim up
+ * to the tail, so an overwriting producer can't steal them from
+ * under us.
+ *
+ * Returns the number of entries staged.
+ */
+static int
+debug_instance_drain(struct debug_instance *ds)
+{
+	struct debug_thread *dt;
+	struct debug_entry *de;
+	struct debug_rec *r;
+	unsigned int c, t;
+
+	ds->nstaging = 0;
+
+	(void) pthread_mutex_lock(&ds->debug_thread_lock);
+	TAILQ_FOREACH(dt, &ds->threads, t) {
+		dt->drain_nrec = 0;
+		if (atomic_load_explicit(&dt->ring_claim, memory_order_relaxed) ==
+		    atomic_load_explicit(&dt->ring_tail, memory_order_relaxed))
+			continue;
+
+		/*
+		 * This pairs with debug_ring_steal().  The tail is
+		 * reloaded each time around as the producer may have
+		 * stolen past the one we saw.
+		 */
+		atomic_store_explicit(&dt->held, 1, memory_order_seq_cst);
+		c = atomic_load_explicit(&dt->ring_claim, memory_order_acquire);
+		do {
+			t = atomic_load_explicit(&dt->ring_tail,
+			    memory_order_acquire);
+		} while (c != t &&
+		    ! atomic_compare_exchange_weak_explicit(&dt->ring_claim,
+		    &c, t, memory_order_seq_cst, memory_order_acquire));
+		dt->drain_start = c;
+		dt->drain_head = t;
+
+		for (; c != t; c += r->len) {
+			r = debug_ring_rec(dt, c);
+			if (r->type == DEBUG_REC_PAD)
+				continue;
+			dt->drain_nrec++;
+
+			de = debug_instance_stage(ds);
+			if (de == NULL) {
+				debug_drop_count(ds, r->debug_section);
+				continue;
+			}
+			de->ts = debug_clock_to_ns(&ds->clock, r->ts);
+			de->debug_section = r->debug_section;
+			de->debug_mask = r->debug_mask;
+			de->len = r->msglen;
+			de->written = r->flags & ~DEBUG_REC_F_KV;
+			if (r->type == DEBUG_REC_SPILL &&
+			    (r->flags & DEBUG_REC_F_KV)) {
+				de->buf = NULL;
+				memcpy(&de->args, r->buf, sizeof(de->args));
+				de->kv = 1;
+			} else if (r->type == DEBUG_REC_SPILL) {
+				memcpy(&de->buf, r->buf, sizeof(de->buf));
+			} else if (r->type == DEBUG_REC_DEFERRED) {
+				de->buf = NULL;
+				de->fmt = ((struct debug_rec_deferred *)
+				    r->buf)->fmt;
+				de->args = ((struct debug_rec_deferred *)
+				    r->buf)->args;
+				de->xerrno = ((struct debug_rec_deferred *)
+				    r->buf)->xerrno;
+			} else if (r->type == DEBUG_REC_KV) {
+				de->buf = NULL;
+				de->args = r->buf;
+				de->kv = 1;
+			} else {
+				de->buf = r->buf;
+			}
+		}
+		if (dt->drain_nrec > ds->stat_depth_max)
+			ds->stat_depth_max = dt->drain_nrec;
+	}
+	(void) pthread_mutex_unlock(&ds->debug_thread_lock);
+
+	if (ds->nstaging > 1)
+		qsort(ds->staging, ds->nstaging, sizeof(struct debug_entry),
+		    debug_entry_cmp);
+
+	return (ds->nstaging);
+}
+
+/*
+ * Queue a "messages dropped" line for each section which has had
+ * any since the last report, and a "messages suppressed" line for
+ * each rate limited or sampled call site.  These go on the end of
+ * the staging array, pointing at drop_buf.
+ *
+ * Returns the number of entries added.
+ */
+static int
+debug_instance_report_drops(struct debug_instance *ds)
+{
+	struct debug_fmt_buf *fb = &ds->drop_buf;
+	struct debug_ratelimit *rl;
+	struct debug_entry *de;
+	uint64_t n, now, ns;
+	int i, first, nrep = 0;
+
+	now = debug_sink_now_ms();
+	if (now - ds->drop_report_ms < DEBUG_DROP_REPORT_MS)
+		return (0);
+	ds->drop_report_ms = now;
+
+	fb->len = 0;
+	first = ds->nstaging;
+	ns = OS_clock_gettime_ns(OS_CLOCK_REALTIME);
+	for (i = 0; i < DEBUG_SECTION_MAX; i++) {
+		if (atomic_load_explicit(&ds->debug_drops[i],
+		    memory_order_relaxed) == 0)
+			continue;
+		de = debug_instance_stage(ds);
+		if (de == NULL)
+			break;
+		n = atomic_exchange_explicit(&ds->debug_drops[i], 0,
+		    memory_order_relaxed);
+		atomic_fetch_add_explicit(&ds->stat_dropped, n,
+		    memory_order_relaxed);
+		de->ts = ns;
+		de->debug_section = i;
+		/* Goes wherever the section logs anything at all */
+		de->debug_mask = DEBUG_MASK_ALL;
+		de->buf = NULL;
+		de->buf_off = fb->len;
+		(void) debug_fmt_buf_printf(fb,
+		    "libdebug: %llu messages dropped in section %s\n",
+		    (unsigned long long) n,
+		    ds->level_strs[i] != NULL ? ds->level_strs[i] : "?");
+		de->len = fb->len - de->buf_off;
+		nrep++;
+	}
+
+	/* Rate limited call sites only ever log to the default instance */
+	if (ds != &debugInstance)
+		goto done;
+
+	/*
+	 * Clear the active flag before collecting the counts; a site
+	 * which suppresses after its count is taken sets it again.
+	 */
+	__atomic_store_n(&debug_ratelimit_active, 0, __ATOMIC_SEQ_CST);
+	rl = __atomic_load_n(&debug_ratelimit_sites, __ATOMIC_ACQUIRE);
+	for (; rl != NULL; rl = rl->next) {
+		if (__atomic_load_n(&rl->suppressed, __ATOMIC_RELAXED) == 0)
+			continue;
+		__atomic_store_n(&debug_ratelimit_active, 1, __ATOMIC_RELAXED);
+		de = debug_instance_stage(ds);
+		if (de == NULL)
+			break;
+		n = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+		de->ts = ns;
+		de->debug_section = __atomic_load_n(&rl->section,
+		    __ATOMIC_RELAXED);
+		de->debug_mask = DEBUG_MASK_ALL;
+		de->buf = NULL;
+		de->buf_off = fb->len;
+		(void) debug_fmt_buf_printf(fb,
+		    "libdebug: %llu messages suppressed at %s:%d\n",
+		    (unsigned long long) n, rl->file, rl->line);
+		de->len = fb->len - de->buf_off;
+		nrep++;
+	}
+
+done:
+	/* drop_buf has stopped moving now */
+	for (i = first; i < ds->nstaging; i++)
+		ds->staging[i].buf = fb->buf + ds->staging[i].buf_off;
+	return (nrep);
+}
+
+/*
+ * Hand the space used by the staged entries back to the producers
+ * and reap the rings of threads which have exited.
+ */
+static void
+debug_instance_release(struct debug_instance *ds)
+{
+	struct debug_thread *dt, *dt_next;
+	struct debug_rec *r;
+	unsigned int h, c;
+
+	(void) pthread_mutex_lock(&ds->debug_thread_lock);
+	for (dt = TAILQ_FIRST(&ds->threads); dt != NULL; dt = dt_next) {
+		dt_next = TAILQ_NEXT(dt, t);
+
+		/* Threads registered since the drain have nothing staged */
+		if (atomic_load_explicit(&dt->held, memory_order_relaxed)) {
+			for (h = dt->drain_start; h != dt->drain_head;
+			    h += r->len) {
+				r = debug_ring_rec(dt, h);
+				debug_rec_free_spill(r);
+			}
+			atomic_store_explicit(&dt->nrec_head,
+			    atomic_load_explicit(&dt->nrec_head,
+			    memory_order_relaxed) + dt->drain_nrec,
+			    memory_order_release);
+			dt->drain_nrec = 0;
+		}
+
+		/*
+		 * Everything before the claim index is now either logged
+		 * or was stolen by the producer, so it can all go.
+		 */
+		c = atomic_load_explicit(&dt->ring_claim, memory_order_acquire);
+		debug_ring_head_advance(dt, c);
+		atomic_store_explicit(&dt->held, 0, memory_order_seq_cst);
+
+		/*
+		 * The thread has gone away; if it's empty now then
+		 * nothing else will ever be queued on it.
+		 */
+		if (atomic_load_explicit(&dt->dead, memory_order_acquire) &&
+		    atomic_load_explicit(&dt->ring_tail,
+		    memory_order_acquire) == c) {
+			TAILQ_REMOVE(&ds->threads, dt, t);
+			debug_thread_free(ds, dt);
+		}
+	}
+	(void) pthread_mutex_unlock(&ds->debug_thread_lock);
+
+	/* Let any producers blocked on a full ring know there's space */
+	if (atomic_load_explicit(&ds->space_waiters, memory_order_seq_cst)) {
+		(void) pthread_mutex_lock(&ds->debug_lock);
+		pthread_cond_broadcast(&ds->space_cond);
+		(void) pthread_mutex_unlock(&ds->debug_lock);
+	}
+}
+
+/*
+ * Returns whether any thread ring has pending entries.
+ */
+static int
+debug_instance_pending(struct debug_instance *ds)
+{
+	struct debug_thread *dt;
+	int r = 0;
+
+	(void) pthread_mutex_lock(&ds->debug_thread_lock);
+	TAILQ_FOREACH(dt, &ds->threads, t) {
+		if (atomic_load_explicit(&dt->ring_claim, memory_order_relaxed) !=
+		    atomic_load_explicit(&dt->ring_tail, memory_order_seq_cst)) {
+			r = 1;
+			break;
+		}
+	}
+	(void) pthread_mutex_unlock(&ds->debug_thread_lock);
+
+	return (r);
+}
+
+/*
+ * Return the log file descriptor for the crash handler, or -1.
+ * Plain text can't be written into a compressed file.
+ */
+int
+debug_instance_crash_fd(void)
+{
+
+	if (debugInstance.logfile.zmode != DEBUG_COMPRESS_NONE)
+		return (-1);
+	return (debugInstance.file_sink.fd);
+}
+
+/*
+ * Write out whatever is still queued on the thread rings.
+ *
+ * This is called from the crash handler so it walks the rings
+ * without taking any locks and only uses async-signal-safe calls.
+ * Deferred entries can't be formatted here, so their format string
+ * is written out as-is, and DEBUG_KV() entries just their event name.
+ */
+void
+debug_instance_crash_dump(int fd)
+{
+	struct debug_instance *ds = &debugInstance;
+	struct debug_thread *dt;
+	struct debug_rec *r;
+	unsigned int h, t;
+	const char *p;
+	uint64_t ns;
+	uint32_t kl;
+	size_t len;
+
+	debug_crash_write_str(fd, "--- libdebug: pending queued entries ---\n");
+	TAILQ_FOREACH(dt, &ds->threads, t) {
+		h = atomic_load_explicit(&dt->ring_head, memory_order_acquire);
+		t = atomic_load_explicit(&dt->ring_tail, memory_order_acquire);
+		for (; h != t; h += r->len) {
+			r = debug_ring_rec(dt, h);
+			/* Don't trust a ring we may have crashed in */
+			if (r->len == 0 || r->len > dt->ring_size)
+				break;
+			if (r->type == DEBUG_REC_PAD)
+				continue;
+
+			debug_crash_write_str(fd, "(");
+			ns = debug_clock_to_ns(&ds->clock, r->ts);
+			debug_crash_write_u64(fd, ns / 1000000000ULL, 10, 0);
+			debug_crash_write_str(fd, ".");
+			debug_crash_write_u64(fd, (ns / 1000) % 1000000, 10, 6);
+			debug_crash_write_str(fd, ")| ");
+
+			switch (r->type) {
+			case DEBUG_REC_TEXT:
+				p = r->buf;
+				len = r->msglen;
+				break;
+			case DEBUG_REC_SPILL:
+				memcpy(&p, r->buf, sizeof(p));
+				len = r->msglen;
+				if ((r->flags & DEBUG_REC_F_KV) == 0)
+					break;
+				debug_crash_write_str(fd, "[kv] ");
+				p = debug_kv_event(p, len, &kl);
+				len = kl;
+				if (p == NULL) {
+					p = "[garbled]";
+					len = strlen(p);
+				}
+				break;
+			case DEBUG_REC_DEFERRED:
+				debug_crash_write_str(fd, "[deferred] ");
+				p = ((struct debug_rec_deferred *) r->buf)->fmt;
+				len = strlen(p);
+				break;
+			case DEBUG_REC_KV:
+				debug_crash_write_str(fd, "[kv] ");
+				p = debug_kv_event(r->buf, r->msglen, &kl);
+				len = kl;
+				if (p == NULL) {
+					p = "[garbled]";
+					len = strlen(p);
+				}
+				break;
+			default:
+				p = "[unknown record]";
+				len = strlen(p);
+				break;
+			}
+			debug_crash_write(fd, p, len);
+			if (len == 0 || p[len - 1] != '\n')
+				debug_crash_write(fd, "\n", 1);
+		}
+	}
+}
+
+/*
+ * Render a deferred-format entry into the logger's render buffer.
+ *
+ * If the captured arguments somehow don't match the format then
+ * the raw format string is logged instead.
+ */
+static void
+debug_entry_render(struct debug_instance *ds, struct debug_entry *de)
+{
+	struct debug_fmt_buf *fb = &ds->render_buf;
+	size_t start = fb->len;
+
+	if (debug_fmt_render(fb, de->fmt, de->args, de->len) < 0) {
+		fb->len = start;
+		(void) debug_fmt_buf_append(fb, de->fmt, strlen(de->fmt));
+	}
+	if (de->xerrno >= 0) {
+		/* Same as do_debug_warn() */
+		/* XXX TODO: use strerror_r() */
+		(void) debug_fmt_buf_printf(fb, ": %s (%d)\n",
+		    strerror(de->xerrno), de->xerrno);
+	}
+	/* The buffer can still move, so just note where this landed */
+	de->buf = NULL;
+	de->buf_off = start;
+	de->len = fb->len - start;
+	de->fmt = NULL;
+}
+
+/*
+ * Render a DEBUG_KV() entry into the logger's render buffer, as text
+ * or as the JSON members for debug_json_line().  kv stays set for the
+ * latter.
+ */
+static void
+debug_entry_render_kv(struct debug_instance *ds, struct debug_entry *de)
+{
+	struct debug_fmt_buf *fb = &ds->render_buf;
+	size_t start = fb->len;
+	int json = ds->debug_output_format == DEBUG_OUTPUT_JSON;
+
+	if (debug_kv_render(fb, de->args, de->len, json) < 0) {
+		fb->len = start;
+		(void) debug_fmt_buf_append(fb, json ?
+		    "\"event\":\"[garbled]\"" : "[garbled]\n",
+		    json ? 19 : 10);
+	}
+	de->buf = NULL;
+	de->buf_off = start;
+	de->len = fb->len - start;
+	de->kv = json;
+}
+
+/*
+ * Build the prefix pieces for the given second into h
+ * (DEBUG_TS_HEAD_SIZE bytes) and tl (DEBUG_TS_TAIL_SIZE bytes).
+ * Returns the head length; the tail length is in *taillen.
+ *
+ * Every prefix format is "<head><usec><tail>" where only the head
+ * depends on the second; so the logger caches them and only runs
+ * localtime_r()/strftime() once a second rather than once per line.
+ */
+static int
+debug_ts_head(int fmt, time_t sec, char *h, char *tl, int *taillen)
+{
+	struct tm t;
+	const char *tail = "| ";
+	int n = 0;
+
+	switch (fmt) {
+	case DEBUG_TSFMT_ISO8601:
+		localtime_r(&sec, &t);
+		n = strftime(h, DEBUG_TS_HEAD_SIZE, "%Y-%m-%dT%H:%M:%S.", &t);
+		tail = NULL;
+		*taillen = strftime(tl, DEBUG_TS_TAIL_SIZE, "%z| ", &t);
+		break;
+	case DEBUG_TSFMT_RELATIVE:
+		h[n++] = '+';
+		n += debug_u64toa(h + n, sec, 10, 0);
+		h[n++] = '.';
+		break;
+	case DEBUG_TSFMT_EPOCH:
+		n += debug_u64toa(h + n, sec, 10, 0);
+		h[n++] = '.';
+		break;
+	case DEBUG_TSFMT_DEFAULT:
+	default:
+		localtime_r(&sec, &t);
+		n = strftime(h, DEBUG_TS_HEAD_SIZE, "%Y-%m-%d %H:%M:%S (", &t);
+		n += debug_u64toa(h + n, sec, 10, 0);
+		h[n++] = '.';
+		tail = ")| ";
+		break;
+	}
+	if (tail != NULL)
+		*taillen = snprintf(tl, DEBUG_TS_TAIL_SIZE, "%s", tail);
+	return (n);
+}
+
+/*
+ * Rebuild the cached prefix pieces for the given second.
+ */
+static void
+debug_instance_ts_update(struct debug_instance *ds, time_t sec)
+{
+
+	ds->debug_ts_headlen = debug_ts_head(ds->debug_ts_format, sec,
+	    ds->debug_ts_head, ds->debug_ts_tail, &ds->debug_ts_taillen);
+	ds->debug_ts_sec = sec;
+	ds->debug_ts_valid = 1;
+}
+
+/*
+ * Build the timestamp prefix for an entry into buf, which must be
+ * DEBUG_TS_PREFIX_SIZE bytes.  Returns the prefix length; the prefix
+ * is NUL terminated.
+ *
+ * Called with debug_file_lock held.
+ */
+static int
+debug_instance_ts_prefix(struct debug_instance *ds, uint64_t ns, char *buf)
+{
+	time_t sec;
+	long usec;
+	int n;
+
+	if (ds->debug_ts_format == DEBUG_TSFMT_RELATIVE) {
+		/* Entries can predate the start after a clock step */
+		if (ns < ds->debug_ts_start)
+			ns = 0;
+		else
+			ns -= ds->debug_ts_start;
+	}
+	sec = ns / 1000000000ULL;
+	usec = (ns / 1000) % 1000000;
+
+	if (! ds->debug_ts_valid || sec != ds->debug_ts_sec)
+		debug_instance_ts_update(ds, sec);
+
+	n = ds->debug_ts_headlen;
+	memcpy(buf, ds->debug_ts_head, n);
+	n += debug_u64toa(buf + n, usec, 10, 6);
+	memcpy(buf + n, ds->debug_ts_tail, ds->debug_ts_taillen);
+	n += ds->debug_ts_taillen;
+	buf[n] = '\0';
+	return (n);
+}
+
+/*
+ * Hand a line to each destination its section/mask is enabled for.
+ *
+ * Returns whether the line is a warning or worse, which some flush
+ * policies care about.
+ *
+ * This must be called with the file_lock held.
+ */
+static int
+debug_instance_emit_locked(struct debug_instance *ds,
+    const struct debug_entry *de, const char *pfx, const char *msg)
+{
+
+	/* Keep the most recent lines around in case we crash */
+	debug_crash_log(pfx, de->pfx_len, msg, de->len);
+
+	/*
+	 * Ok, now that it's done, we can figure out where to
+	 * write it to.  Skip anywhere the caller already wrote it.
+	 */
+	if ((de->written & (1 << DEBUG_TYPE_PRINT)) == 0 &&
+	    ds->levels[DEBUG_TYPE_PRINT][de->debug_section] &
+	    de->debug_mask) {
+		(void) debug_sink_add(&ds->stderr_sink, pfx, de->pfx_len);
+		(void) debug_sink_add(&ds->stderr_sink, msg, de->len);
+	}
+	if (ds->file_sink.fd >= 0 &&
+	    (de->written & (1 << DEBUG_TYPE_LOG)) == 0 &&
+	    ds->levels[DEBUG_TYPE_LOG][de->debug_section] &
+	    de->debug_mask) {
+		(void) debug_sink_add(&ds->file_sink, pfx, de->pfx_len);
+		(void) debug_sink_add(&ds->file_sink, msg, de->len);
+	}
+
+	/* syslog and any registered sinks are written by their workers */
+	debug_worker_add(ds, de, pfx, msg);
+
+	return ((de->debug_mask & DEBUG_LVL_WARNING_UP) != 0);
+}
+
+/*
+ * DEBUG_OVERFLOW_SYNC: the calling thread's ring is full, so write
+ * the message out from here.  It may come out ahead of messages
+ * which are still queued.  written is the destinations the caller
+ * has already written it to directly; kv is set if msg is the JSON
+ * members of a DEBUG_KV() line.
+ */
+static void
+debug_instance_log_sync(struct debug_instance *ds, debug_section_t section,
+    debug_mask_t mask, const char *msg, int len, int written, int kv)
+{
+	struct debug_fmt_buf jb = { NULL, 0, 0 };
+	char pbuf[DEBUG_TS_PREFIX_SIZE];
+	struct debug_entry de;
+	const char *pfx;
+
+	bzero(&de, sizeof(de));
+	de.ts = OS_clock_gettime_ns(OS_CLOCK_REALTIME);
+	de.debug_section = section;
+	de.debug_mask = mask;
+	de.len = len;
+	de.written = written;
+
+	(void) pthread_mutex_lock(&ds->debug_file_lock);
+	if (ds->debug_output_format == DEBUG_OUTPUT_JSON &&
+	    debug_json_line(&jb, de.ts, ds->level_strs[section], mask,
+	    msg, len, kv) == 0) {
+		pfx = msg = jb.buf;
+		de.len = jb.len;
+	} else {
+		de.pfx_len = debug_instance_ts_prefix(ds, de.ts, pbuf);
+		pfx = pbuf;
+	}
+	(void) debug_instance_emit_locked(ds, &de, pfx, msg);
+	debug_sink_batch_done(&ds->stderr_sink, &ds->debug_flush, 1,
+	    debug_sink_now_ms());
+	debug_sink_batch_done(&ds->file_sink, &ds->debug_flush, 1,
+	    debug_sink_now_ms());
+	debug_sink_flush(&ds->stderr_sink);
+	debug_sink_flush(&ds->file_sink);
+	debug_worker_publish(ds);
+	(void) pthread_mutex_unlock(&ds->debug_file_lock);
+	free(jb.buf);
+}
+
+/*
+ * Return the destinations (as (1 << type) bits) a line at mask in
+ * section should be written to directly rather than queued.
+ */
+static inline int
+debug_sync_types(struct debug_instance *ds, debug_section_t section,
+    debug_mask_t mask)
+{
+	int types = 0;
+
+	if (__builtin_expect((ds->debug_sync_any & mask) == 0, 1))
+		return (0);
+	if (ds->levels[DEBUG_TYPE_PRINT][section] & mask &
+	    ds->debug_sync_levels[DEBUG_TYPE_PRINT])
+		types |= 1 << DEBUG_TYPE_PRINT;
+	if (ds->levels[DEBUG_TYPE_LOG][section] & mask &
+	    ds->debug_sync_levels[DEBUG_TYPE_LOG])
+		types |= 1 << DEBUG_TYPE_LOG;
+	return (types);
+}
+
+/*
+ * Write a line to the destinations in types from the calling thread,
+ * with a single writev() each; the prefix is built from scratch rather
+ * than from the logger's cached copy.
+ *
+ * Nothing here waits for the logger.  stderr is written without a
+ * lock.  The log file is only written if it's plain and not going
+ * through io_uring, under a lock which is only held by opens and
+ * rotations (see debug_logfile_write_direct()); a compressed or
+ * async file is left to the logger.  The line comes out ahead of
+ * anything still queued or held back under the flush policy.
+ *
+ * The line is still queued as normal, carrying the destinations this
+ * returns, so the logger writes it everywhere else (and anywhere the
+ * write here failed) in its place amongst the queued lines.
+ *
+ * With JSON output the whole line is built in a heap buffer; kv is set
+ * if msg is the JSON members of a DEBUG_KV() line.
+ */
+static int
+debug_instance_write_direct(struct debug_instance *ds, int types,
+    debug_section_t section, debug_mask_t mask, const char *msg, int len,
+    int kv)
+{
+	char pfx[DEBUG_TS_PREFIX_SIZE], tail[DEBUG_TS_TAIL_SIZE];
+	struct debug_fmt_buf jb = { NULL, 0, 0 };
+	struct iovec iov[2];
+	debug_tsfmt_t tsfmt;
+	uint64_t ns;
+	ssize_t tot;
+	int n, niov, taillen = 0, written = 0;
+
+	ns = OS_clock_gettime_ns(OS_CLOCK_REALTIME);
+	if (__atomic_load_n(&ds->debug_output_format, __ATOMIC_RELAXED) ==
+	    DEBUG_OUTPUT_JSON) {
+		if (debug_json_line(&jb, ns, ds->level_strs[section], mask,
+		    msg, len, kv) < 0) {
+			free(jb.buf);
+			return (0);
+		}
+		iov[0].iov_base = jb.buf;
+		iov[0].iov_len = jb.len;
+		tot = jb.len;
+		niov = 1;
+	} else {
+		tsfmt = __atomic_load_n(&ds->debug_ts_format,
+		    __ATOMIC_RELAXED);
+		if (tsfmt == DEBUG_TSFMT_RELATIVE)
+			ns = ns < ds->debug_ts_start ? 0 :
+			    ns - ds->debug_ts_start;
+		n = debug_ts_head(tsfmt, ns / 1000000000ULL, pfx, tail,
+		    &taillen);
+		n += debug_u64toa(pfx + n, (ns / 1000) % 1000000, 10, 6);
+		memcpy(pfx + n, tail, taillen);
+		n += taillen;
+
+		iov[0].iov_base = pfx;
+		iov[0].iov_len = n;
+		iov[1].iov_base = (void *) (uintptr_t) msg;
+		iov[1].iov_len = len;
+		tot = n + len;
+		niov = 2;
+	}
+
+	if (types & (1 << DEBUG_TYPE_PRINT)) {
+		if (writev(STDERR_FILENO, iov, niov) == tot)
+			written |= 1 << DEBUG_TYPE_PRINT;
+		else
+			__atomic_add_fetch(&ds->stderr_sink.nerrors, 1,
+			    __ATOMIC_RELAXED);
+	}
+	if ((types & (1 << DEBUG_TYPE_LOG)) &&
+	    debug_logfile_write_direct(&ds->logfile, iov, niov) == 0)
+		written |= 1 << DEBUG_TYPE_LOG;
+	free(jb.buf);
+	return (written);
+}
+
+/*
+ * Hand a line to libdebug-collectord, tagged with the destinations
+ * this process has it enabled for, less any it's already been
+ * written to directly.  A full region is counted by the collector.
+ */
+static void
+debug_instance_log_shm(struct debug_instance *ds, debug_section_t section,
+    debug_mask_t mask, const char *msg, int len, int written)
+{
+	int types = 0;
+
+	if (ds->levels[DEBUG_TYPE_PRINT][section] & mask)
+		types |= 1 << DEBUG_TYPE_PRINT;
+	if (ds->levels[DEBUG_TYPE_LOG][section] & mask)
+		types |= 1 << DEBUG_TYPE_LOG;
+	if (ds->debug_syslog_enable &&
+	    ds->levels[DEBUG_TYPE_SYSLOG][section] & mask)
+		types |= 1 << DEBUG_TYPE_SYSLOG;
+	types &= ~written;
+	if (types != 0)
+		(void) debug_shm_publish(OS_clock_gettime_ns(OS_CLOCK_REALTIME),
+		    section, mask, types, msg, len);
+}
+
+/*
+ * Append the "last message repeated" line for the run being held to
+ * fb and end the run.  Returns the total length, or 0 if it couldn't
+ * be built; the prefix length is in *pfx_len.
+ */
+static int
+debug_instance_coalesce_line(struct debug_instance *ds,
+    struct debug_fmt_buf *fb, int *pfx_len)
+{
+	char msg[DEBUG_COALESCE_MSG_SIZE];
+	size_t start = fb->len;
+	int n;
+
+	n = snprintf(msg, sizeof(msg), "last message repeated %u times\n",
+	    ds->coalesce_count);
+	if (n >= (int) sizeof(msg))
+		n = sizeof(msg) - 1;
+	ds->coalesce_count = 0;
+
+	*pfx_len = 0;
+	if (ds->debug_output_format == DEBUG_OUTPUT_JSON) {
+		if (debug_json_line(fb, ds->coalesce_ts,
+		    ds->level_strs[ds->coalesce_section], ds->coalesce_mask,
+		    msg, n, 0) < 0) {
+			fb->len = start;
+			return (0);
+		}
+		return (fb->len - start);
+	}
+
+	if (debug_fmt_buf_reserve(fb, DEBUG_TS_PREFIX_SIZE + n) < 0)
+		return (0);
+	*pfx_len = debug_instance_ts_prefix(ds, ds->coalesce_ts,
+	    fb->buf + fb->len);
+	fb->len += *pfx_len;
+	(void) debug_fmt_buf_append(fb, msg, n);
+	return (fb->len - start);
+}
+
+/*
+ * Hand the held repeat count to the sinks if the hold time is up, or
+ * regardless if force is set.  The caller finishes the sink batch.
+ * Returns the milliseconds until it's due, or -1 if nothing is held.
+ *
+ * This must be called with the file_lock held.
+ */
+static int
+debug_instance_coalesce_flush_locked(struct debug_instance *ds, int force)
+{
+	struct debug_entry de;
+	uint64_t now, hold;
+	int len;
+
+	if (ds->coalesce_count == 0)
+		return (-1);
+	now = OS_clock_gettime_ns(OS_CLOCK_REALTIME);
+	hold = (uint64_t) ds->debug_coalesce_ms * 1000000ULL;
+	if (! force && now - ds->coalesce_start < hold)
+		return ((hold - (now - ds->coalesce_start)) / 1000000ULL + 1);
+
+	bzero(&de, sizeof(de));
+	de.debug_section = ds->coalesce_section;
+	de.debug_mask = ds->coalesce_mask;
+	ds->coalesce_line.len = 0;
+	len = debug_instance_coalesce_line(ds, &ds->coalesce_line, &de.pfx_len);
+	if (len == 0)
+		return (-1);
+	de.len = len - de.pfx_len;
+	(void) debug_instance_emit_locked(ds, &de, ds->coalesce_line.buf,
+	    ds->coalesce_line.buf + de.pfx_len);
+	return (-1);
+}
+
+/*
+ * Replace an entry's message with its JSON line, in the render buffer.
+ * If that can't be done the message goes out as it is.
+ *
+ * This must be called with the file_lock held.
+ */
+static void
+debug_instance_json_entry(struct debug_instance *ds, struct debug_entry *de)
+{
+	struct debug_fmt_buf *fb = &ds->render_buf;
+	size_t start = fb->len;
+	const char *msg;
+
+	de->pfx_off = 0;
+	de->pfx_len = 0;
+	msg = de->buf != NULL ? de->buf : fb->buf + de->buf_off;
+	if (debug_json_line(fb, de->ts, ds->level_strs[de->debug_section],
+	    de->debug_mask, msg, de->len, de->kv) < 0) {
+		fb->len = start;
+		return;
+	}
+	de->buf = NULL;
+	de->buf_off = start;
+	de->len = fb->len - start;
+}
+
+/*
+ * Decide whether the entry repeats the last line written.  Repeats
+ * are marked dup and counted; when a run ends, or has been held for
+ * the coalesce time, the entry carries the "repeated" line for it.
+ *
+ * This must be called with the file_lock held.
+ */
+static void
+debug_instance_coalesce(struct debug_instance *ds, struct debug_entry *de)
+{
+	struct debug_fmt_buf *fb = &ds->render_buf;
+	const char *msg;
+	int same;
+
+	/* Lines the caller wrote directly are already out */
+	msg = de->buf != NULL ? de->buf : fb->buf + de->buf_off;
+	same = ds->coalesce_valid && de->written == 0 &&
+	    de->debug_section == ds->coalesce_section &&
+	    de->debug_mask == ds->coalesce_mask &&
+	    (size_t) de->len == ds->coalesce_last.len &&
+	    memcmp(msg, ds->coalesce_last.buf, de->len) == 0;
+
+	if (same) {
+		if (ds->coalesce_count == 0)
+			ds->coalesce_start = de->ts;
+		ds->coalesce_count++;
+		ds->coalesce_ts = de->ts;
+		de->dup = 1;
+		if (de->ts - ds->coalesce_start <
+		    (uint64_t) ds->debug_coalesce_ms * 1000000ULL)
+			return;
+	}
+
+	if (ds->coalesce_count != 0) {
+		de->rpt_section = ds->coalesce_section;
+		de->rpt_mask = ds->coalesce_mask;
+		de->rpt_off = fb->len;
+		de->rpt_len = debug_instance_coalesce_line(ds, fb,
+		    &de->rpt_pfx_len);
+	}
+	ds->coalesce_count = 0;
+
+	if (same)
+		return;
+	msg = de->buf != NULL ? de->buf : fb->buf + de->buf_off;
+	ds->coalesce_last.len = 0;
+	ds->coalesce_valid = debug_fmt_buf_append(&ds->coalesce_last, msg,
+	    de->len) == 0;
+	ds->coalesce_section = de->debug_section;
+	ds->coalesce_mask = de->debug_mask;
+}
+
+/*
+ * Write out the staged batch.
+ *
+ * First the prefixes are built and any deferred entries rendered
+ * into render_buf; then each line is handed to the sinks as a
+ * prefix/message iovec pair pointing at render_buf and the thread
+ * rings, so nothing is copied unless the flush policy holds the
+ * batch back.  The ring space mustn't be released until this is done.
+ *
+ * This must be called with the file_lock held.
+ */
+static void
+debug_instance_log_batch_locked(struct debug_instance *ds)
+{
+	struct debug_fmt_buf *fb = &ds->render_buf;
+	struct debug_entry *de, rpt;
+	const char *pfx, *msg;
+	uint64_t now, ns;
+	int i, urgent = 0;
+
+	ds->stat_batches++;
+	ds->stat_batch_size[debug_stats_bucket(ds->nstaging)]++;
+
+	fb->len = 0;
+	for (i = 0; i < ds->nstaging; i++) {
+		de = &ds->staging[i];
+
+		/* Deferred entries are formatted here, off the caller's thread */
+		if (de->fmt != NULL)
+			debug_entry_render(ds, de);
+		else if (de->kv)
+			debug_entry_render_kv(ds, de);
+
+		de->dup = 0;
+		de->rpt_len = 0;
+		if (ds->debug_coalesce_ms != 0) {
+			debug_instance_coalesce(ds, de);
+			if (de->dup)
+				continue;
+		}
+
+		/* JSON lines carry the timestamp inside, so no prefix */
+		if (ds->debug_output_format == DEBUG_OUTPUT_JSON) {
+			debug_instance_json_entry(ds, de);
+			continue;
+		}
+
+		/* Generate debug timestamp string */
+		if (debug_fmt_buf_reserve(fb, DEBUG_TS_PREFIX_SIZE) < 0) {
+			de->pfx_off = 0;
+			de->pfx_len = 0;
+			continue;
+		}
+		de->pfx_off = fb->len;
+		de->pfx_len = debug_instance_ts_prefix(ds, de->ts,
+		    fb->buf + fb->len);
+		fb->len += de->pfx_len;
+	}
+
+	ns = OS_clock_gettime_ns(OS_CLOCK_REALTIME);
+	for (i = 0; i < ds->nstaging; i++) {
+		de = &ds->staging[i];
+		ds->stat_written++;
+		ds->stat_latency_ns[debug_stats_bucket(ns > de->ts ?
+		    ns - de->ts : 0)]++;
+		if (de->rpt_len != 0) {
+			bzero(&rpt, sizeof(rpt));
+			rpt.debug_section = de->rpt_section;
+			rpt.debug_mask = de->rpt_mask;
+			rpt.pfx_len = de->rpt_pfx_len;
+			rpt.len = de->rpt_len - de->rpt_pfx_len;
+			pfx = fb->buf + de->rpt_off;
+			urgent |= debug_instance_emit_locked(ds, &rpt, pfx,
+			    pfx + rpt.pfx_len);
+		}
+		if (de->dup)
+			continue;
+		pfx = fb->buf + de->pfx_off;
+		msg = de->buf != NULL ? de->buf : fb->buf + de->buf_off;
+		urgent |= debug_instance_emit_locked(ds, de, pfx, msg);
+	}
+
+	now = debug_sink_now_ms();
+	debug_sink_batch_done(&ds->stderr_sink, &ds->debug_flush, urgent, now);
+	debug_sink_batch_done(&ds->file_sink, &ds->debug_flush, urgent, now);
+	debug_worker_publish(ds);
+}
+
+/*
+ * Write out anything whose flush interval has expired; returns the
+ * milliseconds until the next deadline, or -1 if there isn't one.
+ *
+ * If idle is set everything pending is written out regardless.
+ *
+ * This must be called with the file_lock held.
+ */
+static int
+debug_instance_flush_locked(struct debug_instance *ds, int idle)
+{
+	uint64_t now = debug_sink_now_ms();
+	int d1, d2, dc;
+
+	dc = debug_instance_coalesce_flush_locked(ds, idle);
+	debug_worker_publish(ds);
+	if (idle) {
+		debug_sink_batch_done(&ds->stderr_sink, &ds->debug_flush, 1,
+		    now);
+		debug_sink_batch_done(&ds->file_sink, &ds->debug_flush, 1,
+		    now);
+		debug_sink_flush(&ds->stderr_sink);
+		debug_sink_flush(&ds->file_sink);
+		return (-1);
+	}
+	debug_sink_batch_done(&ds->stderr_sink, &ds->debug_flush, 0, now);
+	debug_sink_batch_done(&ds->file_sink, &ds->debug_flush, 0, now);
+	d1 = debug_sink_deadline(&ds->stderr_sink, &ds->debug_flush, now);
+	d2 = debug_sink_deadline(&ds->file_sink, &ds->debug_flush, now);
+	if (d1 < 0 || (d2 >= 0 && d2 < d1))
+		d1 = d2;
+	if (d1 < 0 || (dc >= 0 && dc < d1))
+		d1 = dc;
+	return (d1);
+}
+
+/*
+ * Count a suppressed call.  The first one since the last report links
+ * the site onto the report list and makes sure the logger is ticking.
+ */
+static int
+debug_ratelimit_suppress(struct debug_ratelimit *rl, debug_section_t s)
+{
+	struct debug_instance *ds = &debugInstance;
+	struct debug_ratelimit *head;
+
+	__atomic_store_n(&rl->section, s, __ATOMIC_RELAXED);
+	if (__atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED) != 0)
+		return (0);
+
+	if (__atomic_exchange_n(&rl->linked, 1, __ATOMIC_RELAXED) == 0) {
+		head = __atomic_load_n(&debug_ratelimit_sites,
+		    __ATOMIC_RELAXED);
+		do {
+			rl->next = head;
+		} while (! __atomic_compare_exchange_n(&debug_ratelimit_sites,
+		    &head, rl, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	/*
+	 * The logger may be in a long idle sleep with the tick stopped;
+	 * this happens at most once a report interval.
+	 */
+	if (__atomic_exchange_n(&debug_ratelimit_active, 1,
+	    __ATOMIC_SEQ_CST) == 0 &&
+	    atomic_load_explicit(&ds->debug_thr_sleeping,
+	    memory_order_seq_cst) != 0) {
+		(void) pthread_mutex_lock(&ds->debug_lock);
+		pthread_cond_signal(&ds->log_cond);
+		(void) pthread_mutex_unlock(&ds->debug_lock);
+	}
+	return (0);
+}
+
+/*
+ * DEBUG_RATELIMIT() check - a GCRA token bucket.  state is the time
+ * the bucket would be full again; a call is allowed if that's no more
+ * than (burst - 1) intervals away.  A rate of 0 suppresses everything.
+ */
+int
+debug_ratelimit_ok(struct debug_ratelimit *rl, debug_section_t s,
+    unsigned int rate, unsigned int burst)
+{
+	uint64_t now, tat, ntat, t, tau;
+
+	if (rate == 0)
+		return (debug_ratelimit_suppress(rl, s));
+	t = 1000000000ULL / rate;
+	tau = (burst > 1) ? t * (burst - 1) : 0;
+
+	/* The tick is only current while the logger is ticking */
+	if (__atomic_load_n(&debug_ratelimit_active, __ATOMIC_RELAXED))
+		now = __atomic_load_n(&debug_tick_ns, __ATOMIC_RELAXED);
+	else
+		now = OS_clock_gettime_ns(OS_CLOCK_MONOTONIC);
+	tat = __atomic_load_n(&rl->state, __ATOMIC_RELAXED);
+	do {
+		if (tat > now + tau)
+			return (debug_ratelimit_suppress(rl, s));
+		ntat = ((tat > now) ? tat : now) + t;
+	} while (! __atomic_compare_exchange_n(&rl->state, &tat, ntat, 1,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return (1);
+}
+
+/*
+ * DEBUG_SAMPLE() check - allow the first of every n calls.
+ */
+int
+debug_sample_ok(struct debug_ratelimit *rl, debug_section_t s,
+    unsigned int n)
+{
+	uint64_t c;
+
+	c = __atomic_fetch_add(&rl->state, 1, __ATOMIC_RELAXED);
+	if (n <= 1 || c % n == 0)
+		return (1);
+	return (debug_ratelimit_suppress(rl, s));
+}
+
+/*
+ * Turn a payload into a line, in buf if it fits, else in a heap
+ * buffer.  json is only used for DEBUG_KV() lines.
+ *
+ * Returns the buffer used and the length in *lenp, or NULL on error.
+ */
+static char *
+debug_payload_render(const struct debug_payload *p, int json, char *buf,
+    size_t buflen, int *lenp)
+{
+	struct debug_fmt_buf fb = { NULL, 0, 0 };
+	char tbuf[DEBUG_FORMAT_BUF_SIZE];
+	char *msg, *wmsg;
+	va_list aq;
+
+	switch (p->type) {
+	case DEBUG_PAYLOAD_FMT:
+		if (p->xerrno < 0) {
+			va_copy(aq, *p->ap);
+			msg = debug_vformat(buf, buflen, lenp, p->fmt, aq);
+			va_end(aq);
+			return (msg);
+		}
+		va_copy(aq, *p->ap);
+		msg = debug_vformat(tbuf, sizeof(tbuf), lenp, p->fmt, aq);
+		va_end(aq);
+		if (msg == NULL)
+			return (NULL);
+
+		/* And now, log the errno string */
+		/* XXX TODO: use strerror_r() */
+		wmsg = debug_format(buf, buflen, lenp, "%s: %s (%d)\n",
+		    msg,
+		    strerror(p->xerrno),
+		    p->xerrno);
+		if (msg != tbuf)
+			free(msg);
+		return (wmsg);
+	case DEBUG_PAYLOAD_ARGS:
+		if (debug_fmt_render(&fb, p->fmt, p->args, p->argslen) < 0) {
+			fb.len = 0;
+			(void) debug_fmt_buf_append(&fb, p->fmt,
+			    strlen(p->fmt));
+		}
+		break;
+	case DEBUG_PAYLOAD_KV:
+		if (debug_kv_render(&fb, p->args, p->argslen, json) < 0) {
+			free(fb.buf);
+			return (NULL);
+		}
+		break;
+	default:
+		return (NULL);
+	}
+	*lenp = fb.len;
+	return (fb.buf);
+}
+
+/*
+ * Try to queue a payload as it is, for the logger thread to render.
+ * Returns 0 if it's been dealt with (queued, or counted as dropped)
+ * and -1 if it has to be rendered here.
+ */
+static int
+debug_payload_queue(struct debug_instance *ds, struct debug_thread *dt,
+    uint64_t ts, debug_section_t section, debug_mask_t mask,
+    const struct debug_payload *p)
+{
+	va_list aq;
+	int r;
+
+	switch (p->type) {
+	case DEBUG_PAYLOAD_FMT:
+		if (! ds->debug_defer_format)
+			return (-1);
+		va_copy(aq, *p->ap);
+		r = debug_entry_queue_deferred(ds, dt, ts, section, mask,
+		    p->xerrno, p->fmt, aq);
+		va_end(aq);
+		return (r);
+	case DEBUG_PAYLOAD_ARGS:
+		return (debug_entry_queue_args(ds, dt, ts, section, mask, -1,
+		    p->fmt, p->args, p->argslen));
+	case DEBUG_PAYLOAD_KV:
+		debug_entry_queue_kv(ds, dt, ts, section, mask, p->args,
+		    p->argslen, p->args_is_heap, 0);
+		return (0);
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * The enqueue path shared by every DEBUG*() call.
+ *
+ * The payload is queued as it is where possible, leaving the logger
+ * thread to render it.  It's only rendered here for the paths which
+ * don't go through the logger: direct writes (see
+ * debug_set_sync_levels()), the shm region and DEBUG_OVERFLOW_SYNC
+ * on a full ring.  A line written directly is still queued, carrying
+ * the destinations it's been written to.
+ *
+ * A DEBUG_KV() payload's args are owned by this if args_is_heap is set.
+ */
+static void
+debug_instance_enqueue(struct debug_instance *ds, debug_section_t section,
+    debug_mask_t mask, struct debug_payload *p)
+{
+	struct debug_thread *dt;
+	char buf[DEBUG_FORMAT_BUF_SIZE];
+	char *msg = NULL;
+	uint64_t ts;
+	int len, full = 0, sync, json, written = 0;
+
+	/* The collector does the writing if there's a shm region */
+	sync = debug_sync_types(ds, section, mask);
+	dt = NULL;
+	ts = 0;
+	if (ds == &debugInstance && debug_shm_active())
+		goto render;
+
+	dt = debug_thread_get(ds);
+	if (dt == NULL)
+		goto done;
+
+	/*
+	 * Apply the overflow policy if the ring is at its limit;
+	 * lines being written directly go out regardless.
+	 */
+	dt->wait_deadline_set = 0;
+	full = ! debug_instance_can_queue(ds, dt);
+	if (full && sync == 0 &&
+	    ds->debug_overflow_policy != DEBUG_OVERFLOW_SYNC) {
+		debug_drop_count(ds, section);
+		goto done;
+	}
+
+	/* Raw timestamp; the logger converts it to wall clock time */
+	ts = debug_clock_read(&ds->clock);
+
+	/* Just capture the arguments if the logger can render them */
+	if (! full && sync == 0 &&
+	    debug_payload_queue(ds, dt, ts, section, mask, p) == 0)
+		return;
+
+render:
+	/* The collector adds its own prefix, so it always gets text */
+	json = p->type == DEBUG_PAYLOAD_KV && dt != NULL &&
+	    __atomic_load_n(&ds->debug_output_format, __ATOMIC_RELAXED) ==
+	    DEBUG_OUTPUT_JSON;
+	msg = debug_payload_render(p, json, buf, sizeof(buf), &len);
+	if (msg == NULL)
+		goto done;
+
+	if (sync != 0)
+		written = debug_instance_write_direct(ds, sync, section, mask,
+		    msg, len, json);
+
+	if (dt == NULL) {
+		debug_instance_log_shm(ds, section, mask, msg, len, written);
+		goto done;
+	}
+	if (full) {
+		if (ds->debug_overflow_policy == DEBUG_OVERFLOW_SYNC)
+			debug_instance_log_sync(ds, section, mask, msg, len,
+			    written, json);
+		else if (written == 0)
+			debug_drop_count(ds, section);
+		goto done;
+	}
+
+	/* Queue entry, wakeup worker thread */
+	if (p->type == DEBUG_PAYLOAD_KV) {
+		if (msg != buf)
+			free(msg);
+		debug_entry_queue_kv(ds, dt, ts, section, mask, p->args,
+		    p->argslen, p->args_is_heap, written);
+		return;
+	}
+	debug_entry_queue(ds, dt, ts, section, mask, msg, len, msg != buf,
+	    written);
+	return;
+
+done:
+	if (msg != NULL && msg != buf)
+		free(msg);
+	if (p->type == DEBUG_PAYLOAD_KV && p->args_is_heap)
+		free(p->args);
+}
+
+/*
+ * Called to do actual debugging.
+ *
+ * The macro hilarity is done so that the arguments to the debug
+ * statement aren't actually evaluated unless the debugging level
+ * is matched.
+ */
+static void
+debug_instance_vdebug(struct debug_instance *ds, int section,
+    debug_mask_t mask, const char *fmt, va_list ap)
+{
+	struct debug_payload p;
+	va_list aq;
+
+	bzero(&p, sizeof(p));
+	p.type = DEBUG_PAYLOAD_FMT;
+	p.fmt = fmt;
+	va_copy(aq, ap);
+	p.ap = &aq;
+	p.xerrno = -1;
+	debug_instance_enqueue(ds, section, mask, &p);
+	va_end(aq);
+}
+
+void
+do_debug(int section, debug_mask_t mask, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	debug_instance_vdebug(&debugInstance, section, mask, fmt, ap);
+	va_end(ap);
+}
+
+void
+do_debug_i(struct debug_instance *ds, int section, debug_mask_t mask,
+    const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	debug_instance_vdebug(ds, section, mask, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * debugging - warn() wrapper.
+ */
+static void
+debug_instance_vwarn(struct debug_instance *ds, int section, int xerrno,
+    const char *fmt, va_list ap)
+{
+	struct debug_payload p;
+	va_list aq;
+
+	bzero(&p, sizeof(p));
+	p.type = DEBUG_PAYLOAD_FMT;
+	p.fmt = fmt;
+	va_copy(aq, ap);
+	p.ap = &aq;
+	p.xerrno = xerrno;
+	debug_instance_enqueue(ds, section, DEBUG_LVL_ERR | DEBUG_LVL_CRIT,
+	    &p);
+	va_end(aq);
+}
+
+void
+do_debug_warn(int section, int xerrno, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	debug_instance_vwarn(&debugInstance, section, xerrno, fmt, ap);
+	va_end(ap);
+}
+
+void
+do_debug_warn_i(struct debug_instance *ds, int section, int xerrno,
+    const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	debug_instance_vwarn(ds, section, xerrno, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Structured logging.
+ *
+ * The fields are encoded (strings copied) and queued as they are; the
+ * logger thread renders them.
+ */
+void
+do_debug_kv_i(struct debug_instance *ds, int section, debug_mask_t mask,
+    const char *event, const struct debug_kv *kv, int nkv)
+{
+	struct debug_payload p;
+	char abuf[DEBUG_FORMAT_BUF_SIZE];
+	char *args;
+	size_t n;
+	int len;
+
+	n = debug_kv_size(event, kv, nkv);
+	if (n > INT_MAX)
 		return;
+	args = abuf;
+	if (n > sizeof(abuf) && (args = malloc(n)) == NULL)
+		return;
+	len = debug_kv_encode(args, n, event, kv, nkv);
+	if (len < 0) {
+		if (args != abuf)
+			free(args);
+		return;
+	}
+
+	bzero(&p, sizeof(p));
+	p.type = DEBUG_PAYLOAD_KV;
+	p.args = args;
+	p.argslen = len;
+	p.args_is_heap = args != abuf;
+	debug_instance_enqueue(ds, section, mask, &p);
+}
+
+void
+do_debug_kv(int section, debug_mask_t mask, const char *event,
+    const struct debug_kv *kv, int nkv)
+{
+
+	do_debug_kv_i(&debugInstance, section, mask, event, kv, nkv);
+}
+
+/*
+ * Log a line from arguments the caller has already captured, in the
+ * encoding described in debug.h; this is what the C++ bindings
+ * (debug.hpp) call.  The line is always deferred, so fmt must outlive
+ * it - a string literal or other static storage - and is rendered by
+ * the logger thread like a deferred format.
+ */
+void
+do_debug_args_i(struct debug_instance *ds, int section, debug_mask_t mask,
+    const char *fmt, const char *args, size_t argslen)
+{
+	struct debug_payload p;
+
+	bzero(&p, sizeof(p));
+	p.type = DEBUG_PAYLOAD_ARGS;
+	p.fmt = fmt;
+	p.args = (char *) (uintptr_t) args;
+	p.argslen = argslen;
+	debug_instance_enqueue(ds, section, mask, &p);
+}
+
+void
+do_debug_args(int section, debug_mask_t mask, const char *fmt,
+    const char *args, size_t argslen)
+{
+
+	do_debug_args_i(&debugInstance, section, mask, fmt, args, argslen);
+}
+
+void
+debug_setmask_str(const char *dbg, debug_type_t t, debug_mask_t mask)
+{
+	debug_section_t s;
+
+	s = debug_section_lookup(&debugInstance, dbg);
+	fprintf(stderr, "%s: setting debug '%s' (%d) to %llx\n",
+	    __func__, dbg, s, (unsigned long long) mask);
+	if (s < 0)
+		return;		/* XXX return something useful? */
+
+	debug_setlevel(s, t, mask);
+}
+
+/*
+ * Set the mask for every section matching an fnmatch(3) pattern and
+ * return the number of sections changed.  "*" matches across dots,
+ * so "net.*" is all of net's descendants; a pattern of that form is
+ * done by walking the section tree rather than matching every name.
+ */
+int
+debug_instance_setmask_glob(struct debug_instance *ds, const char *pattern,
+    debug_type_t t, debug_mask_t mask)
+{
+	struct debug_section_node *n;
+	debug_section_t s, top;
+	size_t len;
+	int i, nmatch = 0;
+
+	if (pattern == NULL || t >= DEBUG_TYPE_MAX)
+		return (-1);
+	len = strlen(pattern);
+
+	(void) pthread_mutex_lock(&debug_section_lock);
+	(void) pthread_mutex_lock(&ds->debug_lock);
+	if (strpbrk(pattern, "*?[\\") == NULL) {
+		s = debug_section_find_locked(ds, pattern, len);
+		if (s >= 0) {
+			ds->levels[t][s] = mask;
+			debug_levels_any_update(ds, s);
+			nmatch++;
+		}
+	} else if (len > 2 && strcmp(pattern + len - 2, ".*") == 0 &&
+	    strpbrk(pattern, "*?[\\") == pattern + len - 1) {
+		/* Pre-order walk of everything below top */
+		top = debug_section_find_locked(ds, pattern, len - 2);
+		s = (top >= 0) ? ds->sections[top].child - 1 : -1;
+		while (s >= 0) {
+			ds->levels[t][s] = mask;
+			debug_levels_any_update(ds, s);
+			nmatch++;
+
+			n = &ds->sections[s];
+			if (n->child != 0) {
+				s = n->child - 1;
+				continue;
+			}
+			while (s != top && ds->sections[s].sibling == 0)
+				s = ds->sections[s].parent - 1;
+			s = (s == top) ? -1 : ds->sections[s].sibling - 1;
+		}
+	} else {
+		for (i = 0; i < ds->nsections; i++) {
+			if (fnmatch(pattern, ds->level_strs[i], 0) != 0)
+				continue;
+			ds->levels[t][i] = mask;
+			debug_levels_any_update(ds, i);
+			nmatch++;
+		}
+	}
+	(void) pthread_mutex_unlock(&ds->debug_lock);
+	(void) pthread_mutex_unlock(&debug_section_lock);
+
+	fprintf(stderr, "%s: setting debug '%s' (%d sections) to %llx\n",
+	    __func__, pattern, nmatch, (unsigned long long) mask);
+	return (nmatch);
+}
+
+int
+debug_setmask_glob(const char *pattern, debug_type_t t, debug_mask_t mask)
+{
+
+	return (debug_instance_setmask_glob(&debugInstance, pattern, t, mask));
+}
+
+/*
+ * As debug_setmask_glob(), but with the type given by name.  Returns
+ * -1 if the type is unknown or nothing matched.
+ */
+int
+debug_setmask_str2(const char *dbg, const char *dtype, debug_mask_t mask)
+{
+	int t_i;
+
+	/* Type lookup */
+	if (strncmp("syslog", dtype, 6) == 0) {
+		t_i = DEBUG_TYPE_SYSLOG;
+	} else if (strncmp("trace", dtype, 5) == 0) {
+		t_i = DEBUG_TYPE_TRACE;
+	} else if (strncmp("log", dtype, 4) == 0) {
+		t_i = DEBUG_TYPE_LOG;
+	} else if (strncmp("print", dtype, 4) == 0) {
+		t_i = DEBUG_TYPE_PRINT;
+	} else {
+		return (-1);
+	}
+
+	if (debug_setmask_glob(dbg, t_i, mask) <= 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Upper bound of the bucket the pth fraction of the samples added
+ * to a histogram since prev falls in.
+ */
+static uint64_t
+debug_stats_pct(const uint64_t *h, const uint64_t *prev, double p)
+{
+	uint64_t n = 0, want, sum = 0;
+	int i;
+
+	for (i = 0; i < DEBUG_STATS_HIST_SIZE; i++)
+		n += h[i] - prev[i];
+	if (n == 0)
+		return (0);
+	want = (uint64_t) (n * p);
+	for (i = 0; i < DEBUG_STATS_HIST_SIZE - 1; i++) {
+		sum += h[i] - prev[i];
+		if (sum > want)
+			break;
+	}
+	return (i == 0 ? 0 : (1ULL << i) - 1);
+}
+
+/*
+ * Log the periodic stats line if it's due, with the counts since the
+ * last one.  Returns the milliseconds until the next, or -1 if they're
+ * turned off.
+ */
+static int
+debug_instance_stats_tick(struct debug_instance *ds)
+{
+	struct debug_stats st, *p = &ds->stats_prev;
+	unsigned int iv;
+	uint64_t now;
+
+	iv = __atomic_load_n(&ds->stats_interval_ms, __ATOMIC_RELAXED);
+	if (iv == 0)
+		return (-1);
+	now = debug_sink_now_ms();
+
+	/* Start counting from when they're turned on */
+	if (iv != ds->stats_interval_cur) {
+		ds->stats_interval_cur = iv;
+		ds->stats_next_ms = now + iv;
+		debug_instance_stats_get(ds, p);
+		return (iv);
+	}
+	if (now < ds->stats_next_ms)
+		return (ds->stats_next_ms - now);
+	ds->stats_next_ms = now + iv;
+
+	debug_instance_stats_get(ds, &st);
+	DEBUG_I(ds, ds->stats_section, DEBUG_LVL_INFO,
+	    "libdebug stats: queued=%llu written=%llu dropped=%llu "
+	    "sink_dropped=%llu batches=%llu depth=%llu depth_max=%llu "
+	    "latency_p50_us=%llu latency_p99_us=%llu\n",
+	    (unsigned long long) (st.queued - p->queued),
+	    (unsigned long long) (st.written - p->written),
+	    (unsigned long long) (st.dropped - p->dropped),
+	    (unsigned long long) (st.sink_dropped - p->sink_dropped),
+	    (unsigned long long) (st.batches - p->batches),
+	    (unsigned long long) st.queue_depth,
+	    (unsigned long long) st.queue_depth_max,
+	    (unsigned long long) debug_stats_pct(st.latency_ns,
+	    p->latency_ns, 0.5) / 1000,
+	    (unsigned long long) debug_stats_pct(st.latency_ns,
+	    p->latency_ns, 0.99) / 1000);
+	*p = st;
+	return (iv);
+}
+
+static void *
+debug_run_thread(void *arg)
+{
+	struct debug_instance *ds = arg;
+	struct timespec ts;
+	int ms, wait, ret, sms, idle;
+
+	while (1) {
+		debug_clock_recalibrate(&ds->clock);
+		__atomic_store_n(&debug_tick_ns,
+		    OS_clock_gettime_ns(OS_CLOCK_MONOTONIC), __ATOMIC_RELAXED);
+		sms = debug_instance_stats_tick(ds);
+
+		/*
+		 * Take /all/ of the items off the thread rings, along
+		 * with any report of messages we've had to drop.
+		 */
+		if (debug_instance_drain(ds) +
+		    debug_instance_report_drops(ds) == 0) {
+			/* Write out anything the flush interval is up for */
+			pthread_mutex_lock(&ds->debug_file_lock);
+			ms = debug_instance_flush_locked(ds, 0);
+			pthread_mutex_unlock(&ds->debug_file_lock);
+
+			/* Keep the rate limit tick going while it's in use */
+			wait = ms;
+			idle = 0;
+			if (__atomic_load_n(&debug_ratelimit_active,
+			    __ATOMIC_RELAXED) &&
+			    (wait < 0 || wait > DEBUG_TICK_MS))
+				wait = DEBUG_TICK_MS;
+			if (wait < 0 && sms >= 0) {
+				idle = 1;
+				wait = sms;
+			} else if (sms >= 0 && wait > sms)
+				wait = sms;
+
+			pthread_mutex_lock(&ds->debug_lock);
+
+			/*
+			 * Only exit once the rings are empty so nothing
+			 * queued before debug_shutdown() is lost.
+			 */
+			if (ds->debug_thr_do_exit) {
+				pthread_mutex_unlock(&ds->debug_lock);
+				return (NULL);
+			}
+
+			/*
+			 * Tell producers we're going to sleep, then check
+			 * again in case something was queued in between.
+			 */
+			atomic_store_explicit(&ds->debug_thr_sleeping, 1,
+			    memory_order_seq_cst);
+			ret = 0;
+			if (! debug_instance_pending(ds)) {
+				clock_gettime(CLOCK_REALTIME, &ts);
+				if (wait >= 0) {
+					ts.tv_sec += wait / 1000;
+					ts.tv_nsec += (wait % 1000) * 1000000L;
+					if (ts.tv_nsec >= 1000000000L) {
+						ts.tv_sec++;
+						ts.tv_nsec -= 1000000000L;
+					}
+				} else
+					ts.tv_sec += 5;
+				/* XXX handle error */
+				ret = pthread_cond_timedwait(&ds->log_cond,
+				    &ds->debug_lock, &ts);
+			}
+			atomic_store_explicit(&ds->debug_thr_sleeping, 0,
+			    memory_order_relaxed);
+			pthread_mutex_unlock(&ds->debug_lock);
+
+			/*
+			 * Don't sit on data forever under the byte or
+			 * warning flush policies once things go quiet.
+			 */
+			if (ret == ETIMEDOUT && (wait < 0 || idle)) {
+				pthread_mutex_lock(&ds->debug_file_lock);
+				(void) debug_instance_flush_locked(ds, 1);
+				pthread_mutex_unlock(&ds->debug_file_lock);
+			}
+			continue;
+		}
+
+		/* File IO goes here */
+		pthread_mutex_lock(&ds->debug_file_lock);
+		debug_instance_log_batch_locked(ds);
+		pthread_mutex_unlock(&ds->debug_file_lock);
+
+		/* And hand the ring space back */
+		debug_instance_release(ds);
+	}
+}
+
+/*
+ * Registered sinks see every section, so their masks are folded into
+ * each section's combined mask.
+ */
+static void
+debug_sink_levels_update(struct debug_instance *ds)
+{
+	int i;
+
+	(void) pthread_mutex_lock(&ds->debug_lock);
+	ds->sink_levels = ds->worker_mask;
+	for (i = 0; i < ds->nsections; i++)
+		debug_levels_any_update(ds, i);
+	(void) pthread_mutex_unlock(&ds->debug_lock);
+}
+
+/*
+ * Set up an instance and start its logger thread.  t is the
+ * instance's own section tables, or NULL for the globals.
+ *
+ * Returns 0, or -1 with errno set if the logger thread couldn't be
+ * started; everything set up here has been torn down again by then.
+ */
+static int
+debug_init_instance(struct debug_instance *ds, debug_clock_t clk,
+    struct debug_section_tables *t)
+{
+	int ret;
+
+	bzero(ds, sizeof(*ds));
+	ds->tables = t;
+	debug_instance_tables_set(ds);
+	memcpy(ds->default_lvl, debug_default_lvl, sizeof(ds->default_lvl));
+
+	debug_clock_init(&ds->clock, clk);
+	__atomic_store_n(&debug_tick_ns,
+	    OS_clock_gettime_ns(OS_CLOCK_MONOTONIC), __ATOMIC_RELAXED);
+
+	ds->debug_queue_limit = 128;
+	ds->debug_queue_limit_bytes = DEBUG_RING_DEFAULT_SIZE;
+	ds->debug_ts_format = DEBUG_TSFMT_DEFAULT;
+	ds->debug_flush.policy = DEBUG_FLUSH_BATCH;
+	debug_sink_init(&ds->stderr_sink, STDERR_FILENO);
+	debug_sink_init(&ds->file_sink, -1);
+	debug_logfile_init(&ds->logfile);
+	ds->file_sink.lf = &ds->logfile;
+	ds->debug_ts_start = OS_clock_gettime_ns(OS_CLOCK_REALTIME);
+	ds->gen = __atomic_add_fetch(&debug_instance_gen, 1, __ATOMIC_RELAXED);
+	TAILQ_INIT(&ds->threads);
+
+	pthread_mutex_init(&ds->debug_thread_lock, NULL);
+	(void) pthread_key_create(&ds->debug_thread_key, debug_thread_exit);
+	pthread_mutex_init(&ds->debug_lock, NULL);
+	pthread_mutex_init(&ds->debug_file_lock, NULL);
+	pthread_cond_init(&ds->log_cond, NULL);
+	pthread_cond_init(&ds->space_cond, NULL);
+
+	debug_worker_init(ds);
+	debug_syslog_sink_init(&ds->syslog, ds->level_strs);
+	ds->syslog_worker = debug_worker_register(ds, &debug_syslog_sink_ops,
+	    &ds->syslog, 0, DEBUG_TYPE_SYSLOG);
+
+	ret = pthread_create(&ds->log_thread, NULL,
+	    debug_run_thread, ds);
+	if (ret != 0) {
+		debug_worker_shutdown(ds);
+		debug_syslog_sink_free(&ds->syslog);
+		debug_sink_free(&ds->stderr_sink);
+		debug_sink_free(&ds->file_sink);
+		debug_logfile_free(&ds->logfile);
+		(void) pthread_key_delete(ds->debug_thread_key);
+		pthread_cond_destroy(&ds->log_cond);
+		pthread_cond_destroy(&ds->space_cond);
+		pthread_mutex_destroy(&ds->debug_lock);
+		pthread_mutex_destroy(&ds->debug_file_lock);
+		pthread_mutex_destroy(&ds->debug_thread_lock);
+		errno = ret;
+		return (-1);
 	}
+	return (0);
+}
+
+/*
+ * Register a sink.  ops->write is called on a thread of the sink's
+ * own with every line whose mask matches mask, in any section; the
+ * sink can't slow down the other destinations, but if it falls too
+ * far behind it will miss lines.  Returns the sink id, or -1.
+ */
+int
+debug_instance_sink_register(struct debug_instance *ds,
+    const struct debug_sink_ops *ops, void *arg, debug_mask_t mask)
+{
+	int id;
+
+	if (ops == NULL || ops->write == NULL)
+		return (-1);
+	id = debug_worker_register(ds, ops, arg, mask, -1);
+	debug_sink_levels_update(ds);
+	return (id);
+}
+
+int
+debug_sink_register(const struct debug_sink_ops *ops, void *arg,
+    debug_mask_t mask)
+{
+
+	return (debug_instance_sink_register(&debugInstance, ops, arg, mask));
+}
+
+void
+debug_instance_sink_set_mask(struct debug_instance *ds, int id,
+    debug_mask_t mask)
+{
+
+	if (id == ds->syslog_worker)
+		return;
+	debug_worker_set_mask(ds, id, mask);
+	debug_sink_levels_update(ds);
+}
+
+void
+debug_sink_set_mask(int id, debug_mask_t mask)
+{
+
+	debug_instance_sink_set_mask(&debugInstance, id, mask);
+}
+
+/*
+ * Unregister a sink; this waits for it to write out the lines it
+ * has already been given and then calls ops->close.
+ */
+void
+debug_instance_sink_unregister(struct debug_instance *ds, int id)
+{
+
+	if (id == ds->syslog_worker)
+		return;
+	debug_worker_unregister(ds, id);
+	debug_sink_levels_update(ds);
+}
+
+void
+debug_sink_unregister(int id)
+{
+
+	debug_instance_sink_unregister(&debugInstance, id);
+}
+
+void
+debug_init(const char *progname)
+{
+
+	debug_init_clock(progname, DEBUG_CLOCK_REALTIME);
+}
+
+/*
+ * Initialise, choosing the timestamp source.
+ *
+ * The coarse clock is much cheaper than the full realtime clock but
+ * only has tick resolution.  The TSC is cheaper still; debug_init_clock()
+ * spends about 10ms calibrating it and falls back to the realtime
+ * clock on platforms without one.
+ */
+void
+debug_init_clock(const char *progname, debug_clock_t clk)
+{
+
+	if (debug_init_instance(&debugInstance, clk, NULL) != 0)
+		err(1, "pthread_create");
+	debug_section_reset(&debugInstance);
+
+	debug_trace_set_progname(progname);
+
+	/* Enable syslog debugging by default */
+	debug_syslog_sink_ident(&debugInstance.syslog, progname);
+	debugInstance.debug_syslog_enable = 1;
+}
+
+/*
+ * Set the per-thread queue limits.
+ *
+ * The entry limit takes effect immediately; the byte limit sizes
+ * the rings of threads which log for the first time after this.
+ */
+void
+debug_instance_set_queue_limit(struct debug_instance *ds, int nentries,
+    size_t nbytes)
+{
+
+	if (nentries > 0)
+		atomic_store_explicit(&ds->debug_queue_limit, nentries,
+		    memory_order_relaxed);
+	if (nbytes > 0)
+		ds->debug_queue_limit_bytes = nbytes;
+}
+
+void
+debug_set_queue_limit(int nentries, size_t nbytes)
+{
+
+	debug_instance_set_queue_limit(&debugInstance, nentries, nbytes);
+}
+
+/*
+ * Set what happens when a thread's queue is full; timeout_ms is
+ * only used by DEBUG_OVERFLOW_BLOCK.
+ *
+ * This should be set before any threads start logging.
+ */
+void
+debug_instance_set_overflow_policy(struct debug_instance *ds,
+    debug_overflow_t policy, unsigned int timeout_ms)
+{
+
+	ds->debug_overflow_timeout_ms = timeout_ms;
+	ds->debug_overflow_policy = policy;
+}
+
+void
+debug_set_overflow_policy(debug_overflow_t policy, unsigned int timeout_ms)
+{
+
+	debug_instance_set_overflow_policy(&debugInstance, policy, timeout_ms);
+}
+
+/*
+ * Enable/disable deferred formatting.
+ *
+ * When enabled, DEBUG() only captures the format string pointer
+ * and the argument values and the logger thread does the formatting.
+ * The format string must remain valid until it's logged, so this is
+ * only safe if every format passed to DEBUG() is a string literal.
+ */
+void
+debug_instance_set_deferred_format(struct debug_instance *ds, int enable)
+{
 
-	/* Get wall clock timestamp */
-	(void) gettimeofday(&tv, NULL);
+	ds->debug_defer_format = !! enable;
+}
 
-	de = debug_entry_create();
-	if (de == NULL) {
-		/* XXX TODO: statistics */
-		return;
-	}
+void
+debug_set_deferred_format(int enable)
+{
 
-	/* Log the message itself */
-	va_start(ap, fmt);
-	vsnprintf(buf, 512, fmt, ap);
-	va_end(ap);
+	debug_instance_set_deferred_format(&debugInstance, enable);
+}
 
-	/* And now, log the errno string */
-	/* XXX TODO: use strerror_r() */
-	snprintf(de->buf, 512, "%s: %s (%d)\n",
-	    buf,
-	    strerror(xerrno),
-	    xerrno);
+/*
+ * Set the timestamp prefix format used for log lines.
+ */
+void
+debug_instance_set_timestamp_format(struct debug_instance *ds,
+    debug_tsfmt_t fmt)
+{
 
-	de->tv = tv;
+	pthread_mutex_lock(&ds->debug_file_lock);
+	__atomic_store_n(&ds->debug_ts_format, fmt, __ATOMIC_RELAXED);
+	ds->debug_ts_valid = 0;
+	pthread_mutex_unlock(&ds->debug_file_lock);
+}
 
-	/* XXX TODO: bounds check these */
-	de->debug_section = section;
-	de->debug_mask = mask;
+void
+debug_set_timestamp_format(debug_tsfmt_t fmt)
+{
 
-	/* Queue entry, wakeup worker thread */
-	/* XXX TODO: yes, methodize this */
-	(void) pthread_mutex_lock(&ds->debug_lock);
-	debug_entry_queue_locked(ds, de);
-	pthread_cond_signal(&ds->log_cond);
-	(void) pthread_mutex_unlock(&ds->debug_lock);
+	debug_instance_set_timestamp_format(&debugInstance, fmt);
 }
 
+/*
+ * Set the line format used for every destination.  Lines already
+ * queued come out in the new format.
+ */
 void
-debug_setmask_str(const char *dbg, debug_type_t t, debug_mask_t mask)
+debug_instance_set_output_format(struct debug_instance *ds,
+    debug_output_t fmt)
 {
-	int i;
-	int len;
 
-	/* XXX locking */
+	pthread_mutex_lock(&ds->debug_file_lock);
+	__atomic_store_n(&ds->debug_output_format, fmt, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ds->debug_file_lock);
+}
 
+void
+debug_set_output_format(debug_output_t fmt)
+{
 
-	len = strlen(dbg);
+	debug_instance_set_output_format(&debugInstance, fmt);
+}
 
-	for (i = 0; i < DEBUG_SECTION_MAX; i++) {
-		if (debug_level_strs[i] == NULL)
-			break;
-		if (strlen(debug_level_strs[i]) == len &&
-		    strncmp(debug_level_strs[i], dbg, len) == 0)
-			break;
-	}
-	fprintf(stderr, "%s: setting debug '%s' (%d) to %llx\n",
-	    __func__, dbg, i, (unsigned long long) mask);
-	if (i >= DEBUG_SECTION_MAX)
-		return;		/* XXX return something useful? */
+/*
+ * Set when the logger thread writes queued output out.  nbytes is
+ * used by DEBUG_FLUSH_BYTES and msec by DEBUG_FLUSH_INTERVAL.
+ *
+ * Anything held back is written out when the logger has been idle
+ * for a while, when the log file is closed/reopened and at shutdown.
+ */
+void
+debug_instance_set_flush_policy(struct debug_instance *ds,
+    debug_flush_t policy, size_t nbytes, unsigned int msec)
+{
 
-	debug_setlevel(i, t, mask);
+	pthread_mutex_lock(&ds->debug_file_lock);
+	ds->debug_flush.policy = policy;
+	ds->debug_flush.nbytes = nbytes;
+	ds->debug_flush.msec = msec;
+	debug_sink_flush(&ds->stderr_sink);
+	debug_sink_flush(&ds->file_sink);
+	pthread_mutex_unlock(&ds->debug_file_lock);
 }
 
-int
-debug_setmask_str2(const char *dbg, const char *dtype, debug_mask_t mask)
+void
+debug_set_flush_policy(debug_flush_t policy, size_t nbytes,
+    unsigned int msec)
 {
-	int i;
-	int len;
-	int d_i, t_i;
 
-	len = strlen(dbg);
+	debug_instance_set_flush_policy(&debugInstance, policy, nbytes, msec);
+}
 
-	/* XXX locking */
+/*
+ * Compress the log file.  level is the compressor's level, or -1
+ * for its default.  An open log file is closed and reopened, which
+ * starts a new gzip member/zstd frame on the end of it.
+ *
+ * Returns -1 if the library was built without support for c.
+ */
+int
+debug_instance_set_file_compression(struct debug_instance *ds,
+    debug_compress_t c, int level)
+{
 
-	/* Section lookup */
-	for (i = 0; i < DEBUG_SECTION_MAX; i++) {
-		if (debug_level_strs[i] == NULL)
-			break;
-		if (strlen(debug_level_strs[i]) == len &&
-		    strncmp(debug_level_strs[i], dbg, len) == 0)
-			break;
-	}
-	if (i >= DEBUG_SECTION_MAX)
+	if (! debug_logfile_compress_ok(c))
 		return (-1);
-	if (debug_level_strs[i] == NULL)
-		return (-1);
-	d_i = i;
 
-	/* Type lookup */
-	if (strncmp("syslog", dtype, 6) == 0) {
-		t_i = DEBUG_TYPE_SYSLOG;
-	} else if (strncmp("log", dtype, 4) == 0) {
-		t_i = DEBUG_TYPE_LOG;
-	} else if (strncmp("print", dtype, 4) == 0) {
-		t_i = DEBUG_TYPE_PRINT;
-	} else {
-		return (-1);
-	}
+	pthread_mutex_lock(&ds->debug_file_lock);
+	ds->logfile.compress = c;
+	ds->logfile.level = level;
+	if (ds->file_sink.fd >= 0)
+		debug_file_open_locked(ds);
+	pthread_mutex_unlock(&ds->debug_file_lock);
+	return (0);
+}
 
-	fprintf(stderr, "%s: setting debug '%s' (%d) to %llx\n",
-	    __func__, dbg, i, (unsigned long long) mask);
+int
+debug_set_file_compression(debug_compress_t c, int level)
+{
 
-	debug_setlevel(d_i, t_i, mask);
-	return (0);
+	return (debug_instance_set_file_compression(&debugInstance, c,
+	    level));
 }
 
-static void *
-debug_run_thread(void *arg)
+/*
+ * Write the log file asynchronously through io_uring, so a slow disk
+ * doesn't hold up the logger thread.  Returns -1 if io_uring isn't
+ * available, in which case the file is still written with writev().
+ */
+int
+debug_instance_set_file_async(struct debug_instance *ds, int enable)
 {
-        TAILQ_HEAD(, debug_entry) staging_list;
-	struct debug_instance *ds = arg;
-	struct debug_entry *de;
-	struct timespec ts;
-	int ret, r;
+	int ret;
 
-	pthread_mutex_lock(&ds->debug_lock);
+	pthread_mutex_lock(&ds->debug_file_lock);
+	debug_sink_flush(&ds->file_sink);
+	ret = debug_logfile_set_async(&ds->logfile, enable);
+	pthread_mutex_unlock(&ds->debug_file_lock);
+	return (ret);
+}
 
-	while (1) {
-		r = 0;
-
-		/* Only wait if the list is empty */
-		if (ds->nitems == 0) {
-			clock_gettime(CLOCK_REALTIME, &ts);
-			ts.tv_sec += 5;
-			ret = pthread_cond_timedwait(&ds->log_cond, &ds->debug_lock, &ts);
-			if (ret == EWOULDBLOCK && ds->nitems == 0)
-				continue;
+int
+debug_set_file_async(int enable)
+{
 
-			/* XXX handle error */
-			if (ret != 0 && ds->nitems == 0)
-				continue;
-		}
+	return (debug_instance_set_file_async(&debugInstance, enable));
+}
 
-		if (ds->debug_thr_do_exit) {
-			pthread_mutex_unlock(&ds->debug_lock);
-			return (NULL);
-		}
+/*
+ * Have the logger thread rotate the log file once it reaches nbytes
+ * (compressed) or is max_age seconds old, whichever comes first; 0
+ * disables either.  ngen old files are kept as name.1 (the newest)
+ * to name.ngen, before any .gz/.zst suffix.
+ */
+void
+debug_instance_set_file_rotation(struct debug_instance *ds, uint64_t nbytes,
+    unsigned int max_age, unsigned int ngen)
+{
 
-		/* Take /all/ of the items under the queue lock */
-		TAILQ_INIT(&staging_list);
-		TAILQ_CONCAT(&staging_list, &ds->list, e);
-		ds->nitems = 0;
+	pthread_mutex_lock(&ds->debug_file_lock);
+	ds->logfile.rotate_bytes = nbytes;
+	ds->logfile.rotate_sec = max_age;
+	ds->logfile.ngen = ngen;
+	pthread_mutex_unlock(&ds->debug_file_lock);
+}
 
-		pthread_mutex_unlock(&ds->debug_lock);
+void
+debug_set_file_rotation(uint64_t nbytes, unsigned int max_age,
+    unsigned int ngen)
+{
 
-		/* File IO goes here */
-		pthread_mutex_lock(&ds->debug_file_lock);
-		while (! TAILQ_EMPTY(&staging_list)) {
-			de = TAILQ_FIRST(&staging_list);
-			TAILQ_REMOVE(&staging_list, de, e);
-			r |= debug_instance_log_entry_locked(ds, de);
-			debug_entry_free(de);
-		}
+	debug_instance_set_file_rotation(&debugInstance, nbytes, max_age,
+	    ngen);
+}
 
-		/* Now, do deferred log flushing */
-		debug_instance_flush_locked(ds, r);
+/*
+ * Collapse runs of identical lines (same section, mask and text) into
+ * the first line and a "last message repeated N times" line.  The
+ * repeat count is written when the run ends or after it's been held
+ * for hold_ms.  0 (the default) turns this off.
+ */
+void
+debug_instance_set_coalesce(struct debug_instance *ds, unsigned int hold_ms)
+{
 
-		pthread_mutex_unlock(&ds->debug_file_lock);
+	pthread_mutex_lock(&ds->debug_file_lock);
+	(void) debug_instance_flush_locked(ds, 1);
+	ds->debug_coalesce_ms = hold_ms;
+	ds->coalesce_valid = 0;
+	pthread_mutex_unlock(&ds->debug_file_lock);
+}
 
-		pthread_mutex_lock(&ds->debug_lock);
-	}
+void
+debug_set_coalesce(unsigned int hold_ms)
+{
+
+	debug_instance_set_coalesce(&debugInstance, hold_ms);
 }
 
-static void
-debug_init_instance(struct debug_instance *ds)
+/*
+ * Write lines at any of the levels in mask to destination t straight
+ * from the calling thread, rather than leaving it to the logger
+ * thread, so they're out before DEBUG() returns and a full queue
+ * can't lose them.  Everything else is still queued.  0 (the
+ * default) queues everything.
+ *
+ * Only stderr (DEBUG_TYPE_PRINT) and the log file (DEBUG_TYPE_LOG)
+ * can be written this way; returns -1 for anything else.  A log file
+ * that's compressed or written through io_uring is still left to the
+ * logger.  The calling thread blocks for the write itself, and the
+ * line comes out ahead of anything still queued or held back; see
+ * debug_instance_write_direct().
+ */
+int
+debug_instance_set_sync_levels(struct debug_instance *ds, debug_type_t t,
+    debug_mask_t mask)
 {
-	int ret;
 
-	bzero(ds, sizeof(*ds));
+	if (t != DEBUG_TYPE_PRINT && t != DEBUG_TYPE_LOG)
+		return (-1);
 
-	ds->debug_queue_limit = 128;
-	TAILQ_INIT(&ds->list);
+	pthread_mutex_lock(&ds->debug_file_lock);
+	ds->debug_sync_levels[t] = mask;
+	ds->debug_sync_any = ds->debug_sync_levels[DEBUG_TYPE_PRINT] |
+	    ds->debug_sync_levels[DEBUG_TYPE_LOG];
+	pthread_mutex_unlock(&ds->debug_file_lock);
+	return (0);
+}
 
-	pthread_mutex_init(&ds->debug_lock, NULL);
-	pthread_mutex_init(&ds->debug_file_lock, NULL);
-	pthread_cond_init(&ds->log_cond, NULL);
+int
+debug_set_sync_levels(debug_type_t t, debug_mask_t mask)
+{
 
-	ret = pthread_create(&ds->log_thread, NULL,
-	    debug_run_thread, ds);
-	if (ret < 0) {
-		err(1, "pthread_create");
+	return (debug_instance_set_sync_levels(&debugInstance, t, mask));
+}
+
+/*
+ * Fill in the ring space and inline/spill counts; see
+ * struct debug_ring_stats.
+ */
+void
+debug_ring_stats_get(struct debug_ring_stats *st)
+{
+	struct debug_instance *ds = &debugInstance;
+	struct debug_thread *dt;
+	unsigned int h, t;
+
+	bzero(st, sizeof(*st));
+
+	(void) pthread_mutex_lock(&ds->debug_thread_lock);
+	TAILQ_FOREACH(dt, &ds->threads, t) {
+		h = atomic_load_explicit(&dt->ring_head, memory_order_relaxed);
+		t = atomic_load_explicit(&dt->ring_tail, memory_order_relaxed);
+		st->nbytes += dt->ring_size;
+		st->nfree += dt->ring_size - (t - h);
+		st->ninline += atomic_load_explicit(&dt->nrec_inline,
+		    memory_order_relaxed);
+		st->nspill += atomic_load_explicit(&dt->nrec_spill,
+		    memory_order_relaxed);
+	}
+	st->ninline += ds->retired_inline;
+	st->nspill += ds->retired_spill;
+	(void) pthread_mutex_unlock(&ds->debug_thread_lock);
+}
+
+/*
+ * Fill in the pipeline statistics.  The counters and histograms run
+ * from debug_init(); queue_depth is a snapshot.
+ */
+void
+debug_instance_stats_get(struct debug_instance *ds, struct debug_stats *st)
+{
+	struct debug_thread *dt;
+	int i;
+
+	bzero(st, sizeof(*st));
+
+	(void) pthread_mutex_lock(&ds->debug_thread_lock);
+	TAILQ_FOREACH(dt, &ds->threads, t) {
+		st->queued += atomic_load_explicit(&dt->nrec_inline,
+		    memory_order_relaxed);
+		st->queued += atomic_load_explicit(&dt->nrec_spill,
+		    memory_order_relaxed);
+		st->queue_depth += (unsigned int)
+		    (atomic_load_explicit(&dt->nrec_tail,
+		    memory_order_relaxed) -
+		    atomic_load_explicit(&dt->nrec_stolen,
+		    memory_order_relaxed) -
+		    atomic_load_explicit(&dt->nrec_head,
+		    memory_order_relaxed));
 	}
+	st->queued += ds->retired_inline + ds->retired_spill;
+	st->queue_depth_max = ds->stat_depth_max;
+	st->file_errors = __atomic_load_n(&ds->logfile.nerrors,
+	    __ATOMIC_RELAXED);
+	st->stderr_errors = __atomic_load_n(&ds->stderr_sink.nerrors,
+	    __ATOMIC_RELAXED);
+	(void) pthread_mutex_unlock(&ds->debug_thread_lock);
+
+	/* Reported drops, plus those waiting to be reported */
+	st->dropped = atomic_load_explicit(&ds->stat_dropped,
+	    memory_order_relaxed);
+	for (i = 0; i < DEBUG_SECTION_MAX; i++)
+		st->dropped += atomic_load_explicit(&ds->debug_drops[i],
+		    memory_order_relaxed);
+
+	(void) pthread_mutex_lock(&ds->debug_file_lock);
+	st->written = ds->stat_written;
+	st->batches = ds->stat_batches;
+	memcpy(st->latency_ns, ds->stat_latency_ns, sizeof(st->latency_ns));
+	memcpy(st->batch_size, ds->stat_batch_size, sizeof(st->batch_size));
+	memcpy(st->stderr_write_ns, ds->stderr_sink.write_ns,
+	    sizeof(st->stderr_write_ns));
+	memcpy(st->file_write_ns, ds->file_sink.write_ns,
+	    sizeof(st->file_write_ns));
+	(void) pthread_mutex_unlock(&ds->debug_file_lock);
+
+	(void) pthread_mutex_lock(&ds->worker_lock);
+	st->sink_dropped = ds->stat_sink_dropped;
+	memcpy(st->sink_write_ns, ds->stat_sink_write_ns,
+	    sizeof(st->sink_write_ns));
+	(void) pthread_mutex_unlock(&ds->worker_lock);
 }
 
 void
-debug_init(const char *progname)
+debug_stats_get(struct debug_stats *st)
+{
+
+	debug_instance_stats_get(&debugInstance, st);
+}
+
+/*
+ * Have the logger thread log a line of statistics every sec seconds
+ * through the "libdebug.stats" section at DEBUG_LVL_INFO; use its
+ * masks to pick where it goes.  0 (the default) turns it off.
+ */
+void
+debug_instance_set_stats_interval(struct debug_instance *ds, unsigned int sec)
 {
 
-	debug_init_instance(&debugInstance);
+	if (sec != 0)
+		ds->stats_section = debug_instance_register(ds,
+		    "libdebug.stats");
 
-	bzero(debug_level_strs, sizeof(debug_level_strs));
-	bzero(debug_levels, sizeof(debug_levels));
+	pthread_mutex_lock(&ds->debug_lock);
+	__atomic_store_n(&ds->stats_interval_ms, sec * 1000,
+	    __ATOMIC_RELAXED);
+	pthread_cond_signal(&ds->log_cond);
+	pthread_mutex_unlock(&ds->debug_lock);
+}
 
-	/* Enable syslog debugging by default */
-	openlog(progname, LOG_NDELAY | LOG_NOWAIT | LOG_PID, LOG_DAEMON);
-	debugInstance.debug_syslog_enable = 1;
+void
+debug_set_stats_interval(unsigned int sec)
+{
+
+	debug_instance_set_stats_interval(&debugInstance, sec);
+}
+
+void
+debug_instance_syslog_enable(struct debug_instance *ds)
+{
+
+	ds->debug_syslog_enable = 1;
 }
 
 void
 debug_syslog_enable(void)
 {
 
-	debugInstance.debug_syslog_enable = 1;
+	debug_instance_syslog_enable(&debugInstance);
+}
+
+void
+debug_instance_syslog_disable(struct debug_instance *ds)
+{
+
+	ds->debug_syslog_enable = 0;
 }
 
 void
 debug_syslog_disable(void)
 {
 
-	debugInstance.debug_syslog_enable = 0;
+	debug_instance_syslog_disable(&debugInstance);
+}
+
+/*
+ * Send syslog lines to the datagram socket at path rather than
+ * /dev/log; NULL goes back to /dev/log.
+ */
+int
+debug_instance_syslog_set_path(struct debug_instance *ds, const char *path)
+{
+
+	return (debug_syslog_sink_path(&ds->syslog, path));
+}
+
+int
+debug_syslog_set_path(const char *path)
+{
+
+	return (debug_instance_syslog_set_path(&debugInstance, path));
+}
+
+/*
+ * Set the syslog frame format and facility (LOG_DAEMON, LOG_LOCAL0,
+ * etc; LOG_DAEMON is the default.)
+ */
+int
+debug_instance_syslog_set_format(struct debug_instance *ds,
+    debug_syslog_format_t fmt, int facility)
+{
+
+	if (fmt != DEBUG_SYSLOG_RFC3164 && fmt != DEBUG_SYSLOG_RFC5424)
+		return (-1);
+	if ((facility & ~LOG_FACMASK) != 0)
+		return (-1);
+	debug_syslog_sink_format(&ds->syslog, fmt, facility);
+	return (0);
+}
+
+int
+debug_syslog_set_format(debug_syslog_format_t fmt, int facility)
+{
+
+	return (debug_instance_syslog_set_format(&debugInstance, fmt,
+	    facility));
 }
 
 static void
 debug_shutdown_instance(struct debug_instance *ds)
 {
+	struct debug_thread *dt;
 
 	/* Signal the worker thread to exit */
 	pthread_mutex_lock(&ds->debug_lock);
@@ -705,29 +3584,115 @@ debug_shutdown_instance(struct debug_instance *ds)
 	/* Exit worker thread */
 	pthread_join(ds->log_thread, NULL);
 
+	/* Free the thread rings; live threads will re-register */
+	(void) pthread_key_delete(ds->debug_thread_key);
+	while ((dt = TAILQ_FIRST(&ds->threads)) != NULL) {
+		TAILQ_REMOVE(&ds->threads, dt, t);
+		debug_thread_free(ds, dt);
+	}
+
 	/* Close the log file, if open, which will do a final flush. */
 	pthread_mutex_lock(&ds->debug_file_lock);
+	(void) debug_instance_flush_locked(ds, 1);
 	debug_file_close_locked(ds);
+	debug_sink_flush(&ds->stderr_sink);
+	debug_sink_free(&ds->stderr_sink);
+	debug_sink_free(&ds->file_sink);
+	debug_logfile_free(&ds->logfile);
 	pthread_mutex_unlock(&ds->debug_file_lock);
 
+	/* Let the sink workers finish up */
+	debug_worker_shutdown(ds);
+	debug_syslog_sink_free(&ds->syslog);
+
 	/* Wrap up */
 	pthread_cond_destroy(&ds->log_cond);
+	pthread_cond_destroy(&ds->space_cond);
 	pthread_mutex_destroy(&ds->debug_lock);
 	pthread_mutex_destroy(&ds->debug_file_lock);
+	pthread_mutex_destroy(&ds->debug_thread_lock);
+	free(ds->staging);
+	ds->staging = NULL;
+	ds->nstaging = ds->staging_size = 0;
+	free(ds->render_buf.buf);
+	bzero(&ds->render_buf, sizeof(ds->render_buf));
+	free(ds->drop_buf.buf);
+	bzero(&ds->drop_buf, sizeof(ds->drop_buf));
+	free(ds->coalesce_last.buf);
+	bzero(&ds->coalesce_last, sizeof(ds->coalesce_last));
+	free(ds->coalesce_line.buf);
+	bzero(&ds->coalesce_line, sizeof(ds->coalesce_line));
+	ds->coalesce_valid = 0;
+	ds->coalesce_count = 0;
 }
 
 void
 debug_shutdown(void)
 {
-	int i;
 
 	debug_shutdown_instance(&debugInstance);
+	debug_trace_shutdown();
+	debug_crash_shutdown();
+	debug_shm_shutdown();
 
-	for (i = 0; i < DEBUG_SECTION_MAX; i++) {
-		if (debug_level_strs[i] != NULL) {
-			free(debug_level_strs[i]);
-			debug_level_strs[i] = NULL;
-		}
+	debug_section_reset(&debugInstance);
+}
+
+/*
+ * Create an instance of its own: its own queues, logger thread,
+ * sinks and sections, none of them shared with the default instance
+ * or any other.  The binary trace buffer, the crash buffer, the shm
+ * transport and DEBUG_RATELIMIT()/DEBUG_SAMPLE() only apply to the
+ * default instance.  name is the syslog ident.
+ *
+ * Returns NULL (with errno set) if it couldn't be created.
+ */
+struct debug_instance *
+debug_instance_create(const char *name, debug_clock_t clk)
+{
+	struct debug_section_tables *t;
+	struct debug_instance *ds;
+
+	ds = malloc(sizeof(*ds));
+	if (ds == NULL)
+		return (NULL);
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		free(ds);
+		return (NULL);
+	}
+
+	if (debug_init_instance(ds, clk, t) != 0) {
+		free(t);
+		free(ds);
+		return (NULL);
 	}
-	bzero(debug_levels, sizeof(debug_levels));
+	if (name != NULL)
+		debug_syslog_sink_ident(&ds->syslog, name);
+	ds->debug_syslog_enable = 1;
+	return (ds);
+}
+
+/*
+ * Flush and tear down an instance from debug_instance_create().
+ * Nothing may log to it once this has been called.
+ */
+void
+debug_instance_destroy(struct debug_instance *ds)
+{
+
+	if (ds == NULL || ds == &debugInstance)
+		return;
+	debug_shutdown_instance(ds);
+	debug_section_reset(ds);
+	free(ds->debug_filename);
+	free(ds->tables);
+	free(ds);
+}
+
+struct debug_instance *
+debug_instance_default(void)
+{
+
+	return (&debugInstance);
 }
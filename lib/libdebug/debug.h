@@ -29,22 +29,130 @@
 #ifndef	__LIBIAPP_DEBUG_H__
 #define	__LIBIAPP_DEBUG_H__
 
-#define	DEBUG_SECTION_MAX		256
-#define	DEBUG_TYPE_MAX			3
+/*
+ * The number of debug sections.  This sizes the level tables DEBUG()
+ * indexes directly and the section table in trace files, so it's part
+ * of the ABI and can't be changed by the application.
+ */
+#define	DEBUG_SECTION_MAX		1024
+#define	DEBUG_TYPE_MAX			4
 #define	DEBUG_SECTION_INVALID		0
 
-#if 0
-/* XXX are these needed? */
-struct debug_instance;
-struct debug_entry;
+#ifdef	__cplusplus
+extern "C" {
 #endif
 
+struct debug_instance;
+
 typedef enum {
         DEBUG_TYPE_PRINT,
         DEBUG_TYPE_LOG,
         DEBUG_TYPE_SYSLOG,
+        DEBUG_TYPE_TRACE,
 } debug_type_t;
 
+/*
+ * Log line timestamp prefix formats.
+ *
+ * DEBUG_TSFMT_DEFAULT	2017-01-02 03:04:05 (1483326245.123456)|
+ * DEBUG_TSFMT_ISO8601	2017-01-02T03:04:05.123456+0000|
+ * DEBUG_TSFMT_RELATIVE	+12.123456| (time since debug_init())
+ * DEBUG_TSFMT_EPOCH	1483326245.123456|
+ */
+typedef enum {
+        DEBUG_TSFMT_DEFAULT,
+        DEBUG_TSFMT_ISO8601,
+        DEBUG_TSFMT_RELATIVE,
+        DEBUG_TSFMT_EPOCH,
+} debug_tsfmt_t;
+
+/*
+ * When the logger thread writes out what it has queued:
+ *
+ * DEBUG_FLUSH_BATCH	after every batch (the default)
+ * DEBUG_FLUSH_BYTES	once at least nbytes are waiting
+ * DEBUG_FLUSH_INTERVAL	at most msec after data was queued
+ * DEBUG_FLUSH_WARNING	once a DEBUG_LVL_WARNING or worse entry is logged
+ */
+typedef enum {
+        DEBUG_FLUSH_BATCH,
+        DEBUG_FLUSH_BYTES,
+        DEBUG_FLUSH_INTERVAL,
+        DEBUG_FLUSH_WARNING,
+} debug_flush_t;
+
+/*
+ * Timestamp sources, chosen with debug_init_clock().
+ *
+ * DEBUG_CLOCK_REALTIME		clock_gettime(CLOCK_REALTIME) (the default)
+ * DEBUG_CLOCK_REALTIME_COARSE	the cheaper, tick resolution realtime clock
+ * DEBUG_CLOCK_MONOTONIC	monotonic clock, offset to wall time at init
+ * DEBUG_CLOCK_TSC		raw cycle counter, calibrated against the
+ *				realtime clock and converted by the logger
+ */
+typedef enum {
+        DEBUG_CLOCK_REALTIME,
+        DEBUG_CLOCK_REALTIME_COARSE,
+        DEBUG_CLOCK_MONOTONIC,
+        DEBUG_CLOCK_TSC,
+} debug_clock_t;
+
+/*
+ * What happens to a message when the calling thread's queue is full:
+ *
+ * DEBUG_OVERFLOW_DROP_NEWEST	the new message is dropped (the default)
+ * DEBUG_OVERFLOW_DROP_OLDEST	the oldest messages the logger thread
+ *				hasn't picked up yet are dropped instead
+ * DEBUG_OVERFLOW_BLOCK		wait up to timeout_ms for space, then drop
+ * DEBUG_OVERFLOW_SYNC		format and write it from the calling thread
+ *
+ * Dropped messages are counted per section and reported by the logger.
+ */
+typedef enum {
+        DEBUG_OVERFLOW_DROP_NEWEST,
+        DEBUG_OVERFLOW_DROP_OLDEST,
+        DEBUG_OVERFLOW_BLOCK,
+        DEBUG_OVERFLOW_SYNC,
+} debug_overflow_t;
+
+/*
+ * Log file compression; see debug_set_file_compression().
+ * DEBUG_COMPRESS_ZSTD is only available if libzstd was found when
+ * the library was built.
+ */
+typedef enum {
+        DEBUG_COMPRESS_NONE,
+        DEBUG_COMPRESS_GZIP,
+        DEBUG_COMPRESS_ZSTD,
+} debug_compress_t;
+
+/*
+ * Log line format, for every destination; see debug_set_output_format().
+ *
+ * DEBUG_OUTPUT_TEXT	timestamp prefix and message (the default)
+ * DEBUG_OUTPUT_JSON	one JSON object per line:
+ *			{"ts":1483326245.123456,"section":"net","level":"info",
+ *			"msg":"..."}, with "event" and the fields in place of
+ *			"msg" for DEBUG_KV() lines
+ */
+typedef enum {
+        DEBUG_OUTPUT_TEXT,
+        DEBUG_OUTPUT_JSON,
+} debug_output_t;
+
+/*
+ * Syslog frame format; see debug_syslog_set_format().
+ *
+ * DEBUG_SYSLOG_RFC3164	"<PRI>Mmm dd hh:mm:ss ident[pid]: msg", local time
+ *			(the default)
+ * DEBUG_SYSLOG_RFC5424	"<PRI>1 2017-01-02T03:04:05.123456Z host ident pid
+ *			section - msg"
+ */
+typedef enum {
+        DEBUG_SYSLOG_RFC3164,
+        DEBUG_SYSLOG_RFC5424,
+} debug_syslog_format_t;
+
 typedef int debug_section_t;
 typedef uint64_t debug_mask_t;
 
@@ -52,10 +160,167 @@ typedef uint64_t debug_mask_t;
 
 #define	DEBUG_SECTION_UNINIT	-1
 
+/*
+ * Per-thread ring statistics; see debug_ring_stats_get().
+ *
+ * nbytes/nfree are the total and currently free space across the
+ * per-thread rings.  ninline are messages which were stored in the
+ * rings; nspill are oversized messages which spilled to the heap.
+ */
+struct debug_ring_stats {
+	uint64_t nbytes;
+	uint64_t nfree;
+	uint64_t ninline;
+	uint64_t nspill;
+};
+
+/*
+ * Logging pipeline statistics; see debug_stats_get().
+ *
+ * The histograms have log2 buckets: bucket 0 counts zeroes and bucket
+ * i values from 2^(i-1) to 2^i - 1, with the last bucket also taking
+ * anything larger.  Latency is from the DEBUG() call to the line being
+ * handed to the destinations; write times are per writev()/sink call.
+ */
+#define	DEBUG_STATS_HIST_SIZE		32
+
+struct debug_stats {
+	uint64_t queued;		/* entries queued by all threads */
+	uint64_t written;		/* entries written out */
+	uint64_t dropped;		/* entries dropped for a full queue */
+	uint64_t sink_dropped;		/* lines dropped by lagging sinks */
+	uint64_t batches;		/* logger thread batches */
+	uint64_t queue_depth;		/* entries queued right now */
+	uint64_t queue_depth_max;	/* most any thread has had queued */
+	uint64_t file_errors;		/* failed log file writes */
+	uint64_t stderr_errors;		/* failed stderr writes */
+	uint64_t latency_ns[DEBUG_STATS_HIST_SIZE];
+	uint64_t batch_size[DEBUG_STATS_HIST_SIZE];
+	uint64_t stderr_write_ns[DEBUG_STATS_HIST_SIZE];
+	uint64_t file_write_ns[DEBUG_STATS_HIST_SIZE];
+	uint64_t sink_write_ns[DEBUG_STATS_HIST_SIZE];	/* and syslog */
+};
+
+/*
+ * Captured argument tags, as used for deferred formatting and by
+ * do_debug_args().  Each argument is the tag byte followed by its
+ * value, unaligned and in host byte order.  Integers are always
+ * captured as 64 bit values and cast back to the type the conversion
+ * expects when rendered.
+ */
+#define	DEBUG_ARG_INT			1
+#define	DEBUG_ARG_UINT			2
+#define	DEBUG_ARG_DOUBLE		3
+#define	DEBUG_ARG_LDOUBLE		4
+#define	DEBUG_ARG_PTR			5
+#define	DEBUG_ARG_STR			6	/* uint32 len, bytes, NUL */
+#define	DEBUG_ARG_BOOL			7
+#define	DEBUG_ARG_NULL			8	/* NULL string, no value */
+
+/*
+ * A structured log field; see DEBUG_KV().  Build these with the DKV_*()
+ * macros.  Strings are copied when the line is queued, so they only
+ * have to last until DEBUG_KV() returns.
+ */
+#define	DEBUG_KV_U64			1
+#define	DEBUG_KV_I64			2
+#define	DEBUG_KV_DBL			3
+#define	DEBUG_KV_STR			4
+#define	DEBUG_KV_BOOL			5
+
+struct debug_kv {
+	const char *key;
+	int type;
+	union {
+		uint64_t u64;
+		int64_t i64;
+		double dbl;
+		const char *str;
+	} v;
+};
+
+#define	DKV_U64(k, x)							\
+	((struct debug_kv) { .key = (k), .type = DEBUG_KV_U64, .v.u64 = (x) })
+#define	DKV_I64(k, x)							\
+	((struct debug_kv) { .key = (k), .type = DEBUG_KV_I64, .v.i64 = (x) })
+#define	DKV_DBL(k, x)							\
+	((struct debug_kv) { .key = (k), .type = DEBUG_KV_DBL, .v.dbl = (x) })
+#define	DKV_STR(k, x)							\
+	((struct debug_kv) { .key = (k), .type = DEBUG_KV_STR, .v.str = (x) })
+#define	DKV_BOOL(k, x)							\
+	((struct debug_kv) { .key = (k), .type = DEBUG_KV_BOOL, .v.u64 = !! (x) })
+
+/*
+ * Per call site state for DEBUG_RATELIMIT() and DEBUG_SAMPLE().
+ *
+ * state is the GCRA "theoretical arrival time" in nanoseconds for a
+ * rate limited site, or the call count for a sampled site.  Sites
+ * which have suppressed anything are linked onto a list so the
+ * logger thread can report the suppressed counts.
+ */
+struct debug_ratelimit {
+	uint64_t state;
+	uint64_t suppressed;
+	struct debug_ratelimit *next;
+	int linked;
+	debug_section_t section;
+	const char *file;
+	int line;
+};
+
+/*
+ * A log line as handed to a registered sink.  prefix is the timestamp
+ * prefix and msg the message, including its newline; neither is NUL
+ * terminated.
+ */
+struct debug_line {
+	uint64_t ts;			/* wall clock, nanoseconds */
+	debug_section_t section;
+	debug_mask_t mask;
+	const char *prefix;
+	int prefix_len;
+	const char *msg;
+	int len;
+};
+
+/*
+ * Registered sink callbacks, called on the sink's own thread.  write
+ * gets runs of lines which pass the sink's mask, in order; close (if
+ * set) is called once the sink is unregistered or at shutdown.
+ */
+struct debug_sink_ops {
+	void (*write)(void *arg, const struct debug_line *lines, int nlines);
+	void (*close)(void *arg);
+};
+
 extern	char *debug_level_strs[DEBUG_SECTION_MAX];
 extern	debug_mask_t debug_levels[DEBUG_TYPE_MAX][DEBUG_SECTION_MAX];
 
+/*
+ * The OR of the print, log and syslog masks for each section, kept
+ * up to date by the level setting functions so DEBUG() only has to
+ * check one word.
+ */
+extern	debug_mask_t debug_levels_any[DEBUG_SECTION_MAX];
+
+/*
+ * Independent instances.  Each has its own sections, level tables,
+ * thread queues, logger thread and destinations, so a library which
+ * embeds libdebug neither shares the application's queue limits nor
+ * fills its queues.  The functions without an instance argument work
+ * on the default instance, which debug_init() sets up and whose level
+ * tables are the arrays above.  Tracing, the crash buffer and the shm
+ * transport are only done for the default instance.
+ *
+ * An instance starts with the table DEBUG_I() checks; the rest of it
+ * is private.
+ */
+struct debug_instance_hdr {
+	debug_mask_t *levels_any;	/* [DEBUG_SECTION_MAX] */
+};
+
 extern	void debug_init(const char *progname);
+extern	void debug_init_clock(const char *progname, debug_clock_t clk);
 extern	void debug_shutdown(void);
 extern	void debug_setlevel_default(debug_type_t t, debug_mask_t m);
 extern	void debug_setlevel_maskcopy(debug_type_t st, debug_type_t dt,
@@ -67,18 +332,131 @@ extern	void debug_setmask(debug_section_t s, debug_type_t t,
 	    debug_mask_t mask);
 extern	void debug_setmask_str(const char *dbg, debug_type_t t,
 	    debug_mask_t mask);
+extern	int debug_setmask_str2(const char *dbg, const char *dtype,
+	    debug_mask_t mask);
+extern	int debug_setmask_glob(const char *pattern, debug_type_t t,
+	    debug_mask_t mask);
+extern	void debug_set_queue_limit(int nentries, size_t nbytes);
+extern	void debug_set_overflow_policy(debug_overflow_t policy,
+	    unsigned int timeout_ms);
+extern	void debug_set_deferred_format(int enable);
+extern	void debug_set_timestamp_format(debug_tsfmt_t fmt);
+extern	void debug_set_output_format(debug_output_t fmt);
+extern	void debug_set_flush_policy(debug_flush_t policy, size_t nbytes,
+	    unsigned int msec);
+extern	void debug_set_coalesce(unsigned int hold_ms);
+extern	int debug_set_sync_levels(debug_type_t t, debug_mask_t mask);
+extern	int debug_sink_register(const struct debug_sink_ops *ops, void *arg,
+	    debug_mask_t mask);
+extern	void debug_sink_set_mask(int id, debug_mask_t mask);
+extern	void debug_sink_unregister(int id);
+extern	void debug_ring_stats_get(struct debug_ring_stats *st);
+extern	void debug_stats_get(struct debug_stats *st);
+extern	void debug_set_stats_interval(unsigned int sec);
+extern	int debug_ratelimit_ok(struct debug_ratelimit *rl, debug_section_t s,
+	    unsigned int rate, unsigned int burst);
+extern	int debug_sample_ok(struct debug_ratelimit *rl, debug_section_t s,
+	    unsigned int n);
 extern	void debug_syslog_enable(void);
 extern	void debug_syslog_disable(void);
 
+extern	struct debug_instance *debug_instance_create(const char *name,
+	    debug_clock_t clk);
+extern	void debug_instance_destroy(struct debug_instance *di);
+extern	struct debug_instance *debug_instance_default(void);
+extern	debug_section_t debug_instance_register(struct debug_instance *di,
+	    const char *dbgname);
+extern	void debug_instance_setlevel_default(struct debug_instance *di,
+	    debug_type_t t, debug_mask_t m);
+extern	void debug_instance_setlevel_maskcopy(struct debug_instance *di,
+	    debug_type_t st, debug_type_t dt, debug_mask_t ma, debug_mask_t mo);
+extern	void debug_instance_setlevel_mask(struct debug_instance *di,
+	    debug_type_t st, debug_mask_t ma, debug_mask_t mo);
+extern	void debug_instance_setmask(struct debug_instance *di,
+	    debug_section_t s, debug_type_t t, debug_mask_t mask);
+extern	int debug_instance_setmask_glob(struct debug_instance *di,
+	    const char *pattern, debug_type_t t, debug_mask_t mask);
+extern	void debug_instance_set_queue_limit(struct debug_instance *di,
+	    int nentries, size_t nbytes);
+extern	void debug_instance_set_overflow_policy(struct debug_instance *di,
+	    debug_overflow_t policy, unsigned int timeout_ms);
+extern	void debug_instance_set_deferred_format(struct debug_instance *di,
+	    int enable);
+extern	void debug_instance_set_timestamp_format(
+	    struct debug_instance *di, debug_tsfmt_t fmt);
+extern	void debug_instance_set_output_format(struct debug_instance *di,
+	    debug_output_t fmt);
+extern	void debug_instance_set_flush_policy(struct debug_instance *di,
+	    debug_flush_t policy, size_t nbytes, unsigned int msec);
+extern	void debug_instance_set_coalesce(struct debug_instance *di,
+	    unsigned int hold_ms);
+extern	int debug_instance_set_sync_levels(struct debug_instance *di,
+	    debug_type_t t, debug_mask_t mask);
+extern	void debug_instance_set_stats_interval(struct debug_instance *di,
+	    unsigned int sec);
+extern	void debug_instance_set_filename(struct debug_instance *di,
+	    const char *filename);
+extern	void debug_instance_file_open(struct debug_instance *di);
+extern	void debug_instance_file_close(struct debug_instance *di);
+extern	void debug_instance_file_reopen(struct debug_instance *di);
+extern	int debug_instance_set_file_compression(struct debug_instance *di,
+	    debug_compress_t c, int level);
+extern	int debug_instance_set_file_async(struct debug_instance *di,
+	    int enable);
+extern	void debug_instance_set_file_rotation(struct debug_instance *di,
+	    uint64_t nbytes, unsigned int max_age, unsigned int ngen);
+extern	int debug_instance_sink_register(struct debug_instance *di,
+	    const struct debug_sink_ops *ops, void *arg, debug_mask_t mask);
+extern	void debug_instance_sink_set_mask(struct debug_instance *di, int id,
+	    debug_mask_t mask);
+extern	void debug_instance_sink_unregister(struct debug_instance *di, int id);
+extern	void debug_instance_stats_get(struct debug_instance *di,
+	    struct debug_stats *st);
+extern	void debug_instance_syslog_enable(struct debug_instance *di);
+extern	void debug_instance_syslog_disable(struct debug_instance *di);
+extern	int debug_instance_syslog_set_path(struct debug_instance *di,
+	    const char *path);
+extern	int debug_instance_syslog_set_format(struct debug_instance *di,
+	    debug_syslog_format_t fmt, int facility);
+extern	int debug_syslog_set_path(const char *path);
+extern	int debug_syslog_set_format(debug_syslog_format_t fmt, int facility);
+
 extern	void debug_set_filename(const char *filename);
 extern	void debug_file_open(void);
 extern	void debug_file_close(void);
 extern	void debug_file_reopen(void);
+extern	int debug_set_file_compression(debug_compress_t c, int level);
+extern	int debug_set_file_async(int enable);
+extern	void debug_set_file_rotation(uint64_t nbytes, unsigned int max_age,
+	    unsigned int ngen);
 
 extern	void do_debug(int section, debug_mask_t mask, const char *fmt, ...)
 	    __attribute__ ((format (printf, 3, 4)));
 extern	void do_debug_warn(int section, int xerrno, const char *fmt, ...)
 	    __attribute__ ((format (printf, 3, 4)));
+extern	void do_debug_i(struct debug_instance *di, int section,
+	    debug_mask_t mask, const char *fmt, ...)
+	    __attribute__ ((format (printf, 4, 5)));
+extern	void do_debug_kv(int section, debug_mask_t mask, const char *event,
+	    const struct debug_kv *kv, int nkv);
+extern	void do_debug_args(int section, debug_mask_t mask, const char *fmt,
+	    const char *args, size_t argslen);
+extern	void do_debug_warn_i(struct debug_instance *di, int section,
+	    int xerrno, const char *fmt, ...)
+	    __attribute__ ((format (printf, 4, 5)));
+extern	void do_debug_kv_i(struct debug_instance *di, int section,
+	    debug_mask_t mask, const char *event, const struct debug_kv *kv,
+	    int nkv);
+extern	void do_debug_args_i(struct debug_instance *di, int section,
+	    debug_mask_t mask, const char *fmt, const char *args,
+	    size_t argslen);
+
+extern	int debug_trace_init(const char *dir, unsigned int nrecs);
+extern	int debug_crash_init(const char *path, unsigned int nlines);
+extern	int debug_crash_handler_install(void);
+extern	int debug_shm_init(const char *dir, size_t size);
+extern	void do_debug_trace(debug_section_t section, uint32_t id, int nargs,
+	    const uint64_t *args);
 
 /*
  * This system currently uses a debug mask (up to 64 bits per section)
@@ -98,6 +476,10 @@ extern	void do_debug_warn(int section, int xerrno, const char *fmt, ...)
 #define	DEBUG_LVL_ALERT		0x00000040
 #define	DEBUG_LVL_EMERG		0x00000080
 
+#define	DEBUG_LVL_WARNING_UP	(DEBUG_LVL_WARNING | DEBUG_LVL_ERR | \
+				 DEBUG_LVL_CRIT | DEBUG_LVL_ALERT | \
+				 DEBUG_LVL_EMERG)
+
 /*
  * The rest of the bitmap space is available for debug sections to
  * define as they wish.
@@ -105,13 +487,15 @@ extern	void do_debug_warn(int section, int xerrno, const char *fmt, ...)
 
 #if 1
 /*
- * XXX TODO: always log DEBUG_LVL_EMERG!
+ * A line is only logged if its level is enabled for the section on
+ * some destination; DEBUG_LVL_EMERG isn't special.  Lines at the
+ * levels given to debug_set_sync_levels() are written by the calling
+ * thread, so a full queue or a stalled logger can't lose them; DEBUG()
+ * then blocks until stderr or the log file has taken the line.
  */
 #define	DEBUG(s, l, m, ...)						\
-	do {			\
-		if ((debug_levels[DEBUG_TYPE_PRINT][(s)] & (l)) ||	\
-		     (debug_levels[DEBUG_TYPE_LOG][(s)] & (l)) ||	\
-		     (debug_levels[DEBUG_TYPE_SYSLOG][(s)] & (l)))	\
+	do {								\
+		if (__builtin_expect((debug_levels_any[(s)] & (l)) != 0, 0)) \
 			do_debug(s, l, m, __VA_ARGS__);			\
 	} while (0)
 
@@ -119,6 +503,94 @@ extern	void do_debug_warn(int section, int xerrno, const char *fmt, ...)
 #define DEBUG(s, l, m, ...)
 #endif
 
+/*
+ * DEBUG() for a section of an instance from debug_instance_create().
+ */
+#define	DEBUG_I(di, s, l, m, ...)					\
+	do {								\
+		if (__builtin_expect((((const struct debug_instance_hdr *) \
+		    (di))->levels_any[(s)] & (l)) != 0, 0))		\
+			do_debug_i((di), s, l, m, __VA_ARGS__);		\
+	} while (0)
+
+/*
+ * Structured logging - DEBUG_KV(section, level, "event", DKV_U64("conn",
+ * id), DKV_STR("peer", p), ...) logs an event name and typed fields.
+ * The values are copied onto the queue as they are and only turned
+ * into text (or JSON) by the logger thread; in text format the line
+ * reads "event conn=12 peer=10.0.0.1".
+ */
+#define	DEBUG_KV(s, l, ev, ...)						\
+	do {								\
+		if (__builtin_expect((debug_levels_any[(s)] & (l)) != 0, 0)) { \
+			const struct debug_kv _dkv[] =			\
+			    { { NULL }, ##__VA_ARGS__ };		\
+			do_debug_kv((s), (l), (ev), _dkv + 1,		\
+			    sizeof(_dkv) / sizeof(_dkv[0]) - 1);	\
+		}							\
+	} while (0)
+
+#define	DEBUG_KV_I(di, s, l, ev, ...)				\
+	do {								\
+		if (__builtin_expect((((const struct debug_instance_hdr *) \
+		    (di))->levels_any[(s)] & (l)) != 0, 0)) {		\
+			const struct debug_kv _dkv[] =			\
+			    { { NULL }, ##__VA_ARGS__ };		\
+			do_debug_kv_i((di), (s), (l), (ev), _dkv + 1,	\
+			    sizeof(_dkv) / sizeof(_dkv[0]) - 1);	\
+		}							\
+	} while (0)
+
+/*
+ * Binary tracing - DEBUG_TRACE(section, id, u64, ...) writes a fixed
+ * size record with up to six 64 bit arguments into the calling
+ * thread's trace ring.  Nothing is formatted; the ring files are
+ * decoded offline.  Tracing is enabled for a section by setting a
+ * non-zero DEBUG_TYPE_TRACE mask.
+ */
+#define	DEBUG_TRACE(s, id, ...)						\
+	do {								\
+		if (__builtin_expect(					\
+		    debug_levels[DEBUG_TYPE_TRACE][(s)] != 0, 0)) {	\
+			const uint64_t _dt_args[] = { 0, ##__VA_ARGS__ };	\
+			do_debug_trace((s), (id),			\
+			    sizeof(_dt_args) / sizeof(_dt_args[0]) - 1,	\
+			    _dt_args + 1);				\
+		}							\
+	} while (0)
+
+/*
+ * Rate limited and sampled logging for busy call sites.
+ *
+ * DEBUG_RATELIMIT(s, l, rate, burst, m, ...) logs at most rate messages
+ * a second from this call site, allowing bursts of up to burst.
+ * DEBUG_SAMPLE(s, l, n, m, ...) logs one in every n calls.
+ *
+ * The check is done after the level check and before do_debug(), so a
+ * suppressed call doesn't allocate or take a lock.  While any site is
+ * suppressing, the rate limit runs off a tick kept by the logger
+ * thread and doesn't read the clock either; otherwise it reads the
+ * monotonic clock.  The number of suppressed calls is logged for each
+ * site about once a second.
+ */
+#define	DEBUG_RATELIMIT(s, l, rate, burst, m, ...)			\
+	do {								\
+		static struct debug_ratelimit _dr_site =		\
+		    { .file = __FILE__, .line = __LINE__ };		\
+		if (__builtin_expect((debug_levels_any[(s)] & (l)) != 0, 0) && \
+		    debug_ratelimit_ok(&_dr_site, (s), (rate), (burst)))	\
+			do_debug(s, l, m, __VA_ARGS__);			\
+	} while (0)
+
+#define	DEBUG_SAMPLE(s, l, n, m, ...)					\
+	do {								\
+		static struct debug_ratelimit _dr_site =		\
+		    { .file = __FILE__, .line = __LINE__ };		\
+		if (__builtin_expect((debug_levels_any[(s)] & (l)) != 0, 0) && \
+		    debug_sample_ok(&_dr_site, (s), (n)))		\
+			do_debug(s, l, m, __VA_ARGS__);			\
+	} while (0)
+
 /*
  * For now, warnings always generate debug info.
  */
@@ -127,4 +599,13 @@ extern	void do_debug_warn(int section, int xerrno, const char *fmt, ...)
 		do_debug_warn(s, errno, __VA_ARGS__);			\
 	} while (0)
 
+#define	DEBUG_WARN_I(di, s, ...)					\
+	do {								\
+		do_debug_warn_i((di), s, errno, __VA_ARGS__);		\
+	} while (0)
+
+#ifdef	__cplusplus
+}
+#endif
+
 #endif	/* __LIBIAPP_DEBUG_H__ */
@@ -0,0 +1,502 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	__LIBIAPP_DEBUG_HPP__
+#define	__LIBIAPP_DEBUG_HPP__
+
+/*
+ * C++17 bindings.
+ *
+ * LDEBUG(section, level, "conn {} state {}", a, b) logs with a
+ * {}-style format.  The format is checked against the argument types
+ * at compile time and turned into a printf format held in static
+ * storage; the argument values are copied into a buffer on the stack
+ * (strings by value) and queued with do_debug_args(), and the logger
+ * thread does the formatting.  Nothing is allocated on the way.
+ * LDEBUG_I(instance, section, level, ...) does the same for an
+ * instance from debug_instance_create().
+ *
+ * Placeholders are "{}", "{:x}"/"{:X}" for hex integers and "{:.N}"
+ * for the precision of a floating point value or the length of a
+ * string; "{{" and "}}" are literal braces.  Arguments can be any
+ * integer, enum, bool, char, floating point value, C string,
+ * std::string, std::string_view or pointer.
+ *
+ * Unlike DEBUG() the line doesn't end in a newline unless the format
+ * does.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "debug.h"
+
+/*
+ * LDEBUG() calls whose level is less severe than this are compiled out
+ * altogether.  Masks with bits above the DEBUG_LVL_* levels are always
+ * compiled in.  The level passed to LDEBUG() has to be a constant.
+ */
+#ifndef	LIBDEBUG_MIN_LEVEL
+#define	LIBDEBUG_MIN_LEVEL		DEBUG_LVL_DEBUG
+#endif
+
+/*
+ * The size of the stack buffer the arguments are captured into.
+ * Strings are cut short if need be so everything fits.
+ */
+#ifndef	LIBDEBUG_ARGS_SIZE
+#define	LIBDEBUG_ARGS_SIZE		1024
+#endif
+
+namespace libdebug {
+
+constexpr bool
+compiled_in(debug_mask_t mask)
+{
+
+	return ((mask & ~(debug_mask_t) 0xff) != 0 ||
+	    (mask & ~((debug_mask_t) LIBDEBUG_MIN_LEVEL - 1)) != 0);
+}
+
+namespace detail {
+
+enum class arg_kind {
+	none, sint, uint, chr, boolean, dbl, ldbl, str, ptr,
+};
+
+template <class T>
+constexpr arg_kind
+kind_of()
+{
+	using U = std::remove_cv_t<std::remove_reference_t<T>>;
+	using D = std::decay_t<U>;
+
+	if constexpr (std::is_same_v<U, bool>)
+		return (arg_kind::boolean);
+	else if constexpr (std::is_same_v<U, char>)
+		return (arg_kind::chr);
+	else if constexpr (std::is_enum_v<U>)
+		return (std::is_signed_v<std::underlying_type_t<U>> ?
+		    arg_kind::sint : arg_kind::uint);
+	else if constexpr (std::is_integral_v<U>)
+		return (std::is_signed_v<U> ? arg_kind::sint : arg_kind::uint);
+	else if constexpr (std::is_same_v<U, long double>)
+		return (arg_kind::ldbl);
+	else if constexpr (std::is_floating_point_v<U>)
+		return (arg_kind::dbl);
+	else if constexpr (std::is_same_v<D, char *> ||
+	    std::is_same_v<D, const char *> ||
+	    std::is_same_v<U, std::string> ||
+	    std::is_same_v<U, std::string_view>)
+		return (arg_kind::str);
+	else if constexpr (std::is_pointer_v<D> || std::is_null_pointer_v<U>)
+		return (arg_kind::ptr);
+	else
+		return (arg_kind::none);
+}
+
+/*
+ * The space to leave for an argument when cutting short a string
+ * before it: its size, or up to 32 bytes of a string.
+ */
+constexpr std::size_t
+min_size(arg_kind k)
+{
+
+	switch (k) {
+	case arg_kind::boolean:
+		return (1 + 4 + 5 + 1);
+	case arg_kind::str:
+		return (1 + 4 + 32 + 1);
+	case arg_kind::ldbl:
+		return (1 + sizeof(long double));
+	default:
+		return (1 + 8);
+	}
+}
+
+/* A "{...}" placeholder: where it starts and ends, and its spec */
+struct placeholder {
+	std::size_t start;
+	std::size_t end;
+	char conv;		/* 'x', 'X' or 0 */
+	int prec;		/* -1 if none */
+};
+
+/*
+ * Parse the placeholder at s[i], which is a '{' which doesn't start
+ * "{{".  Returns false if it's malformed.
+ */
+constexpr bool
+parse_placeholder(const char *s, std::size_t i, placeholder &p)
+{
+
+	p = placeholder{ i, 0, 0, -1 };
+	i++;
+	if (s[i] == ':') {
+		i++;
+		if (s[i] == 'x' || s[i] == 'X') {
+			p.conv = s[i++];
+		} else if (s[i] == '.') {
+			i++;
+			if (s[i] < '0' || s[i] > '9')
+				return (false);
+			p.prec = 0;
+			while (s[i] >= '0' && s[i] <= '9') {
+				p.prec = p.prec * 10 + (s[i++] - '0');
+				if (p.prec > 99)
+					return (false);
+			}
+		}
+	}
+	if (s[i] != '}')
+		return (false);
+	p.end = i + 1;
+	return (true);
+}
+
+/*
+ * Return the number of placeholders in s, or -1 if it has a malformed
+ * one or an unmatched brace.
+ */
+constexpr int
+count_args(const char *s)
+{
+	placeholder p{};
+	std::size_t i = 0;
+	int n = 0;
+
+	for (i = 0; s[i] != '\0'; i++) {
+		if (s[i] == '{' && s[i + 1] == '{') {
+			i++;
+		} else if (s[i] == '{') {
+			if (! parse_placeholder(s, i, p))
+				return (-1);
+			i = p.end - 1;
+			n++;
+		} else if (s[i] == '}') {
+			if (s[i + 1] != '}')
+				return (-1);
+			i++;
+		}
+	}
+	return (n);
+}
+
+/* Whether placeholder spec p makes sense for an argument of kind k */
+constexpr bool
+spec_ok(arg_kind k, const placeholder &p)
+{
+
+	if (p.conv != 0)
+		return (k == arg_kind::sint || k == arg_kind::uint);
+	if (p.prec >= 0)
+		return (k == arg_kind::dbl || k == arg_kind::ldbl ||
+		    k == arg_kind::str);
+	return (true);
+}
+
+/*
+ * The printf format for F::str() with arguments A, built at compile
+ * time.  No conversion is longer than twice its placeholder and a '%'
+ * becomes "%%", so the result fits in twice the length.
+ */
+template <class F, class... A>
+struct format {
+	static constexpr std::size_t len =
+	    std::char_traits<char>::length(F::str());
+	static constexpr arg_kind kinds[] = { kind_of<A>()..., arg_kind::none };
+	static constexpr std::size_t nargs = sizeof...(A);
+
+	/* Whether each placeholder suits its argument */
+	static constexpr bool
+	check()
+	{
+		const char *s = F::str();
+		placeholder p{};
+		std::size_t i = 0, n = 0;
+
+		for (i = 0; s[i] != '\0'; i++) {
+			if ((s[i] == '{' && s[i + 1] == '{') || s[i] == '}') {
+				i++;
+			} else if (s[i] == '{') {
+				if (! parse_placeholder(s, i, p) || n >= nargs ||
+				    ! spec_ok(kinds[n], p))
+					return (false);
+				i = p.end - 1;
+				n++;
+			}
+		}
+		return (true);
+	}
+
+	static constexpr std::array<char, 2 * len + 1>
+	build()
+	{
+		std::array<char, 2 * len + 1> out{};
+		const char *s = F::str();
+		const char *c = nullptr;
+		placeholder p{};
+		std::size_t i = 0, o = 0, n = 0;
+
+		for (i = 0; s[i] != '\0'; i++) {
+			if ((s[i] == '{' && s[i + 1] == '{') ||
+			    (s[i] == '}' && s[i + 1] == '}')) {
+				out[o++] = s[i++];
+				continue;
+			}
+			if (s[i] == '%') {
+				out[o++] = '%';
+				out[o++] = '%';
+				continue;
+			}
+			if (s[i] != '{') {
+				out[o++] = s[i];
+				continue;
+			}
+			if (! parse_placeholder(s, i, p) || n >= nargs)
+				break;
+			i = p.end - 1;
+
+			out[o++] = '%';
+			if (p.prec >= 0) {
+				out[o++] = '.';
+				if (p.prec >= 10)
+					out[o++] = '0' + p.prec / 10;
+				out[o++] = '0' + p.prec % 10;
+			}
+			switch (kinds[n++]) {
+			case arg_kind::sint:
+				c = p.conv == 'x' ? "llx" :
+				    p.conv == 'X' ? "llX" : "lld";
+				break;
+			case arg_kind::uint:
+				c = p.conv == 'x' ? "llx" :
+				    p.conv == 'X' ? "llX" : "llu";
+				break;
+			case arg_kind::chr:
+				c = "c";
+				break;
+			case arg_kind::dbl:
+				c = "g";
+				break;
+			case arg_kind::ldbl:
+				c = "Lg";
+				break;
+			case arg_kind::ptr:
+				c = "p";
+				break;
+			default:
+				c = "s";
+				break;
+			}
+			for (; *c != '\0'; c++)
+				out[o++] = *c;
+		}
+		out[o] = '\0';
+		return (out);
+	}
+
+	static constexpr std::array<char, 2 * len + 1> value = build();
+};
+
+/* The on-stack capture buffer, in the encoding do_debug_args() takes */
+struct argbuf {
+	char buf[LIBDEBUG_ARGS_SIZE];
+	std::size_t len = 0;
+
+	void
+	put(int tag, const void *v, std::size_t n)
+	{
+
+		if (len + 1 + n > sizeof(buf))
+			return;
+		buf[len++] = (char) tag;
+		std::memcpy(buf + len, v, n);
+		len += n;
+	}
+
+	void
+	put_int(int tag, uint64_t v)
+	{
+
+		put(tag, &v, sizeof(v));
+	}
+
+	/* Leave reserve bytes for the arguments after this one if we can */
+	void
+	put_str(const char *s, std::size_t n, std::size_t reserve)
+	{
+		std::size_t room;
+		uint32_t l;
+
+		if (len + 1 + sizeof(l) + 1 > sizeof(buf))
+			return;
+		room = sizeof(buf) - len - 1 - sizeof(l) - 1;
+		room = room > reserve ? room - reserve : 0;
+		if (n > room)
+			n = room;
+		l = n;
+		buf[len++] = DEBUG_ARG_STR;
+		std::memcpy(buf + len, &l, sizeof(l));
+		len += sizeof(l);
+		std::memcpy(buf + len, s, n);
+		len += n;
+		buf[len++] = '\0';
+	}
+};
+
+template <class T>
+inline void
+put_arg(argbuf &ab, const T &v, std::size_t reserve)
+{
+	using U = std::remove_cv_t<std::remove_reference_t<T>>;
+	constexpr arg_kind k = kind_of<T>();
+
+	if constexpr (k == arg_kind::boolean) {
+		ab.put_str(v ? "true" : "false", v ? 4 : 5, reserve);
+	} else if constexpr (std::is_enum_v<U>) {
+		ab.put_int(k == arg_kind::sint ? DEBUG_ARG_INT : DEBUG_ARG_UINT,
+		    (uint64_t) static_cast<std::underlying_type_t<U>>(v));
+	} else if constexpr (k == arg_kind::sint || k == arg_kind::chr) {
+		ab.put_int(DEBUG_ARG_INT, (uint64_t) (int64_t) v);
+	} else if constexpr (k == arg_kind::uint) {
+		ab.put_int(DEBUG_ARG_UINT, (uint64_t) v);
+	} else if constexpr (k == arg_kind::dbl) {
+		double d = v;
+
+		ab.put(DEBUG_ARG_DOUBLE, &d, sizeof(d));
+	} else if constexpr (k == arg_kind::ldbl) {
+		ab.put(DEBUG_ARG_LDOUBLE, &v, sizeof(v));
+	} else if constexpr (k == arg_kind::str) {
+		if constexpr (std::is_class_v<U>) {
+			ab.put_str(v.data(), v.size(), reserve);
+		} else {
+			const char *p = v;
+
+			if (p == nullptr)
+				p = "(null)";
+			ab.put_str(p, std::strlen(p), reserve);
+		}
+	} else if constexpr (k == arg_kind::ptr) {
+		if constexpr (std::is_null_pointer_v<U>)
+			ab.put_int(DEBUG_ARG_PTR, 0);
+		else
+			ab.put_int(DEBUG_ARG_PTR, (uint64_t) (uintptr_t) v);
+	}
+}
+
+/* The space the arguments after each one need, at the least */
+template <class... A>
+constexpr std::array<std::size_t, sizeof...(A) + 1>
+reserves()
+{
+	constexpr arg_kind kinds[] = { kind_of<A>()..., arg_kind::none };
+	std::array<std::size_t, sizeof...(A) + 1> r{};
+	std::size_t i = 0;
+
+	for (i = sizeof...(A); i > 0; i--)
+		r[i - 1] = r[i] +
+		    (i < sizeof...(A) ? min_size(kinds[i]) : 0);
+	return (r);
+}
+
+template <class F, class... A>
+inline void
+log(struct debug_instance *di, int section, debug_mask_t mask,
+    const A &... a)
+{
+	constexpr int n = count_args(F::str());
+	constexpr std::array<std::size_t, sizeof...(A) + 1> r = reserves<A...>();
+	argbuf ab;
+	std::size_t i = 0;
+
+	static_assert(n >= 0,
+	    "LDEBUG: malformed {} placeholder or unmatched brace");
+	static_assert(n == (int) sizeof...(A),
+	    "LDEBUG: the number of {} doesn't match the number of arguments");
+	static_assert(((kind_of<A>() != arg_kind::none) && ...),
+	    "LDEBUG: unsupported argument type");
+	static_assert(format<F, A...>::check(),
+	    "LDEBUG: a {:x} or {:.N} doesn't suit its argument's type");
+
+	(put_arg(ab, a, r[i++]), ...);
+	(void) r;
+	(void) i;
+	if (di == nullptr)
+		do_debug_args(section, mask, format<F, A...>::value.data(),
+		    ab.buf, ab.len);
+	else
+		do_debug_args_i(di, section, mask,
+		    format<F, A...>::value.data(), ab.buf, ab.len);
+}
+
+}	/* namespace detail */
+}	/* namespace libdebug */
+
+/*
+ * LDEBUG(section, level, "format {}", ...): see above.  The arguments
+ * are only evaluated if the section has the level enabled somewhere.
+ */
+#define	LDEBUG(s, l, f, ...)						\
+	do {								\
+		if constexpr (::libdebug::compiled_in(l)) {		\
+			if (__builtin_expect(				\
+			    (debug_levels_any[(s)] & (l)) != 0, 0)) {	\
+				struct _ldebug_fmt {			\
+					static constexpr const char *	\
+					str() { return (f); }		\
+				};					\
+				::libdebug::detail::log<_ldebug_fmt>(nullptr, \
+				    (s), (l), ##__VA_ARGS__);		\
+			}						\
+		}							\
+	} while (0)
+
+#define	LDEBUG_I(di, s, l, f, ...)				\
+	do {								\
+		if constexpr (::libdebug::compiled_in(l)) {		\
+			if (__builtin_expect((((const struct		\
+			    debug_instance_hdr *) (di))->levels_any[(s)] & \
+			    (l)) != 0, 0)) {				\
+				struct _ldebug_fmt {			\
+					static constexpr const char *	\
+					str() { return (f); }		\
+				};					\
+				::libdebug::detail::log<_ldebug_fmt>((di), \
+				    (s), (l), ##__VA_ARGS__);		\
+			}						\
+		}							\
+	} while (0)
+
+#endif	/* __LIBIAPP_DEBUG_HPP__ */
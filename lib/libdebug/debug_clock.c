@@ -0,0 +1,197 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Timestamp sources.
+ *
+ * Callers stamp each record with a raw reading of the chosen clock;
+ * the logger thread converts that to wall clock nanoseconds.  For
+ * the monotonic clock that's a fixed offset taken at init; for the
+ * TSC it's a rate calibrated against the realtime clock, refined
+ * by the logger thread as it runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#include "os/time.h"
+
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#include "debug.h"
+#include "debug_internal.h"
+
+/* How long the initial TSC calibration spins for */
+#define	DEBUG_CLOCK_TSC_CAL_NS		(10 * 1000000ULL)
+
+/* How often the logger thread refines the TSC calibration */
+#define	DEBUG_CLOCK_TSC_RECAL_NS	(100 * 1000000ULL)
+
+/*
+ * Set the TSC rate from the calibration start to (tsc, ns), as a
+ * fixed point multiplier so conversions don't need floating point.
+ */
+static void
+debug_clock_tsc_rate(struct debug_clock *c, uint64_t tsc, uint64_t ns)
+{
+
+	c->tsc_mult = (uint64_t) ((double) (ns - c->ns_cal) *
+	    (double) (1ULL << DEBUG_CLOCK_SHIFT) /
+	    (double) (tsc - c->tsc_cal));
+}
+
+/*
+ * Scale a TSC delta to nanoseconds.  It's split at the shift so the
+ * multiplications can't overflow for any delta.
+ */
+static inline uint64_t
+debug_clock_tsc_scale(const struct debug_clock *c, uint64_t d)
+{
+	uint64_t lo = d & ((1ULL << DEBUG_CLOCK_SHIFT) - 1);
+
+	return ((d >> DEBUG_CLOCK_SHIFT) * c->tsc_mult +
+	    ((lo * c->tsc_mult) >> DEBUG_CLOCK_SHIFT));
+}
+
+/*
+ * Take a (TSC, wall clock) pair, reading the TSC either side of the
+ * clock so the pair is as tight as possible.
+ */
+static void
+debug_clock_tsc_sample(uint64_t *tsc, uint64_t *ns)
+{
+	uint64_t t0, t1;
+
+	t0 = OS_tsc_read();
+	*ns = OS_clock_gettime_ns(OS_CLOCK_REALTIME);
+	t1 = OS_tsc_read();
+	*tsc = t0 + (t1 - t0) / 2;
+}
+
+void
+debug_clock_init(struct debug_clock *c, debug_clock_t type)
+{
+	uint64_t tsc, ns;
+
+	bzero(c, sizeof(*c));
+
+#ifndef	OS_HAVE_TSC
+	if (type == DEBUG_CLOCK_TSC)
+		type = DEBUG_CLOCK_REALTIME;
+#endif
+
+	c->type = type;
+	switch (type) {
+	case DEBUG_CLOCK_REALTIME_COARSE:
+		c->clk_id = OS_CLOCK_REALTIME_COARSE;
+		break;
+	case DEBUG_CLOCK_MONOTONIC:
+		c->clk_id = OS_CLOCK_MONOTONIC;
+		c->offset = OS_clock_gettime_ns(OS_CLOCK_REALTIME) -
+		    OS_clock_gettime_ns(OS_CLOCK_MONOTONIC);
+		break;
+	case DEBUG_CLOCK_TSC:
+		c->clk_id = OS_CLOCK_REALTIME;
+		debug_clock_tsc_sample(&c->tsc_cal, &c->ns_cal);
+		do {
+			debug_clock_tsc_sample(&tsc, &ns);
+		} while (ns - c->ns_cal < DEBUG_CLOCK_TSC_CAL_NS);
+		if (tsc == c->tsc_cal) {
+			/* No usable counter */
+			c->type = DEBUG_CLOCK_REALTIME;
+			break;
+		}
+		debug_clock_tsc_rate(c, tsc, ns);
+		c->tsc_base = tsc;
+		c->ns_base = ns;
+		break;
+	case DEBUG_CLOCK_REALTIME:
+	default:
+		c->type = DEBUG_CLOCK_REALTIME;
+		c->clk_id = OS_CLOCK_REALTIME;
+		break;
+	}
+}
+
+/*
+ * Refine the TSC rate against the longer baseline since init and
+ * re-anchor to the current wall clock so it follows clock steps.
+ *
+ * Only called from the logger thread.
+ */
+void
+debug_clock_recalibrate(struct debug_clock *c)
+{
+	uint64_t tsc, ns;
+
+	if (c->type != DEBUG_CLOCK_TSC)
+		return;
+	ns = OS_clock_gettime_ns(OS_CLOCK_REALTIME);
+	if (ns - c->ns_base < DEBUG_CLOCK_TSC_RECAL_NS)
+		return;
+
+	debug_clock_tsc_sample(&tsc, &ns);
+	if (tsc > c->tsc_cal && ns > c->ns_cal)
+		debug_clock_tsc_rate(c, tsc, ns);
+	c->tsc_base = tsc;
+	c->ns_base = ns;
+}
+
+/*
+ * Convert a raw timestamp to wall clock nanoseconds.
+ *
+ * This is also used by the crash handler, so it's integer arithmetic
+ * only.
+ */
+uint64_t
+debug_clock_to_ns(const struct debug_clock *c, uint64_t ts)
+{
+	uint64_t d;
+
+	switch (c->type) {
+	case DEBUG_CLOCK_MONOTONIC:
+		return (ts + c->offset);
+	case DEBUG_CLOCK_TSC:
+		/* Records can predate the last re-anchoring */
+		d = ts - c->tsc_base;
+		if ((int64_t) d >= 0)
+			return (c->ns_base + debug_clock_tsc_scale(c, d));
+		return (c->ns_base - debug_clock_tsc_scale(c, -d));
+	default:
+		return (ts);
+	}
+}
@@ -0,0 +1,441 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Crash buffer and crash handler.
+ *
+ * The logger thread copies every line it writes into a small file
+ * backed ring, so the most recent output survives the process dying.
+ * The optional signal handler dumps that ring, whatever is still
+ * queued on the thread rings and the most recent trace records to
+ * stderr and the log file before letting the signal kill the process.
+ *
+ * Everything reachable from the signal handler must be
+ * async-signal-safe: no locks, no stdio, no allocation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#include "debug.h"
+#include "debug_internal.h"
+#include "debug_trace.h"
+
+/* How many of each thread's most recent trace records to dump */
+#define	DEBUG_CRASH_TRACE_RECS		32
+
+#define	DEBUG_CRASH_ALTSTACK_SIZE	65536
+
+static const int debug_crash_signals[] = {
+	SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT
+};
+#define	DEBUG_CRASH_NSIGNALS						\
+	(sizeof(debug_crash_signals) / sizeof(debug_crash_signals[0]))
+
+static struct debug_crash_hdr *debug_crash_hdr;
+static char *debug_crash_lines;
+static size_t debug_crash_maplen;
+
+static struct sigaction debug_crash_oact[DEBUG_CRASH_NSIGNALS];
+static int debug_crash_installed;
+static void *debug_crash_altstack;
+static atomic_int debug_crash_active;
+
+/*
+ * Alternate signal stacks given to the threads which log; they're
+ * freed by the key destructor when each thread exits.
+ */
+static pthread_once_t debug_crash_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t debug_crash_key;
+static __thread int debug_crash_thr_checked;
+
+/*
+ * Async-signal-safe output helpers.
+ */
+void
+debug_crash_write(int fd, const char *s, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, s, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return;
+		s += r;
+		len -= r;
+	}
+}
+
+void
+debug_crash_write_str(int fd, const char *s)
+{
+
+	debug_crash_write(fd, s, strlen(s));
+}
+
+void
+debug_crash_write_u64(int fd, uint64_t v, int base, int width)
+{
+	char buf[64];
+
+	debug_crash_write(fd, buf, debug_u64toa(buf, v, base, width));
+}
+
+/*
+ * Create the crash buffer file, holding the last nlines lines
+ * (rounded up to a power of two.)
+ */
+int
+debug_crash_init(const char *path, unsigned int nlines)
+{
+	struct debug_crash_hdr *h;
+	size_t off, maplen;
+	unsigned int n;
+	void *p;
+	int fd;
+
+	if (path == NULL || nlines == 0 || debug_crash_hdr != NULL)
+		return (-1);
+
+	for (n = 1; n < nlines && n < (1U << 20); n <<= 1)
+		;
+
+	off = (sizeof(*h) + DEBUG_CACHELINE_SIZE - 1) &
+	    ~(DEBUG_CACHELINE_SIZE - 1);
+	maplen = off + (size_t) n * DEBUG_CRASH_LINE_SIZE;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open failed (%s): %s\n",
+		    __func__, path, strerror(errno));
+		return (-1);
+	}
+	if (ftruncate(fd, maplen) < 0) {
+		fprintf(stderr, "%s: ftruncate failed (%s): %s\n",
+		    __func__, path, strerror(errno));
+		close(fd);
+		return (-1);
+	}
+	p = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap failed (%s): %s\n",
+		    __func__, path, strerror(errno));
+		return (-1);
+	}
+
+	h = p;
+	h->magic = DEBUG_CRASH_MAGIC;
+	h->version = DEBUG_CRASH_VERSION;
+	h->line_size = DEBUG_CRASH_LINE_SIZE;
+	h->nlines = n;
+	h->line_offset = off;
+	h->pid = getpid();
+	h->widx = 0;
+
+	debug_crash_lines = (char *) p + off;
+	debug_crash_maplen = maplen;
+	debug_crash_hdr = h;
+	return (0);
+}
+
+/*
+ * Copy a log line into the crash buffer.
+ *
+ * The slot is claimed atomically as lines may also be written from
+ * outside the logger thread.
+ */
+void
+debug_crash_log(const char *prefix, int plen, const char *msg, int len)
+{
+	struct debug_crash_hdr *h = debug_crash_hdr;
+	size_t pl, ml;
+	uint64_t w;
+	char *l;
+
+	if (h == NULL)
+		return;
+
+	w = __atomic_fetch_add(&h->widx, 1, __ATOMIC_RELAXED);
+	l = debug_crash_lines + (w & (h->nlines - 1)) * h->line_size;
+
+	pl = plen;
+	if (pl > h->line_size - 1)
+		pl = h->line_size - 1;
+	ml = len;
+	if (ml > h->line_size - 1 - pl)
+		ml = h->line_size - 1 - pl;
+	memcpy(l, prefix, pl);
+	memcpy(l + pl, msg, ml);
+	l[pl + ml] = '\0';
+}
+
+/*
+ * Write the crash buffer lines out, oldest first.
+ */
+static void
+debug_crash_dump_lines(int fd)
+{
+	struct debug_crash_hdr *h = debug_crash_hdr;
+	const char *l;
+	uint64_t i, w;
+	size_t len;
+
+	if (h == NULL)
+		return;
+
+	w = __atomic_load_n(&h->widx, __ATOMIC_RELAXED);
+	debug_crash_write_str(fd, "--- libdebug: last logged lines ---\n");
+	i = (w > h->nlines) ? w - h->nlines : 0;
+	for (; i < w; i++) {
+		l = debug_crash_lines + (i & (h->nlines - 1)) * h->line_size;
+		len = strnlen(l, h->line_size);
+		debug_crash_write(fd, l, len);
+		if (len == 0 || l[len - 1] != '\n')
+			debug_crash_write(fd, "\n", 1);
+	}
+}
+
+/*
+ * Hand the signal to whatever handler was installed before ours.
+ * If there wasn't one, or it returns, the default action kills us.
+ */
+static void
+debug_crash_chain(int sig, siginfo_t *si, void *uc)
+{
+	struct sigaction *oact = NULL, dfl;
+	unsigned int i;
+
+	for (i = 0; i < DEBUG_CRASH_NSIGNALS; i++) {
+		if (debug_crash_signals[i] == sig)
+			oact = &debug_crash_oact[i];
+	}
+	if (oact != NULL && (oact->sa_flags & SA_SIGINFO) != 0 &&
+	    oact->sa_sigaction != NULL)
+		oact->sa_sigaction(sig, si, uc);
+	else if (oact != NULL && (oact->sa_flags & SA_SIGINFO) == 0 &&
+	    oact->sa_handler != SIG_DFL && oact->sa_handler != SIG_IGN)
+		oact->sa_handler(sig);
+
+	/*
+	 * SA_RESETHAND put the default action back, unless the chained
+	 * handler changed it; the signal is blocked until we return, at
+	 * which point it kills us.
+	 */
+	bzero(&dfl, sizeof(dfl));
+	dfl.sa_handler = SIG_DFL;
+	(void) sigaction(sig, &dfl, NULL);
+	(void) raise(sig);
+}
+
+static void
+debug_crash_handler(int sig, siginfo_t *si, void *uc)
+{
+	int fds[2];
+	int i, nfd;
+
+	/* Only one thread gets to dump; the rest wait to be killed */
+	if (atomic_exchange(&debug_crash_active, 1) != 0) {
+		for (;;)
+			pause();
+	}
+
+	fds[0] = STDERR_FILENO;
+	nfd = 1;
+	i = debug_instance_crash_fd();
+	if (i >= 0 && i != STDERR_FILENO)
+		fds[nfd++] = i;
+
+	for (i = 0; i < nfd; i++) {
+		debug_crash_write_str(fds[i], "*** libdebug: caught signal ");
+		debug_crash_write_u64(fds[i], sig, 10, 0);
+		debug_crash_write_str(fds[i], " (pid ");
+		debug_crash_write_u64(fds[i], getpid(), 10, 0);
+		if (si != NULL && (sig == SIGSEGV || sig == SIGBUS)) {
+			debug_crash_write_str(fds[i], ", addr 0x");
+			debug_crash_write_u64(fds[i],
+			    (uintptr_t) si->si_addr, 16, 0);
+		}
+		debug_crash_write_str(fds[i], ")\n");
+
+		debug_crash_dump_lines(fds[i]);
+		debug_instance_crash_dump(fds[i]);
+		debug_trace_crash_dump(fds[i], DEBUG_CRASH_TRACE_RECS);
+		debug_crash_write_str(fds[i], "*** libdebug: end of dump\n");
+	}
+
+	debug_crash_chain(sig, si, uc);
+}
+
+static void
+debug_crash_altstack_free(void *arg)
+{
+	stack_t ss;
+
+	bzero(&ss, sizeof(ss));
+	ss.ss_flags = SS_DISABLE;
+	(void) sigaltstack(&ss, NULL);
+	free(arg);
+}
+
+static void
+debug_crash_key_init(void)
+{
+
+	(void) pthread_key_create(&debug_crash_key, debug_crash_altstack_free);
+}
+
+/*
+ * Give the calling thread an alternate signal stack, if the crash
+ * handler is installed and the thread doesn't have one already, so
+ * a stack overflow on it can be reported.  This is called the first
+ * time a thread logs.
+ */
+void
+debug_crash_thread_init(void)
+{
+	stack_t ss, oss;
+
+	if (debug_crash_thr_checked ||
+	    ! __atomic_load_n(&debug_crash_installed, __ATOMIC_ACQUIRE))
+		return;
+	debug_crash_thr_checked = 1;
+
+	if (sigaltstack(NULL, &oss) < 0 || (oss.ss_flags & SS_DISABLE) == 0)
+		return;
+	(void) pthread_once(&debug_crash_key_once, debug_crash_key_init);
+	ss.ss_sp = malloc(DEBUG_CRASH_ALTSTACK_SIZE);
+	if (ss.ss_sp == NULL)
+		return;
+	ss.ss_size = DEBUG_CRASH_ALTSTACK_SIZE;
+	ss.ss_flags = 0;
+	if (sigaltstack(&ss, NULL) < 0 ||
+	    pthread_setspecific(debug_crash_key, ss.ss_sp) != 0) {
+		debug_crash_altstack_free(ss.ss_sp);
+		return;
+	}
+}
+
+/*
+ * Install the crash handler for SIGSEGV, SIGBUS, SIGILL, SIGFPE
+ * and SIGABRT.  Once the dump is written the signal is passed on to
+ * the handler which was installed before this one, if any.
+ *
+ * An alternate signal stack is set up for the calling thread, and for
+ * each thread when it first logs from then on, so stack overflows can
+ * be reported too.  Threads which had already logged (or never log)
+ * need their own sigaltstack() for that.
+ */
+int
+debug_crash_handler_install(void)
+{
+	struct sigaction sa;
+	stack_t ss;
+	unsigned int i;
+
+	if (debug_crash_installed)
+		return (0);
+
+	debug_crash_altstack = malloc(DEBUG_CRASH_ALTSTACK_SIZE);
+	if (debug_crash_altstack != NULL) {
+		ss.ss_sp = debug_crash_altstack;
+		ss.ss_size = DEBUG_CRASH_ALTSTACK_SIZE;
+		ss.ss_flags = 0;
+		if (sigaltstack(&ss, NULL) < 0) {
+			free(debug_crash_altstack);
+			debug_crash_altstack = NULL;
+		}
+	}
+
+	bzero(&sa, sizeof(sa));
+	sa.sa_sigaction = debug_crash_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESETHAND | SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+
+	for (i = 0; i < DEBUG_CRASH_NSIGNALS; i++) {
+		if (sigaction(debug_crash_signals[i], &sa,
+		    &debug_crash_oact[i]) < 0) {
+			fprintf(stderr, "%s: sigaction(%d) failed: %s\n",
+			    __func__, debug_crash_signals[i],
+			    strerror(errno));
+			while (i-- > 0)
+				(void) sigaction(debug_crash_signals[i],
+				    &debug_crash_oact[i], NULL);
+			return (-1);
+		}
+	}
+	__atomic_store_n(&debug_crash_installed, 1, __ATOMIC_RELEASE);
+	return (0);
+}
+
+/*
+ * Restore the original signal handlers and unmap the crash buffer.
+ * The crash buffer file is left behind.
+ */
+void
+debug_crash_shutdown(void)
+{
+	stack_t ss;
+	unsigned int i;
+
+	if (debug_crash_installed) {
+		for (i = 0; i < DEBUG_CRASH_NSIGNALS; i++)
+			(void) sigaction(debug_crash_signals[i],
+			    &debug_crash_oact[i], NULL);
+		debug_crash_installed = 0;
+	}
+	if (debug_crash_altstack != NULL) {
+		bzero(&ss, sizeof(ss));
+		ss.ss_flags = SS_DISABLE;
+		(void) sigaltstack(&ss, NULL);
+		free(debug_crash_altstack);
+		debug_crash_altstack = NULL;
+	}
+	if (debug_crash_hdr != NULL) {
+		(void) munmap(debug_crash_hdr, debug_crash_maplen);
+		debug_crash_hdr = NULL;
+		debug_crash_lines = NULL;
+	}
+}
@@ -0,0 +1,1067 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Deferred formatting.
+ *
+ * The caller side walks the printf format string and copies the raw
+ * argument values into a compact tagged buffer; strings are copied
+ * by value.  The logger thread later walks the same format string
+ * and renders each conversion with the captured argument.
+ *
+ * DEBUG_KV() fields are encoded with the same tags and rendered as
+ * text or JSON, and the JSON line format lives here too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <sys/types.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#include "debug.h"
+#include "debug_internal.h"
+
+/* Length modifiers */
+#define	DEBUG_FMT_LEN_NONE	0
+#define	DEBUG_FMT_LEN_HH	1
+#define	DEBUG_FMT_LEN_H		2
+#define	DEBUG_FMT_LEN_L		3
+#define	DEBUG_FMT_LEN_LL	4
+#define	DEBUG_FMT_LEN_J		5
+#define	DEBUG_FMT_LEN_Z		6
+#define	DEBUG_FMT_LEN_T		7
+#define	DEBUG_FMT_LEN_LD	8	/* 'L' */
+
+#define	DEBUG_FMT_SPEC_MAX	32
+
+struct debug_fmt_spec {
+	int speclen;		/* length from the '%' up to the conversion */
+	char conv;
+	int lenmod;
+	int nstar;		/* number of '*' width/precision arguments */
+	int prec_star;		/* precision is a '*' argument */
+	int prec;		/* literal precision, or -1 */
+};
+
+/*
+ * Parse a single conversion specification starting at the '%'.
+ *
+ * Returns a pointer past the conversion character, or NULL if it's
+ * something we don't know how to defer (positional arguments, %n,
+ * wide strings, etc.)
+ */
+static const char *
+debug_fmt_parse(const char *p, struct debug_fmt_spec *sp)
+{
+	const char *s = p;
+
+	bzero(sp, sizeof(*sp));
+	sp->prec = -1;
+	p++;
+
+	/* Flags */
+	while (*p != '\0' && strchr("-+ #0'", *p) != NULL)
+		p++;
+
+	/* Width */
+	if (*p == '*') {
+		sp->nstar++;
+		p++;
+	} else {
+		while (*p >= '0' && *p <= '9')
+			p++;
+		if (*p == '$')
+			return (NULL);
+	}
+
+	/* Precision */
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			sp->nstar++;
+			sp->prec_star = 1;
+			p++;
+		} else {
+			sp->prec = 0;
+			while (*p >= '0' && *p <= '9') {
+				sp->prec = sp->prec * 10 + (*p - '0');
+				p++;
+			}
+		}
+	}
+
+	/* Length modifier */
+	switch (*p) {
+	case 'h':
+		p++;
+		sp->lenmod = DEBUG_FMT_LEN_H;
+		if (*p == 'h') {
+			p++;
+			sp->lenmod = DEBUG_FMT_LEN_HH;
+		}
+		break;
+	case 'l':
+		p++;
+		sp->lenmod = DEBUG_FMT_LEN_L;
+		if (*p == 'l') {
+			p++;
+			sp->lenmod = DEBUG_FMT_LEN_LL;
+		}
+		break;
+	case 'q':
+		p++;
+		sp->lenmod = DEBUG_FMT_LEN_LL;
+		break;
+	case 'j':
+		p++;
+		sp->lenmod = DEBUG_FMT_LEN_J;
+		break;
+	case 'z':
+		p++;
+		sp->lenmod = DEBUG_FMT_LEN_Z;
+		break;
+	case 't':
+		p++;
+		sp->lenmod = DEBUG_FMT_LEN_T;
+		break;
+	case 'L':
+		p++;
+		sp->lenmod = DEBUG_FMT_LEN_LD;
+		break;
+	}
+
+	if (*p == '\0')
+		return (NULL);
+	sp->conv = *p++;
+	sp->speclen = p - s;
+	if (sp->speclen >= DEBUG_FMT_SPEC_MAX)
+		return (NULL);
+
+	switch (sp->conv) {
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+	case 'a': case 'A': case 'p': case '%':
+		return (p);
+	case 'c':
+	case 's':
+		/* No wide characters / strings */
+		if (sp->lenmod != DEBUG_FMT_LEN_NONE)
+			return (NULL);
+		return (p);
+	default:
+		return (NULL);
+	}
+}
+
+/*
+ * Argument buffer encoding.
+ *
+ * Each argument is a one byte tag followed by the raw value; values
+ * aren't aligned, so they're always accessed via memcpy().
+ */
+struct debug_argbuf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int
+debug_arg_put(struct debug_argbuf *ab, int tag, const void *v, size_t len)
+{
+
+	if (ab->len + 1 + len > ab->size)
+		return (-1);
+	ab->buf[ab->len++] = tag;
+	memcpy(ab->buf + ab->len, v, len);
+	ab->len += len;
+	return (0);
+}
+
+static int
+debug_arg_put_int(struct debug_argbuf *ab, int tag, uint64_t v)
+{
+
+	return (debug_arg_put(ab, tag, &v, sizeof(v)));
+}
+
+static int
+debug_arg_put_str(struct debug_argbuf *ab, const char *s, size_t len)
+{
+	uint32_t l = len;
+
+	if (ab->len + 1 + sizeof(l) + len + 1 > ab->size)
+		return (-1);
+	ab->buf[ab->len++] = DEBUG_ARG_STR;
+	memcpy(ab->buf + ab->len, &l, sizeof(l));
+	ab->len += sizeof(l);
+	memcpy(ab->buf + ab->len, s, len);
+	ab->len += len;
+	ab->buf[ab->len++] = '\0';
+	return (0);
+}
+
+/*
+ * Capture the arguments for fmt into buf.
+ *
+ * Returns the number of bytes used, or -1 if the format can't be
+ * deferred or the arguments don't fit; the caller should format
+ * the message itself in that case.
+ */
+int
+debug_fmt_capture(char *buf, size_t buflen, const char *fmt, va_list ap)
+{
+	struct debug_argbuf ab = { buf, 0, buflen };
+	struct debug_fmt_spec sp;
+	const char *p = fmt, *s;
+	long double ld;
+	double d;
+	int i, star[2];
+	int64_t iv;
+	uint64_t uv;
+	size_t l;
+
+	while ((p = strchr(p, '%')) != NULL) {
+		p = debug_fmt_parse(p, &sp);
+		if (p == NULL)
+			return (-1);
+		if (sp.conv == '%')
+			continue;
+
+		for (i = 0; i < sp.nstar; i++) {
+			star[i] = va_arg(ap, int);
+			if (debug_arg_put_int(&ab, DEBUG_ARG_INT, star[i]) < 0)
+				return (-1);
+		}
+
+		switch (sp.conv) {
+		case 'd':
+		case 'i':
+			switch (sp.lenmod) {
+			case DEBUG_FMT_LEN_L:
+				iv = va_arg(ap, long);
+				break;
+			case DEBUG_FMT_LEN_LL:
+				iv = va_arg(ap, long long);
+				break;
+			case DEBUG_FMT_LEN_J:
+				iv = va_arg(ap, intmax_t);
+				break;
+			case DEBUG_FMT_LEN_Z:
+				iv = va_arg(ap, ssize_t);
+				break;
+			case DEBUG_FMT_LEN_T:
+				iv = va_arg(ap, ptrdiff_t);
+				break;
+			default:
+				iv = va_arg(ap, int);
+				break;
+			}
+			if (debug_arg_put_int(&ab, DEBUG_ARG_INT, iv) < 0)
+				return (-1);
+			break;
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			switch (sp.lenmod) {
+			case DEBUG_FMT_LEN_L:
+				uv = va_arg(ap, unsigned long);
+				break;
+			case DEBUG_FMT_LEN_LL:
+				uv = va_arg(ap, unsigned long long);
+				break;
+			case DEBUG_FMT_LEN_J:
+				uv = va_arg(ap, uintmax_t);
+				break;
+			case DEBUG_FMT_LEN_Z:
+				uv = va_arg(ap, size_t);
+				break;
+			case DEBUG_FMT_LEN_T:
+				uv = va_arg(ap, ptrdiff_t);
+				break;
+			default:
+				uv = va_arg(ap, unsigned int);
+				break;
+			}
+			if (debug_arg_put_int(&ab, DEBUG_ARG_UINT, uv) < 0)
+				return (-1);
+			break;
+		case 'c':
+			iv = va_arg(ap, int);
+			if (debug_arg_put_int(&ab, DEBUG_ARG_INT, iv) < 0)
+				return (-1);
+			break;
+		case 'p':
+			uv = (uintptr_t) va_arg(ap, void *);
+			if (debug_arg_put_int(&ab, DEBUG_ARG_PTR, uv) < 0)
+				return (-1);
+			break;
+		case 's':
+			s = va_arg(ap, const char *);
+			if (s == NULL)
+				s = "(null)";
+			/*
+			 * Honour the precision; the string may not be
+			 * NUL terminated.
+			 */
+			if (sp.prec_star && star[sp.nstar - 1] >= 0)
+				l = strnlen(s, star[sp.nstar - 1]);
+			else if (! sp.prec_star && sp.prec >= 0)
+				l = strnlen(s, sp.prec);
+			else
+				l = strlen(s);
+			if (debug_arg_put_str(&ab, s, l) < 0)
+				return (-1);
+			break;
+		default:
+			/* Floating point */
+			if (sp.lenmod == DEBUG_FMT_LEN_LD) {
+				ld = va_arg(ap, long double);
+				if (debug_arg_put(&ab, DEBUG_ARG_LDOUBLE, &ld,
+				    sizeof(ld)) < 0)
+					return (-1);
+			} else {
+				d = va_arg(ap, double);
+				if (debug_arg_put(&ab, DEBUG_ARG_DOUBLE, &d,
+				    sizeof(d)) < 0)
+					return (-1);
+			}
+			break;
+		}
+	}
+
+	return (ab.len);
+}
+
+/*
+ * Format an unsigned integer into buf, zero padded to at least width
+ * digits.  buf must have room for 64 digits.
+ *
+ * This is used both on the logger fast path and from the crash
+ * handler, so it must stay async-signal-safe - no locale, no stdio.
+ *
+ * Returns the number of characters written; buf isn't NUL terminated.
+ */
+int
+debug_u64toa(char *buf, uint64_t v, int base, int width)
+{
+	static const char digits[] = "0123456789abcdef";
+	char tmp[64];
+	int n = 0, i;
+
+	do {
+		tmp[n++] = digits[v % base];
+		v /= base;
+	} while (v != 0 && n < (int) sizeof(tmp));
+	while (n < width && n < (int) sizeof(tmp))
+		tmp[n++] = '0';
+
+	for (i = 0; i < n; i++)
+		buf[i] = tmp[n - 1 - i];
+	return (n);
+}
+
+/*
+ * Output buffer handling.
+ */
+int
+debug_fmt_buf_reserve(struct debug_fmt_buf *fb, size_t len)
+{
+	size_t sz;
+	char *p;
+
+	if (fb->len + len + 1 <= fb->size)
+		return (0);
+	sz = fb->size ? fb->size : 256;
+	while (sz < fb->len + len + 1)
+		sz *= 2;
+	p = realloc(fb->buf, sz);
+	if (p == NULL)
+		return (-1);
+	fb->buf = p;
+	fb->size = sz;
+	return (0);
+}
+
+int
+debug_fmt_buf_append(struct debug_fmt_buf *fb, const char *s, size_t len)
+{
+
+	if (debug_fmt_buf_reserve(fb, len) < 0)
+		return (-1);
+	memcpy(fb->buf + fb->len, s, len);
+	fb->len += len;
+	fb->buf[fb->len] = '\0';
+	return (0);
+}
+
+/*
+ * Append a printf-style formatted string.  Since the specs are built
+ * at runtime this deliberately doesn't carry a format attribute.
+ */
+int
+debug_fmt_buf_printf(struct debug_fmt_buf *fb, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(fb->buf + fb->len, fb->size - fb->len, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return (-1);
+	if ((size_t) n >= fb->size - fb->len) {
+		if (debug_fmt_buf_reserve(fb, n) < 0)
+			return (-1);
+		va_start(ap, fmt);
+		n = vsnprintf(fb->buf + fb->len, fb->size - fb->len, fmt, ap);
+		va_end(ap);
+	}
+	fb->len += n;
+	return (0);
+}
+
+/*
+ * Pull the next argument out of the encoded buffer.
+ */
+struct debug_argcur {
+	const char *p;
+	const char *end;
+};
+
+static int
+debug_arg_get(struct debug_argcur *ac, int tag, void *v, size_t len)
+{
+
+	if (ac->p + 1 + len > ac->end || *ac->p != tag)
+		return (-1);
+	memcpy(v, ac->p + 1, len);
+	ac->p += 1 + len;
+	return (0);
+}
+
+static int
+debug_arg_get_int(struct debug_argcur *ac, uint64_t *v)
+{
+
+	if (ac->p < ac->end && *ac->p == DEBUG_ARG_UINT)
+		return (debug_arg_get(ac, DEBUG_ARG_UINT, v, sizeof(*v)));
+	if (ac->p < ac->end && *ac->p == DEBUG_ARG_PTR)
+		return (debug_arg_get(ac, DEBUG_ARG_PTR, v, sizeof(*v)));
+	return (debug_arg_get(ac, DEBUG_ARG_INT, v, sizeof(*v)));
+}
+
+static int
+debug_arg_get_str(struct debug_argcur *ac, const char **s, uint32_t *len)
+{
+
+	if (ac->p + 1 + sizeof(*len) > ac->end || *ac->p != DEBUG_ARG_STR)
+		return (-1);
+	memcpy(len, ac->p + 1, sizeof(*len));
+	if (ac->p + 1 + sizeof(*len) + *len + 1 > ac->end)
+		return (-1);
+	*s = ac->p + 1 + sizeof(*len);
+	ac->p += 1 + sizeof(*len) + *len + 1;
+	return (0);
+}
+
+#define	DEBUG_FMT_EMIT(fb, spec, ns, star, v)				\
+	((ns) == 0 ? debug_fmt_buf_printf(fb, spec, v) :		\
+	 (ns) == 1 ? debug_fmt_buf_printf(fb, spec, (star)[0], v) :	\
+	 debug_fmt_buf_printf(fb, spec, (star)[0], (star)[1], v))
+
+/*
+ * Render fmt using the captured arguments, appending to fb.
+ *
+ * Returns 0 on success or -1 if the arguments don't match the
+ * format, in which case fb holds whatever was rendered up to that
+ * point.
+ */
+int
+debug_fmt_render(struct debug_fmt_buf *fb, const char *fmt,
+    const char *args, size_t argslen)
+{
+	struct debug_argcur ac = { args, args + argslen };
+	struct debug_fmt_spec sp;
+	char spec[DEBUG_FMT_SPEC_MAX];
+	const char *p = fmt, *q, *s;
+	long double ld;
+	double d;
+	uint64_t v;
+	uint32_t l;
+	int i, r, star[2];
+
+	while ((q = strchr(p, '%')) != NULL) {
+		if (q != p && debug_fmt_buf_append(fb, p, q - p) < 0)
+			return (-1);
+		p = debug_fmt_parse(q, &sp);
+		if (p == NULL)
+			return (-1);
+		if (sp.conv == '%') {
+			if (debug_fmt_buf_append(fb, "%", 1) < 0)
+				return (-1);
+			continue;
+		}
+		memcpy(spec, q, sp.speclen);
+		spec[sp.speclen] = '\0';
+
+		for (i = 0; i < sp.nstar; i++) {
+			if (debug_arg_get_int(&ac, &v) < 0)
+				return (-1);
+			star[i] = (int) v;
+		}
+
+		switch (sp.conv) {
+		case 'd':
+		case 'i':
+			if (debug_arg_get_int(&ac, &v) < 0)
+				return (-1);
+			switch (sp.lenmod) {
+			case DEBUG_FMT_LEN_L:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (long) v);
+				break;
+			case DEBUG_FMT_LEN_LL:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (long long) v);
+				break;
+			case DEBUG_FMT_LEN_J:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (intmax_t) v);
+				break;
+			case DEBUG_FMT_LEN_Z:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (ssize_t) v);
+				break;
+			case DEBUG_FMT_LEN_T:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (ptrdiff_t) v);
+				break;
+			default:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (int) v);
+				break;
+			}
+			break;
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			if (debug_arg_get_int(&ac, &v) < 0)
+				return (-1);
+			switch (sp.lenmod) {
+			case DEBUG_FMT_LEN_L:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (unsigned long) v);
+				break;
+			case DEBUG_FMT_LEN_LL:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (unsigned long long) v);
+				break;
+			case DEBUG_FMT_LEN_J:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (uintmax_t) v);
+				break;
+			case DEBUG_FMT_LEN_Z:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (size_t) v);
+				break;
+			case DEBUG_FMT_LEN_T:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (ptrdiff_t) v);
+				break;
+			default:
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+				    (unsigned int) v);
+				break;
+			}
+			break;
+		case 'c':
+			if (debug_arg_get_int(&ac, &v) < 0)
+				return (-1);
+			r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star, (int) v);
+			break;
+		case 'p':
+			if (debug_arg_get_int(&ac, &v) < 0)
+				return (-1);
+			r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star,
+			    (void *) (uintptr_t) v);
+			break;
+		case 's':
+			if (debug_arg_get_str(&ac, &s, &l) < 0)
+				return (-1);
+			r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star, s);
+			break;
+		default:
+			if (sp.lenmod == DEBUG_FMT_LEN_LD) {
+				if (debug_arg_get(&ac, DEBUG_ARG_LDOUBLE, &ld,
+				    sizeof(ld)) < 0)
+					return (-1);
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star, ld);
+			} else {
+				if (debug_arg_get(&ac, DEBUG_ARG_DOUBLE, &d,
+				    sizeof(d)) < 0)
+					return (-1);
+				r = DEBUG_FMT_EMIT(fb, spec, sp.nstar, star, d);
+			}
+			break;
+		}
+		if (r < 0)
+			return (-1);
+	}
+
+	return (debug_fmt_buf_append(fb, p, strlen(p)));
+}
+
+/*
+ * Structured fields.
+ *
+ * A DEBUG_KV() line is encoded as the event name as a DEBUG_ARG_STR,
+ * then for each field the key as a DEBUG_ARG_STR followed by the
+ * tagged value.  Booleans are a single byte and NULL strings just
+ * the tag.
+ */
+static size_t
+debug_kv_str_size(const char *s)
+{
+
+	return (1 + sizeof(uint32_t) + (s != NULL ? strlen(s) : 0) + 1);
+}
+
+/*
+ * Return the number of bytes debug_kv_encode() needs for the line.
+ */
+size_t
+debug_kv_size(const char *event, const struct debug_kv *kv, int nkv)
+{
+	size_t n;
+	int i;
+
+	n = debug_kv_str_size(event);
+	for (i = 0; i < nkv; i++) {
+		n += debug_kv_str_size(kv[i].key);
+		switch (kv[i].type) {
+		case DEBUG_KV_BOOL:
+			n += 2;
+			break;
+		case DEBUG_KV_STR:
+			if (kv[i].v.str == NULL)
+				n += 1;
+			else
+				n += debug_kv_str_size(kv[i].v.str);
+			break;
+		default:
+			n += 1 + sizeof(uint64_t);
+			break;
+		}
+	}
+	return (n);
+}
+
+/*
+ * Encode the line into buf.  Returns the number of bytes used, or -1
+ * if buf is too small or a field has an unknown type.
+ */
+int
+debug_kv_encode(char *buf, size_t buflen, const char *event,
+    const struct debug_kv *kv, int nkv)
+{
+	struct debug_argbuf ab = { buf, 0, buflen };
+	const char *s;
+	uint8_t b;
+	int i, r;
+
+	s = event != NULL ? event : "";
+	if (debug_arg_put_str(&ab, s, strlen(s)) < 0)
+		return (-1);
+	for (i = 0; i < nkv; i++) {
+		s = kv[i].key != NULL ? kv[i].key : "";
+		if (debug_arg_put_str(&ab, s, strlen(s)) < 0)
+			return (-1);
+		switch (kv[i].type) {
+		case DEBUG_KV_U64:
+			r = debug_arg_put_int(&ab, DEBUG_ARG_UINT, kv[i].v.u64);
+			break;
+		case DEBUG_KV_I64:
+			r = debug_arg_put_int(&ab, DEBUG_ARG_INT, kv[i].v.i64);
+			break;
+		case DEBUG_KV_DBL:
+			r = debug_arg_put(&ab, DEBUG_ARG_DOUBLE, &kv[i].v.dbl,
+			    sizeof(kv[i].v.dbl));
+			break;
+		case DEBUG_KV_BOOL:
+			b = kv[i].v.u64 != 0;
+			r = debug_arg_put(&ab, DEBUG_ARG_BOOL, &b, sizeof(b));
+			break;
+		case DEBUG_KV_STR:
+			if (kv[i].v.str == NULL)
+				r = debug_arg_put(&ab, DEBUG_ARG_NULL, &b, 0);
+			else
+				r = debug_arg_put_str(&ab, kv[i].v.str,
+				    strlen(kv[i].v.str));
+			break;
+		default:
+			r = -1;
+			break;
+		}
+		if (r < 0)
+			return (-1);
+	}
+	return (ab.len);
+}
+
+/*
+ * Return the event name of an encoded line, or NULL if it's garbled.
+ */
+const char *
+debug_kv_event(const char *args, size_t argslen, uint32_t *len)
+{
+	struct debug_argcur ac = { args, args + argslen };
+	const char *s;
+
+	if (debug_arg_get_str(&ac, &s, len) < 0)
+		return (NULL);
+	return (s);
+}
+
+/*
+ * Find the first byte in s which has to be escaped in a JSON string:
+ * a control character, '"' or '\'.  Returns len if there isn't one.
+ *
+ * Log messages are mostly plain text, so this is scanned 16 bytes at
+ * a time where SSE2 is available.
+ */
+static size_t
+debug_json_scan(const char *s, size_t len)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i ctl = _mm_set1_epi8(0x1f);
+	__m128i v, m;
+	int bits;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (const void *) (s + i));
+		/* v <= 0x1f (unsigned) iff min(v, 0x1f) == v */
+		m = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+		    _mm_cmpeq_epi8(v, bslash));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v));
+		bits = _mm_movemask_epi8(m);
+		if (bits != 0)
+			return (i + __builtin_ctz(bits));
+	}
+#endif
+	for (; i < len; i++) {
+		if ((unsigned char) s[i] < 0x20 || s[i] == '"' || s[i] == '\\')
+			return (i);
+	}
+	return (len);
+}
+
+/*
+ * Append s to fb escaped for use inside a JSON string.  Bytes from
+ * 0x80 up are copied as they are, so text which isn't UTF-8 comes out
+ * that way too.
+ */
+int
+debug_json_escape(struct debug_fmt_buf *fb, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[6];
+	size_t i, n;
+	int el;
+
+	if (debug_fmt_buf_reserve(fb, len) < 0)
+		return (-1);
+	for (i = 0; i < len; i++) {
+		n = debug_json_scan(s + i, len - i);
+		if (n != 0 && debug_fmt_buf_append(fb, s + i, n) < 0)
+			return (-1);
+		i += n;
+		if (i == len)
+			break;
+
+		esc[0] = '\\';
+		el = 2;
+		switch (s[i]) {
+		case '"':	esc[1] = '"'; break;
+		case '\\':	esc[1] = '\\'; break;
+		case '\b':	esc[1] = 'b'; break;
+		case '\f':	esc[1] = 'f'; break;
+		case '\n':	esc[1] = 'n'; break;
+		case '\r':	esc[1] = 'r'; break;
+		case '\t':	esc[1] = 't'; break;
+		default:
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[(s[i] >> 4) & 0xf];
+			esc[5] = hex[s[i] & 0xf];
+			el = 6;
+			break;
+		}
+		if (debug_fmt_buf_append(fb, esc, el) < 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Append a string field value in text format; it's quoted (and
+ * escaped) if it's empty or has anything in it which would make the
+ * line ambiguous to split up again.
+ */
+static int
+debug_kv_text_str(struct debug_fmt_buf *fb, const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ((unsigned char) s[i] <= ' ' || s[i] == '"' ||
+		    s[i] == '=' || s[i] == '\\' || s[i] == 0x7f)
+			break;
+	}
+	if (len != 0 && i == len)
+		return (debug_fmt_buf_append(fb, s, len));
+	if (debug_fmt_buf_append(fb, "\"", 1) < 0 ||
+	    debug_json_escape(fb, s, len) < 0 ||
+	    debug_fmt_buf_append(fb, "\"", 1) < 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Render an encoded DEBUG_KV() line, appending to fb: as the text
+ * line "event key=value ...\n", or if json is set as the JSON members
+ * "event":"event","key":value,... to go inside the line's object.
+ *
+ * Returns 0 on success or -1 if the encoding is garbled, in which
+ * case fb holds whatever was rendered up to that point.
+ */
+int
+debug_kv_render(struct debug_fmt_buf *fb, const char *args, size_t argslen,
+    int json)
+{
+	struct debug_argcur ac = { args, args + argslen };
+	char num[32];
+	const char *s;
+	uint32_t l;
+	uint64_t v;
+	double d;
+	uint8_t b;
+	int n, r;
+
+	if (debug_arg_get_str(&ac, &s, &l) < 0)
+		return (-1);
+	if (json)
+		r = debug_fmt_buf_append(fb, "\"event\":\"", 9) < 0 ||
+		    debug_json_escape(fb, s, l) < 0 ||
+		    debug_fmt_buf_append(fb, "\"", 1) < 0;
+	else
+		r = debug_fmt_buf_append(fb, s, l);
+	if (r != 0)
+		return (-1);
+
+	while (ac.p < ac.end) {
+		if (debug_arg_get_str(&ac, &s, &l) < 0)
+			return (-1);
+		if (json)
+			r = debug_fmt_buf_append(fb, ",\"", 2) < 0 ||
+			    debug_json_escape(fb, s, l) < 0 ||
+			    debug_fmt_buf_append(fb, "\":", 2) < 0;
+		else
+			r = debug_fmt_buf_append(fb, " ", 1) < 0 ||
+			    debug_fmt_buf_append(fb, s, l) < 0 ||
+			    debug_fmt_buf_append(fb, "=", 1) < 0;
+		if (r != 0 || ac.p >= ac.end)
+			return (-1);
+
+		switch (*ac.p) {
+		case DEBUG_ARG_UINT:
+			if (debug_arg_get(&ac, DEBUG_ARG_UINT, &v,
+			    sizeof(v)) < 0)
+				return (-1);
+			n = debug_u64toa(num, v, 10, 0);
+			r = debug_fmt_buf_append(fb, num, n);
+			break;
+		case DEBUG_ARG_INT:
+			if (debug_arg_get(&ac, DEBUG_ARG_INT, &v,
+			    sizeof(v)) < 0)
+				return (-1);
+			n = 0;
+			if ((int64_t) v < 0) {
+				num[n++] = '-';
+				v = -v;
+			}
+			n += debug_u64toa(num + n, v, 10, 0);
+			r = debug_fmt_buf_append(fb, num, n);
+			break;
+		case DEBUG_ARG_DOUBLE:
+			if (debug_arg_get(&ac, DEBUG_ARG_DOUBLE, &d,
+			    sizeof(d)) < 0)
+				return (-1);
+			/* JSON has no NaN or infinity */
+			if (json && ! isfinite(d)) {
+				r = debug_fmt_buf_append(fb, "null", 4);
+				break;
+			}
+			/* The shortest of these which reads back the same */
+			n = snprintf(num, sizeof(num), "%.15g", d);
+			if (strtod(num, NULL) != d)
+				n = snprintf(num, sizeof(num), "%.17g", d);
+			r = debug_fmt_buf_append(fb, num, n);
+			break;
+		case DEBUG_ARG_BOOL:
+			if (debug_arg_get(&ac, DEBUG_ARG_BOOL, &b,
+			    sizeof(b)) < 0)
+				return (-1);
+			r = b ? debug_fmt_buf_append(fb, "true", 4) :
+			    debug_fmt_buf_append(fb, "false", 5);
+			break;
+		case DEBUG_ARG_STR:
+			if (debug_arg_get_str(&ac, &s, &l) < 0)
+				return (-1);
+			if (json)
+				r = debug_fmt_buf_append(fb, "\"", 1) < 0 ||
+				    debug_json_escape(fb, s, l) < 0 ||
+				    debug_fmt_buf_append(fb, "\"", 1) < 0 ?
+				    -1 : 0;
+			else
+				r = debug_kv_text_str(fb, s, l);
+			break;
+		case DEBUG_ARG_NULL:
+			ac.p++;
+			r = json ? debug_fmt_buf_append(fb, "null", 4) :
+			    debug_fmt_buf_append(fb, "(null)", 6);
+			break;
+		default:
+			return (-1);
+		}
+		if (r < 0)
+			return (-1);
+	}
+
+	if (! json && debug_fmt_buf_append(fb, "\n", 1) < 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * JSON lines output.
+ */
+#define	DEBUG_JSON_HDR_SIZE		128
+
+static const char *debug_json_levels[] = {
+	"debug", "info", "notice", "warning", "err", "crit", "alert", "emerg",
+};
+
+/*
+ * Append a line as a JSON object to fb: the timestamp (epoch seconds),
+ * section name, level and either the message as "msg" or, if kv is
+ * set, msg as the members rendered by debug_kv_render().  The level is
+ * the most severe DEBUG_LVL_* bit in mask; masks with none of those
+ * are given as "mask" instead, and libdebug's own reports (which are
+ * logged with every bit set) have neither.
+ *
+ * msg may point into fb itself.
+ */
+int
+debug_json_line(struct debug_fmt_buf *fb, uint64_t ns, const char *section,
+    debug_mask_t mask, const char *msg, int len, int kv)
+{
+	char num[24];
+	ptrdiff_t off = -1;
+	size_t slen;
+	int i, n, r;
+
+	if (section == NULL)
+		section = "?";
+	slen = strlen(section);
+
+	/* Leave room for everything escaped, so fb won't move under msg */
+	if (fb->buf != NULL && (uintptr_t) msg >= (uintptr_t) fb->buf &&
+	    (uintptr_t) msg < (uintptr_t) fb->buf + fb->size)
+		off = msg - fb->buf;
+	if (debug_fmt_buf_reserve(fb,
+	    DEBUG_JSON_HDR_SIZE + 6 * (slen + len)) < 0)
+		return (-1);
+	if (off >= 0)
+		msg = fb->buf + off;
+
+	(void) debug_fmt_buf_append(fb, "{\"ts\":", 6);
+	n = debug_u64toa(num, ns / 1000000000ULL, 10, 0);
+	num[n++] = '.';
+	n += debug_u64toa(num + n, (ns / 1000) % 1000000, 10, 6);
+	(void) debug_fmt_buf_append(fb, num, n);
+	(void) debug_fmt_buf_append(fb, ",\"section\":\"", 12);
+	(void) debug_json_escape(fb, section, slen);
+
+	for (i = 7; i >= 0; i--) {
+		if (mask & (1ULL << i))
+			break;
+	}
+	if (mask == DEBUG_MASK_ALL)
+		r = debug_fmt_buf_append(fb, "\",", 2);
+	else if (i >= 0)
+		r = debug_fmt_buf_printf(fb, "\",\"level\":\"%s\",",
+		    debug_json_levels[i]);
+	else
+		r = debug_fmt_buf_printf(fb, "\",\"mask\":\"0x%llx\",",
+		    (unsigned long long) mask);
+	if (r < 0)
+		return (-1);
+
+	if (kv) {
+		(void) debug_fmt_buf_append(fb, msg, len);
+	} else {
+		/* The newline is the line's, not the message's */
+		if (len > 0 && msg[len - 1] == '\n')
+			len--;
+		(void) debug_fmt_buf_append(fb, "\"msg\":\"", 7);
+		(void) debug_json_escape(fb, msg, len);
+		(void) debug_fmt_buf_append(fb, "\"", 1);
+	}
+	(void) debug_fmt_buf_append(fb, "}\n", 2);
+	return (0);
+}
@@ -4,34 +4,706 @@
 /*
  * These are internal structures to the debug framework.
  */
+#define	DEBUG_CACHELINE_SIZE		64
+
+/*
+ * Messages up to this size are formatted on the stack and copied
+ * into the ring; larger ones are formatted into a heap buffer.
+ */
+#define	DEBUG_FORMAT_BUF_SIZE		512
+
+/*
+ * Per-thread ring sizing, in bytes.  Messages larger than
+ * ring_size / DEBUG_RING_INLINE_DIV are spilled to the heap rather
+ * than being copied into the ring.
+ */
+#define	DEBUG_RING_MIN_SIZE		4096
+#define	DEBUG_RING_MAX_SIZE		(1U << 30)
+#define	DEBUG_RING_DEFAULT_SIZE		65536
+#define	DEBUG_RING_INLINE_DIV		4
+
+#define	DEBUG_REC_ALIGN			8
+
+#define	DEBUG_REC_PAD			0	/* skip to the ring start */
+#define	DEBUG_REC_TEXT			1	/* formatted text in buf */
+#define	DEBUG_REC_SPILL			2	/* buf holds a heap pointer */
+#define	DEBUG_REC_DEFERRED		3	/* buf holds debug_rec_deferred */
+#define	DEBUG_REC_KV			4	/* buf holds encoded DEBUG_KV() */
+
+/* Record flags, besides the (1 << type) bits for direct writes */
+#define	DEBUG_REC_F_KV			0x8000	/* spill of a DEBUG_KV() */
+
+/*
+ * A length-prefixed record on a per-thread ring.
+ *
+ * len is the total record length including this header, rounded
+ * up to DEBUG_REC_ALIGN.  Records never wrap around the end of
+ * the ring.
+ */
+struct debug_rec {
+	uint32_t len;
+	uint16_t type;
+	uint16_t flags;			/* types already written directly */
+	uint32_t msglen;
+	debug_section_t debug_section;
+	debug_mask_t debug_mask;
+	uint64_t ts;			/* raw debug_clock reading */
+	char buf[];
+};
+
+/*
+ * Payload of a deferred-format record; msglen is the length of the
+ * captured arguments.  fmt must outlive the record, which in practice
+ * means it has to be a string literal.
+ */
+struct debug_rec_deferred {
+	const char *fmt;
+	int xerrno;		/* do_debug_warn() errno, or -1 */
+	int pad;
+	char args[];
+};
+
+/*
+ * Section registry.  Names are hashed into debug_section_hash[] and
+ * dotted names ("net.tcp.retransmit") are linked into a tree under
+ * their parent ("net.tcp"), which is registered implicitly if needed.
+ * Links are stored as section + 1 so a zeroed table is empty.
+ */
+#define	DEBUG_SECTION_HASH_SIZE		(DEBUG_SECTION_MAX * 2)
+
+struct debug_section_node {
+	uint32_t hash;
+	debug_section_t hnext;		/* hash chain */
+	debug_section_t parent;
+	debug_section_t child;		/* first child */
+	debug_section_t sibling;	/* next child of parent */
+};
+
+/*
+ * The sections and level tables of an instance created with
+ * debug_instance_create(); the default instance uses the global
+ * arrays instead.
+ */
+struct debug_section_tables {
+	char *strs[DEBUG_SECTION_MAX];
+	debug_mask_t levels[DEBUG_TYPE_MAX][DEBUG_SECTION_MAX];
+	debug_mask_t levels_any[DEBUG_SECTION_MAX];
+	struct debug_section_node sections[DEBUG_SECTION_MAX];
+	debug_section_t hash[DEBUG_SECTION_HASH_SIZE];
+};
+
+/* A growable output buffer, always NUL terminated */
+struct debug_fmt_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+/*
+ * A staged entry, built by the logger thread from a ring record.
+ * buf points into the ring (or at the spill buffer) and is only
+ * valid until the ring space is released.
+ *
+ * Deferred entries have fmt set and buf NULL until they're rendered;
+ * args/len are then the captured arguments.  DEBUG_KV() entries have
+ * kv set and args/len the encoded fields; with JSON output they're
+ * rendered as the JSON members rather than text.
+ */
 struct debug_entry {
-	TAILQ_ENTRY(debug_entry) e;
-	struct timeval tv;
+	uint64_t ts;			/* wall clock, nanoseconds */
 	debug_section_t debug_section;
 	debug_mask_t debug_mask;
-	char buf[512];
+	const char *buf;
+	int len;
+	int seq;
+	const char *fmt;
+	const char *args;
+	int xerrno;
+	int kv;
+	int written;		/* (1 << type) for each direct write */
+
+	/*
+	 * Prefix, and the text of rendered deferred entries (buf is
+	 * then NULL), as offsets into the batch buffer, which may move
+	 * while the batch is being built.
+	 */
+	size_t pfx_off;
+	int pfx_len;
+	size_t buf_off;
+
+	/*
+	 * Coalescing: dup is set if this is a repeat of the previous
+	 * line and isn't written.  If rpt_len is set, a "last message
+	 * repeated" line for the previous run (prefix included) is
+	 * written first, from the batch buffer.
+	 */
+	int dup;
+	int rpt_pfx_len;
+	int rpt_len;
+	size_t rpt_off;
+	debug_section_t rpt_section;
+	debug_mask_t rpt_mask;
+};
+
+/*
+ * Timestamp source state; see debug_clock.c.  Only the logger thread
+ * updates the TSC calibration.
+ */
+struct debug_clock {
+	int type;			/* debug_clock_t */
+	int clk_id;
+	uint64_t offset;		/* monotonic -> wall clock */
+	uint64_t tsc_cal;		/* calibration start */
+	uint64_t ns_cal;
+	uint64_t tsc_base;		/* conversion anchor */
+	uint64_t ns_base;
+	uint64_t tsc_mult;		/* ns per tick << DEBUG_CLOCK_SHIFT */
+};
+
+/* Fixed point shift for debug_clock.tsc_mult */
+#define	DEBUG_CLOCK_SHIFT	24
+
+/* Sink flush policy; see debug_set_flush_policy() */
+struct debug_flush_cfg {
+	int policy;
+	size_t nbytes;
+	unsigned int msec;
+};
+
+/*
+ * io_uring state for asynchronous log file writes; see debug_uring.c.
+ * Each buffer has at most one write in flight.  queue holds the
+ * buffers waiting for or in the chain being written, oldest first.
+ */
+#define	DEBUG_URING_NBUFS		8
+#define	DEBUG_URING_BUF_SIZE		(256 * 1024)
+
+struct debug_uring_buf {
+	char *buf;
+	size_t len;
+	size_t off;			/* written so far */
+	int fd;
+	int busy;			/* queued for writing */
+};
+
+struct debug_uring {
+	int ring_fd;
+	void *sq_ring;
+	void *cq_ring;
+	void *sqes;
+	void *cqes;
+	size_t sq_size;
+	size_t cq_size;			/* 0 if it shares sq_ring */
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	int inflight;
+	int cur;			/* buffer being filled, or -1 */
+	int failed;			/* IORING_OP_WRITE doesn't work */
+	uint64_t *nerrors;		/* where to count failed writes */
+	int queue[DEBUG_URING_NBUFS];
+	int nqueued;
+	struct debug_uring_buf bufs[DEBUG_URING_NBUFS];
+};
+
+/*
+ * The log file, which may be compressed and is rotated by the logger
+ * thread; see debug_logfile.c.  compress is what's configured and
+ * zmode what the current file is actually being written with.
+ */
+#define	DEBUG_LOGFILE_ZBUF_SIZE		65536
+
+#define	DEBUG_LOGFILE_Z_DATA		0
+#define	DEBUG_LOGFILE_Z_FLUSH		1
+#define	DEBUG_LOGFILE_Z_END		2
+
+struct debug_logfile {
+	int fd;
+	char *path;
+	debug_compress_t compress;
+	debug_compress_t zmode;
+	int level;			/* -1 for the default */
+	void *zs;			/* z_stream or ZSTD_CCtx */
+	char *zbuf;
+	uint64_t size;			/* bytes in the current file */
+	time_t opened;
+	uint64_t rotate_bytes;
+	unsigned int rotate_sec;
+	unsigned int ngen;
+	struct debug_uring *uring;	/* if writing asynchronously */
+	uint64_t nerrors;		/* failed writes */
+
+	/*
+	 * Direct writes from other threads (see debug_set_sync_levels())
+	 * go to sync_fd, which is only set while the file is plain and
+	 * written with writev().  fd_lock is only taken around the
+	 * direct writes and by whatever changes the descriptor or how
+	 * it's written - open, close, rotation and io_uring on/off - so
+	 * the logger's writes never hold it.  direct_bytes is what's
+	 * been written directly since the logger last added it to size.
+	 */
+	pthread_mutex_t fd_lock;
+	int sync_fd;
+	uint64_t direct_bytes;
+};
+
+/*
+ * An output sink - a file descriptor plus the iovec for the batch
+ * being written and the data waiting for the flush policy.
+ */
+#define	DEBUG_SINK_IOV_INIT_SIZE	64
+#define	DEBUG_SINK_PENDING_MAX		(1024 * 1024)
+
+struct debug_sink {
+	int fd;
+	struct debug_logfile *lf;	/* if set, write through this */
+	struct iovec *iov;
+	int niov;
+	int iov_size;
+	size_t iov_bytes;
+	struct debug_fmt_buf pending;
+	uint64_t pending_since;		/* msec, monotonic */
+	uint64_t write_ns[DEBUG_STATS_HIST_SIZE];
+	uint64_t nerrors;		/* failed writes to fd */
+};
+
+/*
+ * Registered sinks, each written by its own worker thread; see
+ * debug_worker.c.  The logger publishes each batch of lines once as
+ * an immutable debug_batch on a list shared by all the workers.  Each
+ * worker has its own cursor into the list and a bit in each batch it
+ * has yet to write; a batch is freed once every bit is clear.  A
+ * worker more than DEBUG_SINK_LAG_MAX bytes behind misses batches
+ * rather than holding them all in memory.
+ */
+#define	DEBUG_SINK_MAX			16
+#define	DEBUG_SINK_LAG_MAX		(4 * 1024 * 1024)
+#define	DEBUG_SINK_LINES_INIT_SIZE	256
+
+struct debug_batch {
+	struct debug_batch *next;
+	uint32_t sinks;			/* workers still to write this */
+	size_t size;
+	int nlines;
+	struct debug_line lines[];	/* followed by the text */
+};
+
+/*
+ * The syslog sink; see debug_syslog.c.  Only the syslog worker
+ * touches the socket and header buffer, with lock held, and the
+ * setters take lock to change the rest.
+ */
+#define	DEBUG_SYSLOG_PATH		"/dev/log"
+#define	DEBUG_SYSLOG_PATH_MAX		104
+#define	DEBUG_SYSLOG_IDENT_MAX		48
+#define	DEBUG_SYSLOG_HOST_MAX		64
+
+struct debug_syslog_sink {
+	pthread_mutex_t lock;
+	int fd;
+	int pid;
+	int format;			/* debug_syslog_format_t */
+	int facility;
+	char path[DEBUG_SYSLOG_PATH_MAX];
+	char ident[DEBUG_SYSLOG_IDENT_MAX];
+	char host[DEBUG_SYSLOG_HOST_MAX];
+	char **names;			/* the instance's section names */
+	time_t ts_sec;			/* ts_buf is for this second */
+	char ts_buf[32];
+	struct debug_fmt_buf hdrs;	/* the batch's frame headers */
+};
+
+struct debug_sink_worker {
+	struct debug_instance *ds;
+	int id;
+	struct debug_sink_ops ops;
+	void *arg;
+	debug_mask_t mask;
+	int type;			/* use this level table, or -1 */
+	pthread_t thread;
+	struct debug_batch *cursor;	/* next to write, or NULL */
+	size_t lag;			/* bytes published but not written */
+	uint64_t drops;
+	int exiting;
+};
+
+/* Cached timestamp prefix pieces; see debug_instance_ts_prefix() */
+#define	DEBUG_TS_PREFIX_SIZE		128
+#define	DEBUG_TS_HEAD_SIZE		96
+#define	DEBUG_TS_TAIL_SIZE		16
+
+/* How often the logger reports dropped messages */
+#define	DEBUG_DROP_REPORT_MS		1000
+
+/* Room for a "last message repeated N times" line, after the prefix */
+#define	DEBUG_COALESCE_MSG_SIZE		64
+
+/* The rate limit tick period while any call site is suppressing */
+#define	DEBUG_TICK_MS			10
+
+#define	DEBUG_STAGING_INIT_SIZE		256
+
+/*
+ * Per-thread record ring.
+ *
+ * Each thread which logs gets one of these the first time it queues
+ * an entry.  The owning thread is the only producer and the logger
+ * thread is the only consumer, so the ring itself needs no locking -
+ * just acquire/release ordering on the head/tail indexes.
+ *
+ * The byte indexes are free-running; the offset is (index & ring_mask).
+ * The record counts are kept alongside so the entry limit can be
+ * enforced as well as the byte limit.
+ *
+ * The head and tail live on separate cache lines so the producer
+ * and consumer don't bounce a line between them on every entry.
+ */
+struct debug_thread {
+	TAILQ_ENTRY(debug_thread) t;
+	struct debug_instance *ds;
+	unsigned int gen;
+	unsigned int ring_size;
+	unsigned int ring_mask;
+	char *ring;
+	atomic_int dead;
+	atomic_uint_fast64_t nrec_inline;
+	atomic_uint_fast64_t nrec_spill;
+
+	/* Consumer (logger thread) owned */
+	atomic_uint ring_head __attribute__((aligned(DEBUG_CACHELINE_SIZE)));
+	atomic_uint nrec_head;
+	unsigned int drain_start;
+	unsigned int drain_head;
+	unsigned int drain_nrec;
+
+	/*
+	 * Records before ring_claim have been taken by the logger, or
+	 * thrown away by the producer under DEBUG_OVERFLOW_DROP_OLDEST;
+	 * both sides move it with a CAS.  held is set while the logger
+	 * has records from this ring staged.
+	 */
+	atomic_uint ring_claim __attribute__((aligned(DEBUG_CACHELINE_SIZE)));
+	atomic_int held;
+
+	/* Producer (owning thread) owned */
+	atomic_uint ring_tail __attribute__((aligned(DEBUG_CACHELINE_SIZE)));
+	atomic_uint nrec_tail;
+	atomic_uint nrec_stolen;
+	unsigned int ring_tail_next;
+	unsigned int ring_head_cache;
+	unsigned int nrec_head_cache;
+	int wait_deadline_set;
+	struct timespec wait_deadline;
 };
 
 struct debug_instance {
-	TAILQ_HEAD(, debug_entry) list;
-	int nitems;
+	/* What DEBUG_I() checks; must come first */
+	struct debug_instance_hdr hdr;
+
+	/*
+	 * Sections and level tables; these point at the global arrays
+	 * for the default instance and into tables for the others.  The
+	 * registry is protected by debug_section_lock and the levels by
+	 * debug_lock.  sink_levels is the OR of the registered sinks'
+	 * masks, which is folded into every section's combined mask.
+	 */
+	char **level_strs;
+	debug_mask_t (*levels)[DEBUG_SECTION_MAX];
+	struct debug_section_node *sections;
+	debug_section_t *section_hash;
+	int nsections;
+	debug_mask_t default_lvl[DEBUG_TYPE_MAX];
+	debug_mask_t sink_levels;
+	struct debug_section_tables *tables;
+
+	struct debug_clock clock;
+
+	/* Per-thread rings; the list is protected by debug_thread_lock */
+	TAILQ_HEAD(, debug_thread) threads;
+	pthread_mutex_t debug_thread_lock;
+	pthread_key_t debug_thread_key;
+	unsigned int gen;
+
+	/* Counters from threads which have since exited */
+	uint64_t retired_inline;
+	uint64_t retired_spill;
+
+	/*
+	 * Statistics.  stat_depth_max is updated by the logger with
+	 * debug_thread_lock held, the sink ones under worker_lock and
+	 * the rest under debug_file_lock, apart from stat_dropped which
+	 * the logger adds the reported drops to.
+	 */
+	unsigned int stat_depth_max;
+	atomic_uint_fast64_t stat_dropped;
+	uint64_t stat_written;
+	uint64_t stat_batches;
+	uint64_t stat_latency_ns[DEBUG_STATS_HIST_SIZE];
+	uint64_t stat_batch_size[DEBUG_STATS_HIST_SIZE];
+	uint64_t stat_sink_dropped;
+	uint64_t stat_sink_write_ns[DEBUG_STATS_HIST_SIZE];
+
+	/* The periodic stats line; logger thread owned */
+	unsigned int stats_interval_ms;	/* as set */
+	unsigned int stats_interval_cur;	/* as last seen by the logger */
+	uint64_t stats_next_ms;
+	debug_section_t stats_section;
+	struct debug_stats stats_prev;
+
+	/* Logger thread owned staging array */
+	struct debug_entry *staging;
+	int nstaging;
+	int staging_size;
 
 	pthread_t log_thread;
 	pthread_cond_t log_cond;
 	pthread_mutex_t debug_lock;
 	pthread_mutex_t debug_file_lock;
+	atomic_int debug_thr_sleeping;
 	int debug_thr_do_exit;
-	int debug_queue_limit;
+	atomic_int debug_queue_limit;
+	size_t debug_queue_limit_bytes;
+	int debug_defer_format;
+
+	/*
+	 * Levels written straight to stderr/the log file by the calling
+	 * thread, per type, and the OR of them.
+	 */
+	debug_mask_t debug_sync_levels[DEBUG_TYPE_MAX];
+	debug_mask_t debug_sync_any;
+
+	/* What to do when a thread ring is full */
+	int debug_overflow_policy;
+	unsigned int debug_overflow_timeout_ms;
+	pthread_cond_t space_cond;	/* protected by debug_lock */
+	atomic_int space_waiters;
+
+	/*
+	 * Messages dropped per section since the last report, and
+	 * the logger thread's buffer for the report lines.
+	 */
+	atomic_uint_fast64_t debug_drops[DEBUG_SECTION_MAX];
+	uint64_t drop_report_ms;
+	struct debug_fmt_buf drop_buf;
+
+	/*
+	 * Logger thread owned buffer holding the current batch's
+	 * prefixes and rendered deferred entries.
+	 */
+	struct debug_fmt_buf render_buf;
+
+	/* Output sinks and flush policy; protected by debug_file_lock */
+	struct debug_sink stderr_sink;
+	struct debug_sink file_sink;
+	struct debug_logfile logfile;
+
+	/*
+	 * Registered sinks.  The lines for the next batch are collected
+	 * in sink_lines under debug_file_lock; the workers and the batch
+	 * list are protected by worker_lock.
+	 */
+	pthread_mutex_t worker_lock;
+	pthread_cond_t worker_cond;
+	struct debug_sink_worker *workers[DEBUG_SINK_MAX];
+	struct debug_batch *batch_head;
+	struct debug_batch *batch_tail;
+	debug_mask_t worker_mask;	/* OR of the workers' masks */
+	int syslog_worker;
+	struct debug_line *sink_lines;
+	int nsink_lines;
+	int sink_lines_size;
+	size_t sink_bytes;
+	struct debug_flush_cfg debug_flush;
+
+	/*
+	 * Duplicate line coalescing; protected by debug_file_lock.
+	 * coalesce_last is the text of the last line written and
+	 * coalesce_count the number of repeats of it held back since,
+	 * the first at coalesce_start and the latest at coalesce_ts.
+	 */
+	unsigned int debug_coalesce_ms;
+	struct debug_fmt_buf coalesce_last;
+	int coalesce_valid;
+	debug_section_t coalesce_section;
+	debug_mask_t coalesce_mask;
+	unsigned int coalesce_count;
+	uint64_t coalesce_start;
+	uint64_t coalesce_ts;
+	struct debug_fmt_buf coalesce_line;
+
+	/*
+	 * Line format, timestamp prefix format and the per-second cache
+	 * of the part before the microseconds; protected by
+	 * debug_file_lock.
+	 */
+	int debug_output_format;
+	int debug_ts_format;
+	uint64_t debug_ts_start;
+	int debug_ts_valid;
+	time_t debug_ts_sec;
+	char debug_ts_head[DEBUG_TS_HEAD_SIZE];
+	int debug_ts_headlen;
+	char debug_ts_tail[DEBUG_TS_TAIL_SIZE];
+	int debug_ts_taillen;
 
 	/* Syslog configuration */
-	int debug_syslog_facility;
-	int debug_syslog_logopt;
-	char *debug_syslog_ident;
+	struct debug_syslog_sink syslog;
 	int debug_syslog_enable;
 
-	/* File logging configuration */
-	FILE *debug_file;
+	/* File logging configuration; the fd lives in file_sink */
 	char *debug_filename;
 };
 
+/*
+ * Log2 histogram bucket for v; see struct debug_stats.
+ */
+static inline int
+debug_stats_bucket(uint64_t v)
+{
+	int b;
+
+	b = (v == 0) ? 0 : 64 - __builtin_clzll(v);
+	return (b < DEBUG_STATS_HIST_SIZE ? b : DEBUG_STATS_HIST_SIZE - 1);
+}
+
+/* debug_trace.c */
+extern	void debug_trace_shutdown(void);
+extern	void debug_trace_set_progname(const char *progname);
+extern	void debug_trace_get_progname(char *buf, size_t len);
+extern	void debug_trace_section_name(debug_section_t s, const char *name);
+extern	void debug_trace_crash_dump(int fd, int max);
+
+/* debug_crash.c */
+extern	void debug_crash_log(const char *prefix, int plen, const char *msg,
+	    int len);
+extern	void debug_crash_shutdown(void);
+extern	void debug_crash_thread_init(void);
+extern	void debug_crash_write(int fd, const char *s, size_t len);
+extern	void debug_crash_write_str(int fd, const char *s);
+extern	void debug_crash_write_u64(int fd, uint64_t v, int base, int width);
+
+/* debug.c */
+extern	int debug_instance_crash_fd(void);
+extern	void debug_instance_crash_dump(int fd);
+
+/* debug_clock.c */
+extern	void debug_clock_init(struct debug_clock *c, debug_clock_t type);
+extern	void debug_clock_recalibrate(struct debug_clock *c);
+extern	uint64_t debug_clock_to_ns(const struct debug_clock *c, uint64_t ts);
+
+/* debug_sink.c */
+extern	uint64_t debug_sink_now_ms(void);
+extern	size_t debug_sink_writev(int fd, struct iovec *iov, int niov);
+extern	void debug_sink_init(struct debug_sink *sk, int fd);
+extern	int debug_sink_add(struct debug_sink *sk, const char *buf, size_t len);
+extern	void debug_sink_batch_done(struct debug_sink *sk,
+	    const struct debug_flush_cfg *fc, int urgent, uint64_t now);
+extern	int debug_sink_deadline(const struct debug_sink *sk,
+	    const struct debug_flush_cfg *fc, uint64_t now);
+extern	void debug_sink_flush(struct debug_sink *sk);
+extern	void debug_sink_detach(struct debug_sink *sk);
+extern	void debug_sink_free(struct debug_sink *sk);
+
+/* debug_logfile.c */
+extern	void debug_logfile_init(struct debug_logfile *lf);
+extern	int debug_logfile_compress_ok(debug_compress_t c);
+extern	int debug_logfile_open(struct debug_logfile *lf, const char *path);
+extern	void debug_logfile_close(struct debug_logfile *lf);
+extern	void debug_logfile_free(struct debug_logfile *lf);
+extern	int debug_logfile_write_direct(struct debug_logfile *lf,
+	    struct iovec *iov, int niov);
+extern	void debug_logfile_writev(struct debug_logfile *lf, struct iovec *iov,
+	    int niov);
+extern	int debug_logfile_set_async(struct debug_logfile *lf, int enable);
+
+/* debug_syslog.c */
+extern	const struct debug_sink_ops debug_syslog_sink_ops;
+extern	void debug_syslog_sink_init(struct debug_syslog_sink *sl,
+	    char **names);
+extern	void debug_syslog_sink_ident(struct debug_syslog_sink *sl,
+	    const char *ident);
+extern	int debug_syslog_sink_path(struct debug_syslog_sink *sl,
+	    const char *path);
+extern	void debug_syslog_sink_format(struct debug_syslog_sink *sl,
+	    int format, int facility);
+extern	int debug_syslog_prio(debug_mask_t mask);
+extern	void debug_syslog_sink_free(struct debug_syslog_sink *sl);
+
+/* debug_worker.c */
+extern	void debug_worker_init(struct debug_instance *ds);
+extern	int debug_worker_register(struct debug_instance *ds,
+	    const struct debug_sink_ops *ops, void *arg, debug_mask_t mask,
+	    int type);
+extern	void debug_worker_set_mask(struct debug_instance *ds, int id,
+	    debug_mask_t mask);
+extern	void debug_worker_unregister(struct debug_instance *ds, int id);
+extern	void debug_worker_add(struct debug_instance *ds,
+	    const struct debug_entry *de, const char *pfx, const char *msg);
+extern	void debug_worker_publish(struct debug_instance *ds);
+extern	void debug_worker_shutdown(struct debug_instance *ds);
+
+/* debug_shm.c */
+extern	int debug_shm_active(void);
+extern	int debug_shm_publish(uint64_t ts, debug_section_t section,
+	    debug_mask_t mask, int types, const char *msg, int len);
+extern	void debug_shm_shutdown(void);
+
+/*
+ * What a DEBUG*() call logs, for the enqueue path shared by all of
+ * them; see debug_instance_enqueue().  args is the captured arguments
+ * for DEBUG_PAYLOAD_ARGS and the encoded fields for DEBUG_PAYLOAD_KV.
+ */
+#define	DEBUG_PAYLOAD_FMT		0	/* fmt, *ap and xerrno (or -1) */
+#define	DEBUG_PAYLOAD_ARGS		1	/* fmt and args */
+#define	DEBUG_PAYLOAD_KV		2	/* args */
+
+struct debug_payload {
+	int type;
+	const char *fmt;
+	va_list *ap;
+	int xerrno;
+	char *args;
+	size_t argslen;
+	int args_is_heap;		/* KV: args is to be freed */
+};
+
+/* debug_uring.c */
+extern	int debug_uring_init(struct debug_uring *u);
+extern	size_t debug_uring_write(struct debug_uring *u, int fd,
+	    const char *buf, size_t len);
+extern	void debug_uring_submit(struct debug_uring *u);
+extern	void debug_uring_wait(struct debug_uring *u);
+extern	int debug_uring_failed(struct debug_uring *u);
+extern	void debug_uring_free(struct debug_uring *u);
+
+/* debug_fmt.c */
+extern	int debug_fmt_capture(char *buf, size_t buflen, const char *fmt,
+	    va_list ap);
+extern	int debug_fmt_render(struct debug_fmt_buf *fb, const char *fmt,
+	    const char *args, size_t argslen);
+extern	int debug_fmt_buf_reserve(struct debug_fmt_buf *fb, size_t len);
+extern	int debug_fmt_buf_append(struct debug_fmt_buf *fb, const char *s,
+	    size_t len);
+extern	int debug_fmt_buf_printf(struct debug_fmt_buf *fb, const char *fmt,
+	    ...);
+extern	int debug_u64toa(char *buf, uint64_t v, int base, int width);
+extern	size_t debug_kv_size(const char *event, const struct debug_kv *kv,
+	    int nkv);
+extern	int debug_kv_encode(char *buf, size_t buflen, const char *event,
+	    const struct debug_kv *kv, int nkv);
+extern	int debug_kv_render(struct debug_fmt_buf *fb, const char *args,
+	    size_t argslen, int json);
+extern	const char *debug_kv_event(const char *args, size_t argslen,
+	    uint32_t *len);
+extern	int debug_json_escape(struct debug_fmt_buf *fb, const char *s,
+	    size_t len);
+extern	int debug_json_line(struct debug_fmt_buf *fb, uint64_t ns,
+	    const char *section, debug_mask_t mask, const char *msg, int len,
+	    int kv);
+
 #endif
@@ -0,0 +1,549 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The log file: optionally compressed (gzip, or zstd where available)
+ * and rotated by size and/or age, keeping a number of old generations.
+ *
+ * Everything here runs on the logger thread (or the DEBUG_OVERFLOW_SYNC
+ * caller) with debug_file_lock held, so compression never happens on
+ * the threads doing the logging.  Each write is flushed through the
+ * compressor so the file is always readable up to the last batch;
+ * a longer flush policy gives the compressor more to work with.
+ *
+ * Gzip members and zstd frames can be concatenated, so appending to
+ * an existing compressed file still gives a valid file.
+ *
+ * If asynchronous writes are enabled the output is handed to io_uring
+ * (see debug_uring.c) rather than written directly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#ifdef	DEBUG_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef	DEBUG_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "debug.h"
+#include "debug_internal.h"
+
+void
+debug_logfile_init(struct debug_logfile *lf)
+{
+
+	bzero(lf, sizeof(*lf));
+	lf->fd = -1;
+	lf->level = -1;
+	lf->sync_fd = -1;
+	pthread_mutex_init(&lf->fd_lock, NULL);
+}
+
+/*
+ * Recompute the descriptor direct writes may use; called with
+ * fd_lock held after anything which changes it.
+ */
+static void
+debug_logfile_sync_update(struct debug_logfile *lf)
+{
+
+	lf->sync_fd = (lf->zmode == DEBUG_COMPRESS_NONE &&
+	    lf->uring == NULL) ? lf->fd : -1;
+}
+
+/*
+ * Is this compression method built in?
+ */
+int
+debug_logfile_compress_ok(debug_compress_t c)
+{
+
+	switch (c) {
+	case DEBUG_COMPRESS_NONE:
+		return (1);
+#ifdef	DEBUG_HAVE_ZLIB
+	case DEBUG_COMPRESS_GZIP:
+		return (1);
+#endif
+#ifdef	DEBUG_HAVE_ZSTD
+	case DEBUG_COMPRESS_ZSTD:
+		return (1);
+#endif
+	default:
+		return (0);
+	}
+}
+
+static void
+debug_logfile_write_raw(struct debug_logfile *lf, const char *buf,
+    size_t len)
+{
+	ssize_t r;
+
+	if (lf->uring != NULL) {
+		r = debug_uring_write(lf->uring, lf->fd, buf, len);
+		buf += r;
+		len -= r;
+		lf->size += r;
+	}
+	while (len > 0) {
+		r = write(lf->fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			__atomic_add_fetch(&lf->nerrors, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		buf += r;
+		len -= r;
+		lf->size += r;
+	}
+}
+
+/*
+ * Start a compression stream.  On failure the file is written
+ * uncompressed.
+ */
+static void
+debug_logfile_zstart(struct debug_logfile *lf)
+{
+
+	lf->zmode = DEBUG_COMPRESS_NONE;
+	if (lf->compress == DEBUG_COMPRESS_NONE)
+		return;
+	if (lf->zbuf == NULL) {
+		lf->zbuf = malloc(DEBUG_LOGFILE_ZBUF_SIZE);
+		if (lf->zbuf == NULL)
+			return;
+	}
+
+	switch (lf->compress) {
+#ifdef	DEBUG_HAVE_ZLIB
+	case DEBUG_COMPRESS_GZIP: {
+		z_stream *zs;
+
+		zs = calloc(1, sizeof(*zs));
+		if (zs == NULL)
+			return;
+		/* 15 bits of window plus 16 for a gzip wrapper */
+		if (deflateInit2(zs, lf->level >= 0 ? lf->level :
+		    Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+		    Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(zs);
+			return;
+		}
+		lf->zs = zs;
+		break;
+	}
+#endif
+#ifdef	DEBUG_HAVE_ZSTD
+	case DEBUG_COMPRESS_ZSTD: {
+		ZSTD_CCtx *zc;
+
+		zc = ZSTD_createCCtx();
+		if (zc == NULL)
+			return;
+		if (lf->level >= 0)
+			(void) ZSTD_CCtx_setParameter(zc,
+			    ZSTD_c_compressionLevel, lf->level);
+		lf->zs = zc;
+		break;
+	}
+#endif
+	default:
+		return;
+	}
+	lf->zmode = lf->compress;
+}
+
+/*
+ * Feed buf (which may be empty) to the compressor and write out
+ * what comes back.  op is one of DEBUG_LOGFILE_Z_*.
+ */
+static void
+debug_logfile_zwrite(struct debug_logfile *lf, const char *buf, size_t len,
+    int op)
+{
+
+	switch (lf->zmode) {
+#ifdef	DEBUG_HAVE_ZLIB
+	case DEBUG_COMPRESS_GZIP: {
+		z_stream *zs = lf->zs;
+		int flush, ret;
+
+		flush = (op == DEBUG_LOGFILE_Z_END) ? Z_FINISH :
+		    (op == DEBUG_LOGFILE_Z_FLUSH) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+		zs->next_in = (Bytef *) (uintptr_t) buf;
+		zs->avail_in = len;
+		do {
+			zs->next_out = (Bytef *) lf->zbuf;
+			zs->avail_out = DEBUG_LOGFILE_ZBUF_SIZE;
+			ret = deflate(zs, flush);
+			if (ret == Z_STREAM_ERROR)
+				return;
+			debug_logfile_write_raw(lf, lf->zbuf,
+			    DEBUG_LOGFILE_ZBUF_SIZE - zs->avail_out);
+		} while (zs->avail_out == 0 ||
+		    (flush == Z_FINISH && ret != Z_STREAM_END));
+		break;
+	}
+#endif
+#ifdef	DEBUG_HAVE_ZSTD
+	case DEBUG_COMPRESS_ZSTD: {
+		ZSTD_inBuffer in = { buf, len, 0 };
+		ZSTD_outBuffer out;
+		ZSTD_EndDirective mode;
+		size_t ret;
+
+		mode = (op == DEBUG_LOGFILE_Z_END) ? ZSTD_e_end :
+		    (op == DEBUG_LOGFILE_Z_FLUSH) ? ZSTD_e_flush :
+		    ZSTD_e_continue;
+		do {
+			out.dst = lf->zbuf;
+			out.size = DEBUG_LOGFILE_ZBUF_SIZE;
+			out.pos = 0;
+			ret = ZSTD_compressStream2(lf->zs, &out, &in, mode);
+			if (ZSTD_isError(ret))
+				return;
+			debug_logfile_write_raw(lf, lf->zbuf, out.pos);
+		} while (in.pos < in.size ||
+		    (mode != ZSTD_e_continue && ret != 0));
+		break;
+	}
+#endif
+	default:
+		break;
+	}
+}
+
+/*
+ * Finish the compression stream, if any, and free it.
+ */
+static void
+debug_logfile_zend(struct debug_logfile *lf)
+{
+
+	if (lf->zs == NULL)
+		return;
+	debug_logfile_zwrite(lf, NULL, 0, DEBUG_LOGFILE_Z_END);
+	switch (lf->zmode) {
+#ifdef	DEBUG_HAVE_ZLIB
+	case DEBUG_COMPRESS_GZIP:
+		(void) deflateEnd(lf->zs);
+		free(lf->zs);
+		break;
+#endif
+#ifdef	DEBUG_HAVE_ZSTD
+	case DEBUG_COMPRESS_ZSTD:
+		ZSTD_freeCCtx(lf->zs);
+		break;
+#endif
+	default:
+		break;
+	}
+	lf->zs = NULL;
+	lf->zmode = DEBUG_COMPRESS_NONE;
+}
+
+/*
+ * The name of old generation gen (1 being the newest.)  Any ".gz" or
+ * ".zst" suffix is kept on the end, so "app.log.gz" becomes
+ * "app.log.1.gz".
+ */
+static void
+debug_logfile_genname(const struct debug_logfile *lf, unsigned int gen,
+    char *buf, size_t size)
+{
+	static const char *sfx[] = { ".gz", ".zst", NULL };
+	size_t len, sl;
+	int i;
+
+	len = strlen(lf->path);
+	for (i = 0; sfx[i] != NULL; i++) {
+		sl = strlen(sfx[i]);
+		if (len > sl && strcmp(lf->path + len - sl, sfx[i]) == 0) {
+			snprintf(buf, size, "%.*s.%u%s", (int) (len - sl),
+			    lf->path, gen, sfx[i]);
+			return;
+		}
+	}
+	snprintf(buf, size, "%s.%u", lf->path, gen);
+}
+
+static int
+debug_logfile_open_path(struct debug_logfile *lf)
+{
+	struct stat sb;
+	int fd;
+
+	fd = open(lf->path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0)
+		return (-1);
+	lf->size = (fstat(fd, &sb) == 0) ? sb.st_size : 0;
+	lf->opened = time(NULL);
+	return (fd);
+}
+
+/*
+ * Open path for appending; returns the file descriptor or -1.
+ */
+static void
+debug_logfile_close_locked(struct debug_logfile *lf)
+{
+
+	if (lf->fd >= 0) {
+		debug_logfile_zend(lf);
+		if (lf->uring != NULL)
+			debug_uring_wait(lf->uring);
+		close(lf->fd);
+		lf->fd = -1;
+	}
+	free(lf->path);
+	lf->path = NULL;
+	debug_logfile_sync_update(lf);
+}
+
+int
+debug_logfile_open(struct debug_logfile *lf, const char *path)
+{
+	int fd = -1;
+
+	(void) pthread_mutex_lock(&lf->fd_lock);
+	debug_logfile_close_locked(lf);
+	lf->path = strdup(path);
+	if (lf->path == NULL)
+		goto done;
+	lf->fd = debug_logfile_open_path(lf);
+	if (lf->fd < 0) {
+		free(lf->path);
+		lf->path = NULL;
+		goto done;
+	}
+	debug_logfile_zstart(lf);
+	debug_logfile_sync_update(lf);
+	fd = lf->fd;
+done:
+	(void) pthread_mutex_unlock(&lf->fd_lock);
+	return (fd);
+}
+
+void
+debug_logfile_close(struct debug_logfile *lf)
+{
+
+	(void) pthread_mutex_lock(&lf->fd_lock);
+	debug_logfile_close_locked(lf);
+	(void) pthread_mutex_unlock(&lf->fd_lock);
+}
+
+void
+debug_logfile_free(struct debug_logfile *lf)
+{
+
+	debug_logfile_close(lf);
+	(void) debug_logfile_set_async(lf, 0);
+	free(lf->zbuf);
+	lf->zbuf = NULL;
+	pthread_mutex_destroy(&lf->fd_lock);
+}
+
+/*
+ * Switch to (or from) writing the file through io_uring.  Returns
+ * -1 if io_uring isn't available, in which case writev() is used.
+ */
+int
+debug_logfile_set_async(struct debug_logfile *lf, int enable)
+{
+	struct debug_uring *u;
+	int ret = 0;
+
+	(void) pthread_mutex_lock(&lf->fd_lock);
+	if (enable && lf->uring == NULL) {
+		u = malloc(sizeof(*u));
+		if (u == NULL) {
+			ret = -1;
+		} else if (debug_uring_init(u) < 0) {
+			free(u);
+			ret = -1;
+		} else {
+			u->nerrors = &lf->nerrors;
+			lf->uring = u;
+		}
+	} else if (! enable && lf->uring != NULL) {
+		debug_uring_free(lf->uring);
+		free(lf->uring);
+		lf->uring = NULL;
+	}
+	debug_logfile_sync_update(lf);
+	(void) pthread_mutex_unlock(&lf->fd_lock);
+	return (ret);
+}
+
+/*
+ * Shuffle the old generations along and start a new file.  The new
+ * file is dup2()ed onto the old descriptor so the sink (and the
+ * crash handler) never see it change.
+ */
+static void
+debug_logfile_rotate(struct debug_logfile *lf)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	unsigned int i;
+	int fd;
+
+	debug_logfile_zend(lf);
+	if (lf->uring != NULL)
+		debug_uring_wait(lf->uring);
+
+	/* Direct writes wait here rather than landing in the old file */
+	(void) pthread_mutex_lock(&lf->fd_lock);
+	if (lf->ngen == 0) {
+		(void) unlink(lf->path);
+	} else {
+		debug_logfile_genname(lf, lf->ngen, to, sizeof(to));
+		(void) unlink(to);
+		for (i = lf->ngen - 1; i >= 1; i--) {
+			debug_logfile_genname(lf, i, from, sizeof(from));
+			debug_logfile_genname(lf, i + 1, to, sizeof(to));
+			(void) rename(from, to);
+		}
+		debug_logfile_genname(lf, 1, to, sizeof(to));
+		(void) rename(lf->path, to);
+	}
+
+	fd = debug_logfile_open_path(lf);
+	if (fd >= 0) {
+		(void) dup2(fd, lf->fd);
+		close(fd);
+	} else {
+		/* Keep writing to the old file rather than losing data */
+		fprintf(stderr, "%s: open failed (%s): %s\n", __func__,
+		    lf->path, strerror(errno));
+	}
+	debug_logfile_zstart(lf);
+	debug_logfile_sync_update(lf);
+	(void) pthread_mutex_unlock(&lf->fd_lock);
+}
+
+/*
+ * Write a line to the file from a thread other than the logger, if
+ * it's plain and written with writev(); see struct debug_logfile.
+ * This doesn't wait for the logger, only for an open or a rotation.
+ *
+ * Returns 0 if it was written, else -1 and the caller should leave
+ * the line to the logger.
+ */
+int
+debug_logfile_write_direct(struct debug_logfile *lf, struct iovec *iov,
+    int niov)
+{
+	size_t len, n;
+	int i;
+
+	(void) pthread_mutex_lock(&lf->fd_lock);
+	if (lf->sync_fd < 0) {
+		(void) pthread_mutex_unlock(&lf->fd_lock);
+		return (-1);
+	}
+	for (i = 0, len = 0; i < niov; i++)
+		len += iov[i].iov_len;
+	n = debug_sink_writev(lf->sync_fd, iov, niov);
+	(void) pthread_mutex_unlock(&lf->fd_lock);
+
+	__atomic_add_fetch(&lf->direct_bytes, n, __ATOMIC_RELAXED);
+	if (n < len) {
+		__atomic_add_fetch(&lf->nerrors, 1, __ATOMIC_RELAXED);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Write a batch out, rotating first if the current file is due.
+ */
+void
+debug_logfile_writev(struct debug_logfile *lf, struct iovec *iov, int niov)
+{
+	size_t len, n;
+	int i;
+
+	if (lf->fd < 0)
+		return;
+	lf->size += __atomic_exchange_n(&lf->direct_bytes, 0,
+	    __ATOMIC_RELAXED);
+	if ((lf->rotate_bytes != 0 && lf->size >= lf->rotate_bytes) ||
+	    (lf->rotate_sec != 0 &&
+	    (uint64_t) (time(NULL) - lf->opened) >= lf->rotate_sec))
+		debug_logfile_rotate(lf);
+
+	if (lf->zmode != DEBUG_COMPRESS_NONE) {
+		for (i = 0; i < niov; i++)
+			debug_logfile_zwrite(lf, iov[i].iov_base,
+			    iov[i].iov_len, DEBUG_LOGFILE_Z_DATA);
+		debug_logfile_zwrite(lf, NULL, 0, DEBUG_LOGFILE_Z_FLUSH);
+	} else if (lf->uring != NULL) {
+		for (i = 0; i < niov; i++)
+			debug_logfile_write_raw(lf, iov[i].iov_base,
+			    iov[i].iov_len);
+	} else {
+		for (i = 0, len = 0; i < niov; i++)
+			len += iov[i].iov_len;
+		n = debug_sink_writev(lf->fd, iov, niov);
+		lf->size += n;
+		if (n < len)
+			__atomic_add_fetch(&lf->nerrors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (lf->uring != NULL) {
+		debug_uring_submit(lf->uring);
+		if (debug_uring_failed(lf->uring)) {
+			fprintf(stderr, "%s: io_uring writes failed, "
+			    "using writev()\n", __func__);
+			(void) debug_logfile_set_async(lf, 0);
+		}
+	}
+}
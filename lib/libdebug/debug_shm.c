@@ -0,0 +1,203 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory log transport.
+ *
+ * Once debug_shm_init() is called every line is formatted by the
+ * calling thread and copied straight into a per-process memory mapped
+ * ring file rather than the per-thread queues, and libdebug-collectord
+ * does the writing for every process on the host.  See debug_trace.h
+ * for the layout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#include "debug.h"
+#include "debug_internal.h"
+#include "debug_trace.h"
+
+struct debug_shm {
+	struct debug_shm_hdr *hdr;
+	char *data;
+	uint32_t mask;
+	size_t maplen;
+};
+
+static struct debug_shm debug_shm;
+static atomic_int debug_shm_enabled;
+
+int
+debug_shm_active(void)
+{
+
+	return (atomic_load_explicit(&debug_shm_enabled,
+	    memory_order_acquire));
+}
+
+/*
+ * Send everything logged from here on to libdebug-collectord through
+ * a region file in dir (which the collector is watching) with a ring
+ * of size bytes, rounded up to a power of two.
+ */
+int
+debug_shm_init(const char *dir, size_t size)
+{
+	struct debug_shm_hdr *h;
+	char path[PATH_MAX];
+	size_t off, n;
+	void *p;
+	int fd;
+
+	if (dir == NULL || debug_shm_active())
+		return (-1);
+	for (n = 4096; n < size && n < (1U << 30); n <<= 1)
+		;
+
+	off = (sizeof(*h) + DEBUG_CACHELINE_SIZE - 1) &
+	    ~(DEBUG_CACHELINE_SIZE - 1);
+	snprintf(path, sizeof(path), "%s/", dir);
+	debug_trace_get_progname(path + strlen(path),
+	    sizeof(path) - strlen(path));
+	snprintf(path + strlen(path), sizeof(path) - strlen(path),
+	    ".%ld.shm", (long) getpid());
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return (-1);
+	if (ftruncate(fd, off + n) < 0) {
+		close(fd);
+		(void) unlink(path);
+		return (-1);
+	}
+	p = mmap(NULL, off + n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		(void) unlink(path);
+		return (-1);
+	}
+
+	h = p;
+	h->version = DEBUG_SHM_VERSION;
+	h->size = n;
+	h->data_offset = off;
+	h->pid = getpid();
+	debug_trace_get_progname(h->progname, sizeof(h->progname));
+
+	debug_shm.hdr = h;
+	debug_shm.data = (char *) p + off;
+	debug_shm.mask = n - 1;
+	debug_shm.maplen = off + n;
+
+	/* The collector ignores the file until the magic is there */
+	__atomic_store_n(&h->magic, DEBUG_SHM_MAGIC, __ATOMIC_RELEASE);
+	atomic_store_explicit(&debug_shm_enabled, 1, memory_order_release);
+	return (0);
+}
+
+/*
+ * Copy a line into the region.  types is the destinations the
+ * collector should write it to.
+ *
+ * Returns -1 (and counts it in the header) if it didn't fit.
+ */
+int
+debug_shm_publish(uint64_t ts, debug_section_t section, debug_mask_t mask,
+    int types, const char *msg, int len)
+{
+	struct debug_shm_hdr *h = debug_shm.hdr;
+	struct debug_shm_rec *r;
+	uint64_t w, rd;
+	uint32_t need, pad, off;
+
+	/* Nothing gets to take more than a quarter of the ring */
+	if ((size_t) len > h->size / 4 - sizeof(*r))
+		len = h->size / 4 - sizeof(*r);
+	need = (sizeof(*r) + len + DEBUG_SHM_ALIGN - 1) &
+	    ~(DEBUG_SHM_ALIGN - 1);
+
+	w = __atomic_load_n(&h->widx, __ATOMIC_RELAXED);
+	do {
+		off = w & debug_shm.mask;
+		pad = (off + need > h->size) ? h->size - off : 0;
+		rd = __atomic_load_n(&h->ridx, __ATOMIC_ACQUIRE);
+		if (w + pad + need - rd > h->size) {
+			__atomic_fetch_add(&h->drops, 1, __ATOMIC_RELAXED);
+			return (-1);
+		}
+	} while (! __atomic_compare_exchange_n(&h->widx, &w, w + pad + need,
+	    1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	/* The collector has zeroed everything up to ridx + size */
+	if (pad != 0) {
+		r = (struct debug_shm_rec *) (debug_shm.data + off);
+		__atomic_store_n(&r->commit, pad | DEBUG_SHM_PAD,
+		    __ATOMIC_RELEASE);
+		off = 0;
+	}
+	r = (struct debug_shm_rec *) (debug_shm.data + off);
+	r->types = types;
+	r->section = section;
+	r->msglen = len;
+	r->ts = ts;
+	r->mask = mask;
+	memcpy(r->msg, msg, len);
+	__atomic_store_n(&r->commit, need, __ATOMIC_RELEASE);
+	return (0);
+}
+
+/*
+ * Mark the region closed so the collector removes it once it's
+ * drained, and unmap it.  Nothing else may be logging.
+ */
+void
+debug_shm_shutdown(void)
+{
+
+	if (! debug_shm_active())
+		return;
+	atomic_store(&debug_shm_enabled, 0);
+	__atomic_store_n(&debug_shm.hdr->closed, 1, __ATOMIC_RELEASE);
+	(void) munmap(debug_shm.hdr, debug_shm.maplen);
+	bzero(&debug_shm, sizeof(debug_shm));
+}
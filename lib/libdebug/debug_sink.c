@@ -0,0 +1,294 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Output sinks.
+ *
+ * The logger thread hands each sink the prefix and message pointers
+ * for every line in a drained batch as an iovec.  When the sink is
+ * due to be flushed the batch goes out in a single writev(); else
+ * it's copied into the sink's pending buffer, which is written out
+ * once the flush policy says so.
+ *
+ * All of this is called with debug_file_lock held.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "os/time.h"
+
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#include "debug.h"
+#include "debug_internal.h"
+
+#ifndef	IOV_MAX
+#define	IOV_MAX		1024
+#endif
+
+/* Monotonic milliseconds, for the flush interval */
+uint64_t
+debug_sink_now_ms(void)
+{
+	struct timespec ts;
+
+	OS_clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void
+debug_sink_init(struct debug_sink *sk, int fd)
+{
+
+	bzero(sk, sizeof(*sk));
+	sk->fd = fd;
+}
+
+/*
+ * Write out everything in iov, coping with short writes and
+ * IOV_MAX.  iov is modified.  On error the rest is dropped.
+ *
+ * Returns the number of bytes written; the caller counts a shortfall
+ * as a failed write.
+ */
+size_t
+debug_sink_writev(int fd, struct iovec *iov, int niov)
+{
+	size_t total = 0;
+	ssize_t r;
+	int n;
+
+	while (niov > 0) {
+		n = niov > IOV_MAX ? IOV_MAX : niov;
+		r = writev(fd, iov, n);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return (total);
+		}
+		total += r;
+		/* Skip over what was written */
+		while (niov > 0 && (size_t) r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if (niov > 0) {
+			iov->iov_base = (char *) iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return (total);
+}
+
+/*
+ * Write to the sink's log file, if it has one, else its descriptor.
+ */
+static void
+debug_sink_out(struct debug_sink *sk, struct iovec *iov, int niov)
+{
+	uint64_t t0;
+	size_t len;
+	int i;
+
+	t0 = OS_clock_gettime_ns(OS_CLOCK_MONOTONIC);
+	if (sk->lf != NULL)
+		debug_logfile_writev(sk->lf, iov, niov);
+	else {
+		for (i = 0, len = 0; i < niov; i++)
+			len += iov[i].iov_len;
+		if (debug_sink_writev(sk->fd, iov, niov) < len)
+			__atomic_add_fetch(&sk->nerrors, 1, __ATOMIC_RELAXED);
+	}
+	sk->write_ns[debug_stats_bucket(OS_clock_gettime_ns(
+	    OS_CLOCK_MONOTONIC) - t0)]++;
+}
+
+/*
+ * Queue a buffer as part of the current batch.  buf must stay valid
+ * until debug_sink_batch_done() is called.
+ */
+int
+debug_sink_add(struct debug_sink *sk, const char *buf, size_t len)
+{
+	struct iovec *iov;
+	int n;
+
+	if (len == 0)
+		return (0);
+	if (sk->niov == sk->iov_size) {
+		n = sk->iov_size ? sk->iov_size * 2 : DEBUG_SINK_IOV_INIT_SIZE;
+		iov = realloc(sk->iov, n * sizeof(*iov));
+		if (iov == NULL)
+			return (-1);
+		sk->iov = iov;
+		sk->iov_size = n;
+	}
+	sk->iov[sk->niov].iov_base = (void *) (uintptr_t) buf;
+	sk->iov[sk->niov].iov_len = len;
+	sk->niov++;
+	sk->iov_bytes += len;
+	return (0);
+}
+
+/*
+ * Write out the pending buffer.
+ */
+void
+debug_sink_flush(struct debug_sink *sk)
+{
+	struct iovec iov;
+
+	if (sk->pending.len == 0)
+		return;
+	if (sk->fd >= 0) {
+		iov.iov_base = sk->pending.buf;
+		iov.iov_len = sk->pending.len;
+		debug_sink_out(sk, &iov, 1);
+	}
+	sk->pending.len = 0;
+}
+
+/*
+ * Is the pending data due to be written under the given policy?
+ */
+static int
+debug_sink_due(const struct debug_sink *sk, const struct debug_flush_cfg *fc,
+    int urgent, uint64_t now)
+{
+
+	if (sk->pending.len + sk->iov_bytes >= DEBUG_SINK_PENDING_MAX)
+		return (1);
+	switch (fc->policy) {
+	case DEBUG_FLUSH_BYTES:
+		return (sk->pending.len + sk->iov_bytes >= fc->nbytes);
+	case DEBUG_FLUSH_INTERVAL:
+		return (sk->pending.len != 0 &&
+		    now - sk->pending_since >= fc->msec);
+	case DEBUG_FLUSH_WARNING:
+		return (urgent);
+	case DEBUG_FLUSH_BATCH:
+	default:
+		return (1);
+	}
+}
+
+/*
+ * Finish the current batch: either write it out along with anything
+ * pending, or copy it into the pending buffer.  urgent is set if the
+ * batch contains a warning or worse.
+ */
+void
+debug_sink_batch_done(struct debug_sink *sk, const struct debug_flush_cfg *fc,
+    int urgent, uint64_t now)
+{
+	int i, due;
+
+	/* No new data; the flush interval may still have expired */
+	if (sk->niov == 0) {
+		if (sk->pending.len != 0 && debug_sink_due(sk, fc, urgent, now))
+			debug_sink_flush(sk);
+		return;
+	}
+	if (sk->fd < 0)
+		goto done;
+
+	due = debug_sink_due(sk, fc, urgent, now);
+
+	/* The common case - nothing pending, so write the batch as-is */
+	if (due && sk->pending.len == 0) {
+		debug_sink_out(sk, sk->iov, sk->niov);
+		goto done;
+	}
+
+	if (sk->pending.len == 0)
+		sk->pending_since = now;
+	for (i = 0; i < sk->niov; i++) {
+		if (debug_fmt_buf_append(&sk->pending, sk->iov[i].iov_base,
+		    sk->iov[i].iov_len) < 0) {
+			/* Out of memory; write directly */
+			debug_sink_flush(sk);
+			debug_sink_out(sk, sk->iov + i, sk->niov - i);
+			goto done;
+		}
+	}
+	if (due)
+		debug_sink_flush(sk);
+done:
+	sk->niov = 0;
+	sk->iov_bytes = 0;
+}
+
+/*
+ * Milliseconds until the pending data has to be written, or -1
+ * if there's no deadline.
+ */
+int
+debug_sink_deadline(const struct debug_sink *sk,
+    const struct debug_flush_cfg *fc, uint64_t now)
+{
+
+	if (sk->pending.len == 0 || fc->policy != DEBUG_FLUSH_INTERVAL)
+		return (-1);
+	if (now - sk->pending_since >= fc->msec)
+		return (0);
+	return (fc->msec - (now - sk->pending_since));
+}
+
+/*
+ * Flush and forget the file descriptor (which the caller closes.)
+ */
+void
+debug_sink_detach(struct debug_sink *sk)
+{
+
+	debug_sink_flush(sk);
+	sk->fd = -1;
+}
+
+void
+debug_sink_free(struct debug_sink *sk)
+{
+
+	free(sk->iov);
+	free(sk->pending.buf);
+	bzero(sk, sizeof(*sk));
+	sk->fd = -1;
+}
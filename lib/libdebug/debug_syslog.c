@@ -0,0 +1,370 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Syslog sink.
+ *
+ * Rather than calling syslog(3) for each line, which formats its own
+ * header and makes a send() per line, the syslog worker builds the
+ * frame headers for a batch of lines itself and hands them to the
+ * local syslog socket (/dev/log unless debug_syslog_set_path() says
+ * otherwise) with a single sendmmsg().  Each datagram is the header
+ * and the message as a two entry iovec, so the text isn't copied.
+ *
+ * The priority comes from the most severe level bit in the line's
+ * mask.  RFC 3164 frames carry the time in the local timezone to the
+ * second, which is what every local syslog daemon expects; RFC 5424
+ * frames carry it in UTC to the microsecond, along with the hostname
+ * and the section name as the MSGID.
+ *
+ * The sends block if the daemon falls behind, which only holds up the
+ * syslog worker.  Lines which can't be sent at all (nothing is
+ * listening, or a line is too big for the socket) are dropped, as
+ * syslog(3) does.
+ */
+
+#define	_GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <stdatomic.h>
+
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <pthread.h>
+
+#include "debug.h"
+#include "debug_internal.h"
+
+/* Lines sent per sendmmsg() */
+#define	DEBUG_SYSLOG_BATCH	64
+
+#ifndef	DEBUG_HAVE_SENDMMSG
+/* Send them one at a time where there's no sendmmsg() */
+struct debug_mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#define	mmsghdr		debug_mmsghdr
+#define	sendmmsg	debug_sendmmsg
+
+static int
+debug_sendmmsg(int fd, struct mmsghdr *mv, unsigned int n, int flags)
+{
+	unsigned int i;
+	ssize_t r;
+
+	for (i = 0; i < n; i++) {
+		r = sendmsg(fd, &mv[i].msg_hdr, flags);
+		if (r < 0)
+			return (i > 0 ? (int) i : -1);
+		mv[i].msg_len = r;
+	}
+	return (i);
+}
+#endif
+
+void
+debug_syslog_sink_init(struct debug_syslog_sink *sl, char **names)
+{
+
+	bzero(sl, sizeof(*sl));
+	pthread_mutex_init(&sl->lock, NULL);
+	sl->fd = -1;
+	sl->names = names;
+	sl->format = DEBUG_SYSLOG_RFC3164;
+	sl->facility = LOG_DAEMON;
+	snprintf(sl->path, sizeof(sl->path), "%s", DEBUG_SYSLOG_PATH);
+	snprintf(sl->ident, sizeof(sl->ident), "libdebug");
+	if (gethostname(sl->host, sizeof(sl->host)) < 0 ||
+	    sl->host[0] == '\0')
+		snprintf(sl->host, sizeof(sl->host), "-");
+	sl->host[sizeof(sl->host) - 1] = '\0';
+	sl->pid = getpid();
+	sl->ts_sec = -1;
+}
+
+/*
+ * Set the tag lines are logged with; like openlog(3) this is the
+ * program name as given.
+ */
+void
+debug_syslog_sink_ident(struct debug_syslog_sink *sl, const char *ident)
+{
+
+	if (ident == NULL || *ident == '\0')
+		return;
+	pthread_mutex_lock(&sl->lock);
+	snprintf(sl->ident, sizeof(sl->ident), "%s", ident);
+	pthread_mutex_unlock(&sl->lock);
+}
+
+/*
+ * Set the socket to send to, or /dev/log if path is NULL.  The
+ * socket is reconnected when the next batch is sent.
+ */
+int
+debug_syslog_sink_path(struct debug_syslog_sink *sl, const char *path)
+{
+
+	if (path == NULL)
+		path = DEBUG_SYSLOG_PATH;
+	if (*path == '\0' || strlen(path) >= sizeof(sl->path) ||
+	    strlen(path) >= sizeof(((struct sockaddr_un *) NULL)->sun_path))
+		return (-1);
+	pthread_mutex_lock(&sl->lock);
+	snprintf(sl->path, sizeof(sl->path), "%s", path);
+	if (sl->fd >= 0) {
+		close(sl->fd);
+		sl->fd = -1;
+	}
+	pthread_mutex_unlock(&sl->lock);
+	return (0);
+}
+
+void
+debug_syslog_sink_format(struct debug_syslog_sink *sl, int format,
+    int facility)
+{
+
+	pthread_mutex_lock(&sl->lock);
+	sl->format = format;
+	sl->facility = facility;
+	sl->ts_sec = -1;
+	pthread_mutex_unlock(&sl->lock);
+}
+
+/*
+ * Map the most severe level in a mask to a syslog priority; a mask
+ * with no level bits (just debug bitmask entries) is LOG_DEBUG.
+ * libdebug's own reports are logged with DEBUG_MASK_ALL and go out
+ * as LOG_NOTICE rather than LOG_EMERG.
+ */
+int
+debug_syslog_prio(debug_mask_t mask)
+{
+
+	if (mask == DEBUG_MASK_ALL)
+		return (LOG_NOTICE);
+	if (mask & DEBUG_LVL_EMERG)
+		return (LOG_EMERG);
+	if (mask & DEBUG_LVL_ALERT)
+		return (LOG_ALERT);
+	if (mask & DEBUG_LVL_CRIT)
+		return (LOG_CRIT);
+	if (mask & DEBUG_LVL_ERR)
+		return (LOG_ERR);
+	if (mask & DEBUG_LVL_WARNING)
+		return (LOG_WARNING);
+	if (mask & DEBUG_LVL_NOTICE)
+		return (LOG_NOTICE);
+	if (mask & DEBUG_LVL_INFO)
+		return (LOG_INFO);
+	return (LOG_DEBUG);
+}
+
+static int
+debug_syslog_connect(struct debug_syslog_sink *sl)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", sl->path);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return (-1);
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+		close(fd);
+		return (-1);
+	}
+	sl->fd = fd;
+	sl->pid = getpid();
+	return (0);
+}
+
+/*
+ * The RFC 5424 MSGID is up to 32 printable characters; use the
+ * section name if it fits.
+ */
+static const char *
+debug_syslog_msgid(struct debug_syslog_sink *sl, debug_section_t section)
+{
+	const char *s, *p;
+
+	if (section < 0 || section >= DEBUG_SECTION_MAX ||
+	    (s = sl->names[section]) == NULL || *s == '\0')
+		return ("-");
+	for (p = s; *p != '\0'; p++) {
+		if (*p <= ' ' || *p > '~' || p - s >= 32)
+			return ("-");
+	}
+	return (s);
+}
+
+/*
+ * Append the frame header for a line.  The timestamp text is cached
+ * per second.
+ */
+static int
+debug_syslog_header(struct debug_syslog_sink *sl, const struct debug_line *l)
+{
+	struct tm tm;
+	time_t sec;
+	int pri;
+
+	pri = sl->facility | debug_syslog_prio(l->mask);
+	sec = l->ts / 1000000000ULL;
+	if (sec != sl->ts_sec) {
+		if (sl->format == DEBUG_SYSLOG_RFC5424) {
+			gmtime_r(&sec, &tm);
+			strftime(sl->ts_buf, sizeof(sl->ts_buf),
+			    "%Y-%m-%dT%H:%M:%S", &tm);
+		} else {
+			localtime_r(&sec, &tm);
+			strftime(sl->ts_buf, sizeof(sl->ts_buf),
+			    "%b %e %H:%M:%S", &tm);
+		}
+		sl->ts_sec = sec;
+	}
+
+	if (sl->format == DEBUG_SYSLOG_RFC5424)
+		return (debug_fmt_buf_printf(&sl->hdrs,
+		    "<%d>1 %s.%06uZ %s %s %d %s - ", pri, sl->ts_buf,
+		    (unsigned int) (l->ts % 1000000000ULL / 1000), sl->host,
+		    sl->ident, sl->pid, debug_syslog_msgid(sl, l->section)));
+	return (debug_fmt_buf_printf(&sl->hdrs, "<%d>%s %s[%d]: ", pri,
+	    sl->ts_buf, sl->ident, sl->pid));
+}
+
+/*
+ * Send a batch, reconnecting once if the daemon has gone away (say
+ * it was restarted.)  Whatever can't be sent is dropped.
+ */
+static void
+debug_syslog_send(struct debug_syslog_sink *sl, struct mmsghdr *mv, int n)
+{
+	int i = 0, r, retried = 0;
+
+	while (i < n) {
+		if (sl->fd < 0 && debug_syslog_connect(sl) < 0)
+			return;
+		r = sendmmsg(sl->fd, mv + i, n - i, 0);
+		if (r > 0) {
+			i += r;
+			continue;
+		}
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EMSGSIZE) {
+			/* Too big for the socket; skip just this line */
+			i++;
+			continue;
+		}
+		close(sl->fd);
+		sl->fd = -1;
+		if (retried++)
+			return;
+	}
+}
+
+static void
+debug_syslog_write(void *arg, const struct debug_line *lines, int nlines)
+{
+	struct debug_syslog_sink *sl = arg;
+	struct mmsghdr mv[DEBUG_SYSLOG_BATCH];
+	struct iovec iov[DEBUG_SYSLOG_BATCH][2];
+	size_t off[DEBUG_SYSLOG_BATCH + 1];
+	const struct debug_line *l;
+	int i, j, n, len;
+
+	pthread_mutex_lock(&sl->lock);
+	for (i = 0; i < nlines; i += n) {
+		n = nlines - i;
+		if (n > DEBUG_SYSLOG_BATCH)
+			n = DEBUG_SYSLOG_BATCH;
+
+		/* Headers first; the buffer may move as it grows */
+		sl->hdrs.len = 0;
+		for (j = 0; j < n; j++) {
+			off[j] = sl->hdrs.len;
+			if (debug_syslog_header(sl, &lines[i + j]) < 0)
+				break;
+		}
+		off[j] = sl->hdrs.len;
+		if (j == 0)
+			break;
+		n = j;
+
+		bzero(mv, sizeof(mv[0]) * n);
+		for (j = 0; j < n; j++) {
+			l = &lines[i + j];
+			len = l->len;
+			if (len > 0 && l->msg[len - 1] == '\n')
+				len--;
+			iov[j][0].iov_base = sl->hdrs.buf + off[j];
+			iov[j][0].iov_len = off[j + 1] - off[j];
+			iov[j][1].iov_base = (void *) (uintptr_t) l->msg;
+			iov[j][1].iov_len = len;
+			mv[j].msg_hdr.msg_iov = iov[j];
+			mv[j].msg_hdr.msg_iovlen = 2;
+		}
+		debug_syslog_send(sl, mv, n);
+	}
+	pthread_mutex_unlock(&sl->lock);
+}
+
+const struct debug_sink_ops debug_syslog_sink_ops = {
+	.write = debug_syslog_write,
+};
+
+void
+debug_syslog_sink_free(struct debug_syslog_sink *sl)
+{
+
+	if (sl->fd >= 0)
+		close(sl->fd);
+	sl->fd = -1;
+	free(sl->hdrs.buf);
+	sl->hdrs.buf = NULL;
+	sl->hdrs.len = sl->hdrs.size = 0;
+	pthread_mutex_destroy(&sl->lock);
+}
@@ -0,0 +1,400 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Binary trace buffer.
+ *
+ * Each thread which calls DEBUG_TRACE() gets its own memory mapped
+ * ring file of fixed size records.  Writing a record is a timestamp,
+ * a few stores and a release store of the write index - no locks,
+ * no formatting and no logger thread involvement.
+ *
+ * The rings are decoded offline with libdebug-tracedecode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+#include "os/time.h"
+#include "os/thread.h"
+
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#include "debug.h"
+#include "debug_internal.h"
+#include "debug_trace.h"
+
+struct debug_trace_ring {
+	TAILQ_ENTRY(debug_trace_ring) t;
+	struct debug_trace_hdr *hdr;
+	struct debug_trace_rec *recs;
+	uint32_t mask;
+	size_t maplen;
+};
+
+/*
+ * The ring list and configuration are protected by debug_trace_lock;
+ * the rings themselves are only written by their owning thread.
+ */
+static pthread_mutex_t debug_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(, debug_trace_ring) debug_trace_rings =
+    TAILQ_HEAD_INITIALIZER(debug_trace_rings);
+static pthread_key_t debug_trace_key;
+static char *debug_trace_dir;
+static char debug_trace_progname[DEBUG_TRACE_NAME_LEN];
+static unsigned int debug_trace_nrecs;
+static atomic_uint debug_trace_gen;
+static atomic_int debug_trace_enabled;
+
+/*
+ * The calling thread's ring and the gen it was created in.  Once
+ * debug_trace_shutdown() has freed the rings debug_trace_self is left
+ * dangling, so the gen is kept out here and checked before it's used.
+ */
+static __thread struct debug_trace_ring *debug_trace_self;
+static __thread unsigned int debug_trace_self_gen;
+static __thread unsigned int debug_trace_failed_gen;
+
+static void
+debug_trace_ring_unmap(struct debug_trace_ring *tr)
+{
+
+	(void) munmap(tr->hdr, tr->maplen);
+	free(tr);
+}
+
+/*
+ * pthread key destructor; the file stays behind for decoding.
+ */
+static void
+debug_trace_thread_exit(void *arg)
+{
+	struct debug_trace_ring *tr = arg;
+
+	(void) pthread_mutex_lock(&debug_trace_lock);
+	TAILQ_REMOVE(&debug_trace_rings, tr, t);
+	(void) pthread_mutex_unlock(&debug_trace_lock);
+	debug_trace_ring_unmap(tr);
+}
+
+/*
+ * Create and map the calling thread's trace ring.
+ */
+static struct debug_trace_ring *
+debug_trace_ring_create(unsigned int gen)
+{
+	struct debug_trace_ring *tr;
+	struct debug_trace_hdr *h;
+	char path[PATH_MAX];
+	size_t off, maplen;
+	void *p;
+	int fd, i;
+
+	tr = calloc(1, sizeof(*tr));
+	if (tr == NULL)
+		return (NULL);
+
+	(void) pthread_mutex_lock(&debug_trace_lock);
+	if (debug_trace_dir == NULL)
+		goto fail;
+
+	snprintf(path, sizeof(path), "%s/%s.%ld.%ld.trace",
+	    debug_trace_dir,
+	    debug_trace_progname,
+	    (long) getpid(),
+	    OS_gettid());
+
+	off = (sizeof(*h) + DEBUG_CACHELINE_SIZE - 1) &
+	    ~(DEBUG_CACHELINE_SIZE - 1);
+	maplen = off + sizeof(struct debug_trace_rec) * debug_trace_nrecs;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto fail;
+	if (ftruncate(fd, maplen) < 0) {
+		close(fd);
+		goto fail;
+	}
+	p = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		goto fail;
+
+	h = p;
+	h->magic = DEBUG_TRACE_MAGIC;
+	h->version = DEBUG_TRACE_VERSION;
+	h->rec_size = sizeof(struct debug_trace_rec);
+	h->nrecs = debug_trace_nrecs;
+	h->rec_offset = off;
+	h->nsections = DEBUG_SECTION_MAX;
+	h->pid = getpid();
+	h->tid = OS_gettid();
+	memcpy(h->progname, debug_trace_progname, sizeof(h->progname));
+	h->widx = 0;
+	for (i = 0; i < DEBUG_SECTION_MAX; i++) {
+		if (debug_level_strs[i] != NULL)
+			strncpy(h->section_names[i], debug_level_strs[i],
+			    DEBUG_TRACE_NAME_LEN - 1);
+	}
+
+	tr->hdr = h;
+	tr->recs = (struct debug_trace_rec *) ((char *) p + off);
+	tr->mask = debug_trace_nrecs - 1;
+	tr->maplen = maplen;
+	TAILQ_INSERT_TAIL(&debug_trace_rings, tr, t);
+	(void) pthread_mutex_unlock(&debug_trace_lock);
+
+	(void) pthread_setspecific(debug_trace_key, tr);
+	debug_trace_self = tr;
+	debug_trace_self_gen = gen;
+	return (tr);
+
+fail:
+	(void) pthread_mutex_unlock(&debug_trace_lock);
+	free(tr);
+	/* Don't retry the open() on every trace call */
+	debug_trace_failed_gen = gen;
+	return (NULL);
+}
+
+/*
+ * Enable binary tracing, with ring files created in the given
+ * directory.  nrecs is rounded up to a power of two.
+ *
+ * Sections are traced if their DEBUG_TYPE_TRACE mask is non-zero.
+ */
+int
+debug_trace_init(const char *dir, unsigned int nrecs)
+{
+	unsigned int n;
+
+	if (dir == NULL || nrecs == 0)
+		return (-1);
+
+	for (n = 1; n < nrecs && n < (1U << 24); n <<= 1)
+		;
+
+	(void) pthread_mutex_lock(&debug_trace_lock);
+	if (debug_trace_dir != NULL) {
+		(void) pthread_mutex_unlock(&debug_trace_lock);
+		return (-1);
+	}
+	debug_trace_dir = strdup(dir);
+	if (debug_trace_dir == NULL) {
+		(void) pthread_mutex_unlock(&debug_trace_lock);
+		return (-1);
+	}
+	debug_trace_nrecs = n;
+	(void) pthread_key_create(&debug_trace_key, debug_trace_thread_exit);
+	atomic_fetch_add(&debug_trace_gen, 1);
+	atomic_store(&debug_trace_enabled, 1);
+	(void) pthread_mutex_unlock(&debug_trace_lock);
+
+	return (0);
+}
+
+/*
+ * Unmap all of the trace rings.  The ring files are left behind.
+ *
+ * Nothing else may be tracing: DEBUG_TRACE() doesn't take a lock, so
+ * a thread between its gen check and its stores would write to a ring
+ * which has been unmapped under it.  Stop every thread which traces
+ * (or turn tracing off for their sections and let them get past any
+ * DEBUG_TRACE() in progress) before calling this or debug_shutdown().
+ */
+void
+debug_trace_shutdown(void)
+{
+	struct debug_trace_ring *tr;
+
+	(void) pthread_mutex_lock(&debug_trace_lock);
+	if (debug_trace_dir == NULL) {
+		(void) pthread_mutex_unlock(&debug_trace_lock);
+		return;
+	}
+	atomic_store(&debug_trace_enabled, 0);
+	atomic_fetch_add(&debug_trace_gen, 1);
+	(void) pthread_key_delete(debug_trace_key);
+	while ((tr = TAILQ_FIRST(&debug_trace_rings)) != NULL) {
+		TAILQ_REMOVE(&debug_trace_rings, tr, t);
+		debug_trace_ring_unmap(tr);
+	}
+	free(debug_trace_dir);
+	debug_trace_dir = NULL;
+	(void) pthread_mutex_unlock(&debug_trace_lock);
+}
+
+void
+debug_trace_set_progname(const char *progname)
+{
+	const char *p;
+
+	/* Only the basename goes into the ring file names */
+	p = strrchr(progname, '/');
+	p = (p != NULL) ? p + 1 : progname;
+
+	(void) pthread_mutex_lock(&debug_trace_lock);
+	strncpy(debug_trace_progname, p, sizeof(debug_trace_progname) - 1);
+	(void) pthread_mutex_unlock(&debug_trace_lock);
+}
+
+void
+debug_trace_get_progname(char *buf, size_t len)
+{
+
+	(void) pthread_mutex_lock(&debug_trace_lock);
+	snprintf(buf, len, "%s", debug_trace_progname);
+	(void) pthread_mutex_unlock(&debug_trace_lock);
+}
+
+/*
+ * Record a newly registered section name in every live ring so the
+ * decoder can name it.
+ */
+void
+debug_trace_section_name(debug_section_t s, const char *name)
+{
+	struct debug_trace_ring *tr;
+
+	if (s < 0 || s >= DEBUG_SECTION_MAX)
+		return;
+
+	(void) pthread_mutex_lock(&debug_trace_lock);
+	TAILQ_FOREACH(tr, &debug_trace_rings, t) {
+		bzero(tr->hdr->section_names[s], DEBUG_TRACE_NAME_LEN);
+		strncpy(tr->hdr->section_names[s], name,
+		    DEBUG_TRACE_NAME_LEN - 1);
+	}
+	(void) pthread_mutex_unlock(&debug_trace_lock);
+}
+
+/*
+ * Dump the most recent trace records from every ring; called from
+ * the crash handler, so this walks the ring list without locking and
+ * only uses async-signal-safe calls.
+ */
+void
+debug_trace_crash_dump(int fd, int max)
+{
+	struct debug_trace_ring *tr;
+	struct debug_trace_rec *r;
+	uint64_t i, w;
+	int a;
+
+	TAILQ_FOREACH(tr, &debug_trace_rings, t) {
+		w = __atomic_load_n(&tr->hdr->widx, __ATOMIC_ACQUIRE);
+		debug_crash_write_str(fd, "--- libdebug: trace records, tid ");
+		debug_crash_write_u64(fd, tr->hdr->tid, 10, 0);
+		debug_crash_write_str(fd, " ---\n");
+
+		i = (w > (uint64_t) max) ? w - max : 0;
+		if (w - i > tr->mask + 1)
+			i = w - (tr->mask + 1);
+		for (; i < w; i++) {
+			r = &tr->recs[i & tr->mask];
+			debug_crash_write_str(fd, "(");
+			debug_crash_write_u64(fd, r->ts / 1000000000ULL, 10, 0);
+			debug_crash_write_str(fd, ".");
+			debug_crash_write_u64(fd, r->ts % 1000000000ULL, 10, 9);
+			debug_crash_write_str(fd, ")| ");
+			if (r->section < DEBUG_SECTION_MAX &&
+			    tr->hdr->section_names[r->section][0] != '\0')
+				debug_crash_write(fd,
+				    tr->hdr->section_names[r->section],
+				    strnlen(tr->hdr->section_names[r->section],
+				    DEBUG_TRACE_NAME_LEN));
+			else
+				debug_crash_write_u64(fd, r->section, 10, 0);
+			debug_crash_write_str(fd, ": trace ");
+			debug_crash_write_u64(fd, r->id, 10, 0);
+			debug_crash_write_str(fd, ":");
+			for (a = 0; a < r->nargs && a < DEBUG_TRACE_MAX_ARGS;
+			    a++) {
+				debug_crash_write_str(fd, " 0x");
+				debug_crash_write_u64(fd, r->args[a], 16, 0);
+			}
+			debug_crash_write_str(fd, "\n");
+		}
+	}
+}
+
+/*
+ * Write a trace record.  Called via DEBUG_TRACE().
+ */
+void
+do_debug_trace(debug_section_t section, uint32_t id, int nargs,
+    const uint64_t *args)
+{
+	struct debug_trace_ring *tr;
+	struct debug_trace_rec *r;
+	struct timespec ts;
+	unsigned int gen;
+	uint64_t w;
+
+	gen = atomic_load_explicit(&debug_trace_gen, memory_order_relaxed);
+	tr = debug_trace_self;
+	if (tr == NULL || debug_trace_self_gen != gen) {
+		if (! atomic_load_explicit(&debug_trace_enabled,
+		    memory_order_relaxed) || debug_trace_failed_gen == gen)
+			return;
+		tr = debug_trace_ring_create(gen);
+		if (tr == NULL)
+			return;
+	}
+
+	if (nargs > DEBUG_TRACE_MAX_ARGS)
+		nargs = DEBUG_TRACE_MAX_ARGS;
+
+	(void) OS_clock_gettime(CLOCK_REALTIME, &ts);
+
+	w = tr->hdr->widx;
+	r = &tr->recs[w & tr->mask];
+	r->ts = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->section = section;
+	r->nargs = nargs;
+	r->id = id;
+	memcpy(r->args, args, sizeof(uint64_t) * nargs);
+
+	/*
+	 * The header is shared with the decoder so widx is a plain
+	 * integer rather than a C11 atomic.
+	 */
+	__atomic_store_n(&tr->hdr->widx, w + 1, __ATOMIC_RELEASE);
+}
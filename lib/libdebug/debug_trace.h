@@ -0,0 +1,154 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef	__DEBUG_TRACE_H__
+#define	__DEBUG_TRACE_H__
+
+/*
+ * On-disk format of the per-thread binary trace rings.
+ *
+ * Each thread which traces gets a memory mapped file made up of this
+ * header followed by nrecs fixed size records.  The file is written
+ * in place, so it's always a valid (if possibly torn at the very
+ * last record) snapshot of the most recent nrecs trace records.
+ *
+ * Everything is in host byte order; the decoder is expected to run
+ * on the same kind of machine.
+ */
+
+#define	DEBUG_TRACE_MAGIC		0x5442444c	/* "LDBT" */
+#define	DEBUG_TRACE_VERSION		1
+#define	DEBUG_TRACE_NAME_LEN		32
+#define	DEBUG_TRACE_MAX_ARGS		6
+
+struct debug_trace_rec {
+	uint64_t ts;			/* wall clock, nanoseconds */
+	uint16_t section;
+	uint16_t nargs;
+	uint32_t id;
+	uint64_t args[DEBUG_TRACE_MAX_ARGS];
+};
+
+struct debug_trace_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rec_size;		/* sizeof(struct debug_trace_rec) */
+	uint32_t nrecs;			/* power of two */
+	uint32_t rec_offset;		/* offset of the first record */
+	uint32_t nsections;
+	int64_t pid;
+	int64_t tid;
+	char progname[DEBUG_TRACE_NAME_LEN];
+
+	/*
+	 * Free running count of records written; the next record goes
+	 * into slot (widx & (nrecs - 1)).  This is only ever written by
+	 * the owning thread, with release semantics.
+	 */
+	uint64_t widx;
+
+	/* Section names, as registered with debug_register() */
+	char section_names[DEBUG_SECTION_MAX][DEBUG_TRACE_NAME_LEN];
+};
+
+/*
+ * On-disk format of the crash buffer.
+ *
+ * This is a memory mapped file holding the last nlines log lines,
+ * each truncated to line_size - 1 bytes and NUL terminated.  Since it's
+ * a shared file mapping the contents survive the process dying for
+ * any reason, including ones the crash handler can't catch.
+ */
+#define	DEBUG_CRASH_MAGIC		0x4342444c	/* "LDBC" */
+#define	DEBUG_CRASH_VERSION		1
+#define	DEBUG_CRASH_LINE_SIZE		256
+
+struct debug_crash_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t line_size;
+	uint32_t nlines;		/* power of two */
+	uint32_t line_offset;		/* offset of the first line */
+	uint32_t pad;
+	int64_t pid;
+
+	/* Free running count of lines written, as per debug_trace_hdr */
+	uint64_t widx;
+};
+
+/*
+ * Shared memory log region.
+ *
+ * Each process logging through the collector maps a file made up of
+ * this header followed by a byte ring of records.  Any thread in the
+ * process reserves space by advancing widx, fills in the record and
+ * then sets its commit word; libdebug-collectord reads committed
+ * records from ridx, zeroes the space and advances ridx past them.
+ *
+ * Records never wrap around the end of the ring; a producer which
+ * would wrap first commits a pad record (commit has DEBUG_SHM_PAD set)
+ * covering the rest of the ring.  Record lengths are multiples of
+ * DEBUG_SHM_ALIGN, including the header.
+ */
+#define	DEBUG_SHM_MAGIC			0x5342444c	/* "LDBS" */
+#define	DEBUG_SHM_VERSION		1
+#define	DEBUG_SHM_ALIGN			8
+#define	DEBUG_SHM_PAD			0x80000000U
+
+struct debug_shm_rec {
+	uint32_t commit;		/* record length once written, or 0 */
+	uint16_t types;			/* (1 << debug_type_t) to write to */
+	uint16_t section;
+	uint32_t msglen;
+	uint32_t pad;
+	uint64_t ts;			/* wall clock, nanoseconds */
+	uint64_t mask;
+	char msg[];
+};
+
+struct debug_shm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;			/* bytes of ring, power of two */
+	uint32_t data_offset;		/* offset of the ring */
+	int64_t pid;
+	char progname[DEBUG_TRACE_NAME_LEN];
+	uint32_t closed;		/* set once the process is done */
+	uint32_t pad;
+	uint64_t drops;			/* records which didn't fit */
+
+	/*
+	 * Free running byte counts; widx is advanced by the producers
+	 * (with compare-and-swap) and ridx by the collector, on their
+	 * own cache lines.
+	 */
+	uint64_t widx __attribute__((aligned(64)));
+	uint64_t ridx __attribute__((aligned(64)));
+};
+
+#endif	/* __DEBUG_TRACE_H__ */
@@ -0,0 +1,495 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Asynchronous log file writes using io_uring.
+ *
+ * The logger thread copies each write into one of a small set of
+ * buffers and submits it; the buffer is reclaimed when the write
+ * completes.  The logger only blocks on the disk if every buffer is
+ * still in flight, so a slow disk no longer stalls the drain loop
+ * (and so the producers) for every batch.
+ *
+ * Buffers are queued in order and submitted as a linked chain, so they
+ * hit the file in order; see debug_uring_kick().  This talks to the
+ * kernel directly rather than needing liburing; on kernels without
+ * io_uring (or without IORING_OP_WRITE) debug_uring_init() fails and
+ * the caller keeps using writev().  If writes start failing with
+ * -EINVAL anyway the queued buffers are written with write() and
+ * debug_uring_failed() tells the caller to switch back.
+ *
+ * All of this is called with debug_file_lock held.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#ifdef	DEBUG_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "debug.h"
+#include "debug_internal.h"
+
+#ifdef	DEBUG_HAVE_IO_URING
+
+static int
+debug_uring_enter(struct debug_uring *u, unsigned int nsubmit,
+    unsigned int nwait)
+{
+	int r;
+
+	do {
+		r = syscall(__NR_io_uring_enter, u->ring_fd, nsubmit, nwait,
+		    nwait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (r < 0 && errno == EINTR);
+	return (r);
+}
+
+/*
+ * Check the kernel can do IORING_OP_WRITE (5.6 and later); on older
+ * kernels the ring sets up fine but every write fails with -EINVAL.
+ * IORING_REGISTER_PROBE arrived in the same release.
+ */
+static int
+debug_uring_probe(struct debug_uring *u)
+{
+	struct io_uring_probe *p;
+	size_t len;
+	int ok = 0;
+
+	len = sizeof(*p) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	p = calloc(1, len);
+	if (p == NULL)
+		return (0);
+	if (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_PROBE,
+	    p, IORING_OP_LAST) >= 0 && p->last_op >= IORING_OP_WRITE &&
+	    (p->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) != 0)
+		ok = 1;
+	free(p);
+	return (ok);
+}
+
+int
+debug_uring_init(struct debug_uring *u)
+{
+	struct io_uring_params p;
+
+	bzero(u, sizeof(*u));
+	u->cur = -1;
+	bzero(&p, sizeof(p));
+	u->ring_fd = syscall(__NR_io_uring_setup, DEBUG_URING_NBUFS, &p);
+	if (u->ring_fd < 0)
+		return (-1);
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size)
+			u->sq_size = u->cq_size;
+		u->cq_size = 0;
+	}
+	u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto fail;
+	if (u->cq_size == 0) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	u->sq_head = (unsigned int *) ((char *) u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned int *) ((char *) u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned int *) ((char *) u->sq_ring +
+	    p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *) ((char *) u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned int *) ((char *) u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *) ((char *) u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int *) ((char *) u->cq_ring +
+	    p.cq_off.ring_mask);
+	u->cqes = (char *) u->cq_ring + p.cq_off.cqes;
+	if (! debug_uring_probe(u))
+		goto fail;
+	return (0);
+
+fail:
+	debug_uring_free(u);
+	return (-1);
+}
+
+static void
+debug_uring_error(struct debug_uring *u)
+{
+
+	if (u->nerrors != NULL)
+		__atomic_add_fetch(u->nerrors, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write the rest of a buffer with write().  Only called with nothing
+ * in flight, so it can't land ahead of earlier buffers.
+ */
+static void
+debug_uring_write_sync(struct debug_uring *u, struct debug_uring_buf *b)
+{
+	ssize_t r;
+
+	while (b->off < b->len) {
+		r = write(b->fd, b->buf + b->off, b->len - b->off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			debug_uring_error(u);
+			break;
+		}
+		b->off += r;
+	}
+	b->off = b->len;
+}
+
+/*
+ * Free the buffers which have been completely written (or given up
+ * on), keeping the rest in order.
+ */
+static void
+debug_uring_retire(struct debug_uring *u)
+{
+	struct debug_uring_buf *b;
+	int i, n = 0;
+
+	for (i = 0; i < u->nqueued; i++) {
+		b = &u->bufs[u->queue[i]];
+		if (b->off < b->len) {
+			u->queue[n++] = u->queue[i];
+			continue;
+		}
+		b->busy = 0;
+		b->len = b->off = 0;
+	}
+	u->nqueued = n;
+}
+
+/*
+ * If nothing is in flight, submit the rest of every queued buffer as
+ * one linked chain, oldest first.  The file is opened O_APPEND, so the
+ * offset is ignored; the link is what keeps the writes in order, and
+ * a short write cancels the rest of the chain so nothing can land
+ * after a partly written buffer.  Buffers queued while a chain is in
+ * flight wait for the next one.
+ */
+static void
+debug_uring_kick(struct debug_uring *u)
+{
+	struct debug_uring_buf *b;
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx, n;
+	int i;
+
+	if (u->inflight != 0 || u->nqueued == 0)
+		return;
+
+	if (! u->failed) {
+		tail = *u->sq_tail;
+		for (i = 0; i < u->nqueued; i++) {
+			b = &u->bufs[u->queue[i]];
+			idx = (tail + i) & *u->sq_mask;
+			sqe = &((struct io_uring_sqe *) u->sqes)[idx];
+			bzero(sqe, sizeof(*sqe));
+			sqe->opcode = IORING_OP_WRITE;
+			if (i < u->nqueued - 1)
+				sqe->flags = IOSQE_IO_LINK;
+			sqe->fd = b->fd;
+			sqe->addr = (uint64_t) (uintptr_t) (b->buf + b->off);
+			sqe->len = b->len - b->off;
+			sqe->off = 0;
+			sqe->user_data = u->queue[i];
+			u->sq_array[idx] = idx;
+		}
+		__atomic_store_n(u->sq_tail, tail + u->nqueued,
+		    __ATOMIC_RELEASE);
+		(void) debug_uring_enter(u, u->nqueued, 0);
+
+		/*
+		 * Take back anything the kernel didn't consume; it's
+		 * resubmitted once what was taken has completed.
+		 */
+		n = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) - tail;
+		__atomic_store_n(u->sq_tail, tail + n, __ATOMIC_RELEASE);
+		u->inflight = n;
+		if (n != 0)
+			return;
+	}
+
+	/* The ring is unusable or refused the lot; write them here */
+	for (i = 0; i < u->nqueued; i++)
+		debug_uring_write_sync(u, &u->bufs[u->queue[i]]);
+	debug_uring_retire(u);
+}
+
+static void
+debug_uring_queue(struct debug_uring *u, int i)
+{
+
+	u->queue[u->nqueued++] = i;
+	debug_uring_kick(u);
+}
+
+/*
+ * Account for completed writes.  Once the whole chain is done the
+ * finished buffers are freed and the rest of any short, interrupted
+ * or cancelled ones are resubmitted, in order, with anything queued
+ * since.
+ */
+static void
+debug_uring_reap(struct debug_uring *u)
+{
+	struct io_uring_cqe *cqe;
+	struct debug_uring_buf *b;
+	unsigned int head;
+	int res;
+
+	head = *u->cq_head;
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &((struct io_uring_cqe *) u->cqes)[head & *u->cq_mask];
+		b = &u->bufs[cqe->user_data];
+		res = cqe->res;
+		head++;
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		u->inflight--;
+
+		if (res > 0) {
+			b->off += res;
+		} else if (res == -EINVAL || res == -EOPNOTSUPP) {
+			/* No usable IORING_OP_WRITE; go synchronous */
+			u->failed = 1;
+		} else if (res != -EINTR && res != -EAGAIN &&
+		    res != -ECANCELED) {
+			/* The rest of the buffer is lost, as with writev() */
+			debug_uring_error(u);
+			b->off = b->len;
+		}
+	}
+	if (u->inflight == 0) {
+		debug_uring_retire(u);
+		debug_uring_kick(u);
+	}
+}
+
+/*
+ * Find a free buffer, waiting for a write to finish if need be.
+ */
+static int
+debug_uring_get_buf(struct debug_uring *u)
+{
+	int i;
+
+	debug_uring_reap(u);
+	while (1) {
+		for (i = 0; i < DEBUG_URING_NBUFS; i++) {
+			if (u->bufs[i].busy)
+				continue;
+			if (u->bufs[i].buf == NULL) {
+				u->bufs[i].buf = malloc(DEBUG_URING_BUF_SIZE);
+				if (u->bufs[i].buf == NULL)
+					continue;
+			}
+			return (i);
+		}
+		if (u->inflight == 0)
+			return (-1);
+		(void) debug_uring_enter(u, 0, 1);
+		debug_uring_reap(u);
+	}
+}
+
+/*
+ * Copy buf into the current write buffer, submitting buffers as
+ * they fill up.  Returns the number of bytes taken.
+ */
+size_t
+debug_uring_write(struct debug_uring *u, int fd, const char *buf,
+    size_t len)
+{
+	struct debug_uring_buf *b;
+	size_t n, done = 0;
+
+	while (done < len) {
+		if (u->cur < 0) {
+			u->cur = debug_uring_get_buf(u);
+			if (u->cur < 0)
+				break;
+			u->bufs[u->cur].fd = fd;
+		}
+		b = &u->bufs[u->cur];
+		n = DEBUG_URING_BUF_SIZE - b->len;
+		if (n > len - done)
+			n = len - done;
+		memcpy(b->buf + b->len, buf + done, n);
+		b->len += n;
+		done += n;
+		if (b->len == DEBUG_URING_BUF_SIZE) {
+			b->busy = 1;
+			debug_uring_queue(u, u->cur);
+			u->cur = -1;
+		}
+	}
+	return (done);
+}
+
+/*
+ * Submit whatever has been written since the last call.
+ */
+void
+debug_uring_submit(struct debug_uring *u)
+{
+
+	if (u->cur >= 0 && u->bufs[u->cur].len != 0) {
+		u->bufs[u->cur].busy = 1;
+		debug_uring_queue(u, u->cur);
+		u->cur = -1;
+	}
+	debug_uring_reap(u);
+}
+
+/*
+ * Whether writes have failed in a way that says the kernel can't do
+ * them; the caller should go back to writev().
+ */
+int
+debug_uring_failed(struct debug_uring *u)
+{
+
+	return (u->failed);
+}
+
+/*
+ * Submit everything and wait for it to be written.
+ */
+void
+debug_uring_wait(struct debug_uring *u)
+{
+
+	debug_uring_submit(u);
+	while (u->inflight > 0) {
+		if (debug_uring_enter(u, 0, 1) < 0)
+			break;
+		debug_uring_reap(u);
+	}
+}
+
+void
+debug_uring_free(struct debug_uring *u)
+{
+	int i;
+
+	if (u->cq_head != NULL)
+		debug_uring_wait(u);
+	if (u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_size != 0 && u->cq_ring != NULL && u->cq_ring != MAP_FAILED)
+		munmap(u->cq_ring, u->cq_size);
+	if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_size);
+	if (u->ring_fd >= 0)
+		close(u->ring_fd);
+	for (i = 0; i < DEBUG_URING_NBUFS; i++)
+		free(u->bufs[i].buf);
+	bzero(u, sizeof(*u));
+	u->ring_fd = -1;
+	u->cur = -1;
+}
+
+#else	/* !DEBUG_HAVE_IO_URING */
+
+int
+debug_uring_init(struct debug_uring *u)
+{
+
+	bzero(u, sizeof(*u));
+	u->ring_fd = -1;
+	u->cur = -1;
+	return (-1);
+}
+
+size_t
+debug_uring_write(struct debug_uring *u, int fd, const char *buf,
+    size_t len)
+{
+
+	return (0);
+}
+
+void
+debug_uring_submit(struct debug_uring *u)
+{
+
+}
+
+void
+debug_uring_wait(struct debug_uring *u)
+{
+
+}
+
+int
+debug_uring_failed(struct debug_uring *u)
+{
+
+	return (0);
+}
+
+void
+debug_uring_free(struct debug_uring *u)
+{
+
+}
+
+#endif	/* DEBUG_HAVE_IO_URING */
@@ -0,0 +1,387 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Registered sinks.
+ *
+ * Each registered sink gets its own worker thread, so a slow one (a
+ * syslog daemon that's backed up, a network forwarder) doesn't hold
+ * up the logger thread or the other sinks.
+ *
+ * The logger thread collects the lines any worker wants while it
+ * writes out a batch, then publishes them as a single immutable
+ * debug_batch.  The workers each walk the shared batch list with
+ * their own cursor; see struct debug_batch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#include "os/time.h"
+
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#include "debug.h"
+#include "debug_internal.h"
+
+void
+debug_worker_init(struct debug_instance *ds)
+{
+
+	pthread_mutex_init(&ds->worker_lock, NULL);
+	pthread_cond_init(&ds->worker_cond, NULL);
+	ds->syslog_worker = -1;
+}
+
+static int
+debug_worker_wants(const struct debug_sink_worker *w,
+    const struct debug_line *l)
+{
+
+	if (w->type == DEBUG_TYPE_SYSLOG && ! w->ds->debug_syslog_enable)
+		return (0);
+	if (w->type >= 0)
+		return ((w->ds->levels[w->type][l->section] & l->mask) != 0);
+	return ((w->mask & l->mask) != 0);
+}
+
+/*
+ * Free the batches at the head of the list which every worker has
+ * finished with.
+ */
+static void
+debug_worker_reap_locked(struct debug_instance *ds)
+{
+	struct debug_batch *b;
+
+	while ((b = ds->batch_head) != NULL && b->sinks == 0) {
+		ds->batch_head = b->next;
+		free(b);
+	}
+	if (ds->batch_head == NULL)
+		ds->batch_tail = NULL;
+}
+
+static void *
+debug_worker_run(void *arg)
+{
+	struct debug_sink_worker *w = arg;
+	struct debug_instance *ds = w->ds;
+	struct debug_batch *b, *next;
+	uint32_t bit = 1U << w->id;
+	uint64_t t0, t1;
+	int i, j;
+
+	pthread_mutex_lock(&ds->worker_lock);
+	while (1) {
+		while (w->cursor == NULL && ! w->exiting)
+			pthread_cond_wait(&ds->worker_cond, &ds->worker_lock);
+		b = w->cursor;
+		if (b == NULL)
+			break;
+		pthread_mutex_unlock(&ds->worker_lock);
+
+		/* Hand over each run of lines which pass the filter */
+		t0 = OS_clock_gettime_ns(OS_CLOCK_MONOTONIC);
+		for (i = 0; i < b->nlines; i = j) {
+			while (i < b->nlines &&
+			    ! debug_worker_wants(w, &b->lines[i]))
+				i++;
+			for (j = i; j < b->nlines &&
+			    debug_worker_wants(w, &b->lines[j]); j++)
+				;
+			if (j > i)
+				w->ops.write(w->arg, &b->lines[i], j - i);
+		}
+		t1 = OS_clock_gettime_ns(OS_CLOCK_MONOTONIC);
+
+		pthread_mutex_lock(&ds->worker_lock);
+		ds->stat_sink_write_ns[debug_stats_bucket(t1 - t0)]++;
+		for (next = b->next; next != NULL && (next->sinks & bit) == 0;
+		    next = next->next)
+			;
+		w->cursor = next;
+		w->lag -= b->size;
+		b->sinks &= ~bit;
+		debug_worker_reap_locked(ds);
+	}
+	pthread_mutex_unlock(&ds->worker_lock);
+	return (NULL);
+}
+
+static void
+debug_worker_mask_update_locked(struct debug_instance *ds)
+{
+	debug_mask_t m = 0;
+	int i;
+
+	for (i = 0; i < DEBUG_SINK_MAX; i++) {
+		if (ds->workers[i] != NULL && ds->workers[i]->type < 0)
+			m |= ds->workers[i]->mask;
+	}
+	ds->worker_mask = m;
+}
+
+/*
+ * Start a worker for a sink.  type is the level table to filter on
+ * (DEBUG_TYPE_SYSLOG for the syslog sink), or -1 to use mask for
+ * every section.  Returns the sink id, or -1.
+ */
+int
+debug_worker_register(struct debug_instance *ds,
+    const struct debug_sink_ops *ops, void *arg, debug_mask_t mask, int type)
+{
+	struct debug_sink_worker *w;
+	int id;
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return (-1);
+	w->ds = ds;
+	w->ops = *ops;
+	w->arg = arg;
+	w->mask = mask;
+	w->type = type;
+
+	pthread_mutex_lock(&ds->worker_lock);
+	for (id = 0; id < DEBUG_SINK_MAX; id++) {
+		if (ds->workers[id] == NULL)
+			break;
+	}
+	w->id = id;
+	if (id == DEBUG_SINK_MAX ||
+	    pthread_create(&w->thread, NULL, debug_worker_run, w) != 0) {
+		pthread_mutex_unlock(&ds->worker_lock);
+		free(w);
+		return (-1);
+	}
+	ds->workers[id] = w;
+	debug_worker_mask_update_locked(ds);
+	pthread_mutex_unlock(&ds->worker_lock);
+	return (id);
+}
+
+void
+debug_worker_set_mask(struct debug_instance *ds, int id, debug_mask_t mask)
+{
+
+	if (id < 0 || id >= DEBUG_SINK_MAX)
+		return;
+	pthread_mutex_lock(&ds->worker_lock);
+	if (ds->workers[id] != NULL) {
+		ds->workers[id]->mask = mask;
+		debug_worker_mask_update_locked(ds);
+	}
+	pthread_mutex_unlock(&ds->worker_lock);
+}
+
+/*
+ * Stop a worker once it has written everything published to it,
+ * then close the sink.
+ */
+void
+debug_worker_unregister(struct debug_instance *ds, int id)
+{
+	struct debug_sink_worker *w;
+
+	if (id < 0 || id >= DEBUG_SINK_MAX)
+		return;
+	pthread_mutex_lock(&ds->worker_lock);
+	w = ds->workers[id];
+	if (w == NULL || w->exiting) {
+		pthread_mutex_unlock(&ds->worker_lock);
+		return;
+	}
+	w->exiting = 1;
+	pthread_cond_broadcast(&ds->worker_cond);
+	pthread_mutex_unlock(&ds->worker_lock);
+
+	pthread_join(w->thread, NULL);
+
+	pthread_mutex_lock(&ds->worker_lock);
+	ds->workers[id] = NULL;
+	debug_worker_mask_update_locked(ds);
+	pthread_mutex_unlock(&ds->worker_lock);
+
+	if (w->ops.close != NULL)
+		w->ops.close(w->arg);
+	free(w);
+}
+
+/*
+ * Note a line for the next batch if any worker might want it.  The
+ * pointers must stay valid until debug_worker_publish().
+ *
+ * This must be called with the file_lock held.
+ */
+void
+debug_worker_add(struct debug_instance *ds, const struct debug_entry *de,
+    const char *pfx, const char *msg)
+{
+	struct debug_line *l;
+	int n;
+
+	if ((ds->worker_mask & de->debug_mask) == 0 &&
+	    (ds->syslog_worker < 0 || ! ds->debug_syslog_enable ||
+	    (ds->levels[DEBUG_TYPE_SYSLOG][de->debug_section] &
+	    de->debug_mask) == 0))
+		return;
+
+	if (ds->nsink_lines == ds->sink_lines_size) {
+		n = ds->sink_lines_size ? ds->sink_lines_size * 2 :
+		    DEBUG_SINK_LINES_INIT_SIZE;
+		l = realloc(ds->sink_lines, n * sizeof(*l));
+		if (l == NULL)
+			return;
+		ds->sink_lines = l;
+		ds->sink_lines_size = n;
+	}
+	l = &ds->sink_lines[ds->nsink_lines++];
+	l->ts = de->ts;
+	l->section = de->debug_section;
+	l->mask = de->debug_mask;
+	l->prefix = pfx;
+	l->prefix_len = de->pfx_len;
+	l->msg = msg;
+	l->len = de->len;
+	ds->sink_bytes += de->pfx_len + de->len;
+}
+
+/*
+ * Copy the noted lines into a batch and hand it to the workers.
+ *
+ * This must be called with the file_lock held.
+ */
+void
+debug_worker_publish(struct debug_instance *ds)
+{
+	struct debug_sink_worker *w;
+	struct debug_batch *b;
+	struct debug_line *l;
+	size_t size;
+	char *p;
+	int i, id;
+
+	if (ds->nsink_lines == 0)
+		return;
+	size = sizeof(*b) + ds->nsink_lines * sizeof(struct debug_line) +
+	    ds->sink_bytes;
+	b = malloc(size);
+	if (b == NULL)
+		goto done;
+
+	b->next = NULL;
+	b->sinks = 0;
+	b->size = size;
+	b->nlines = ds->nsink_lines;
+	p = (char *) &b->lines[b->nlines];
+	for (i = 0; i < b->nlines; i++) {
+		l = &b->lines[i];
+		*l = ds->sink_lines[i];
+		memcpy(p, l->prefix, l->prefix_len);
+		l->prefix = p;
+		p += l->prefix_len;
+		memcpy(p, l->msg, l->len);
+		l->msg = p;
+		p += l->len;
+	}
+
+	pthread_mutex_lock(&ds->worker_lock);
+	for (id = 0; id < DEBUG_SINK_MAX; id++) {
+		w = ds->workers[id];
+		if (w == NULL || w->exiting)
+			continue;
+		for (i = 0; i < b->nlines; i++) {
+			if (debug_worker_wants(w, &b->lines[i]))
+				break;
+		}
+		if (i == b->nlines)
+			continue;
+		/* Too far behind; skip this one rather than queue it */
+		if (w->lag + size > DEBUG_SINK_LAG_MAX) {
+			w->drops += b->nlines;
+			ds->stat_sink_dropped += b->nlines;
+			continue;
+		}
+		b->sinks |= 1U << id;
+		w->lag += size;
+		if (w->cursor == NULL)
+			w->cursor = b;
+	}
+	if (b->sinks == 0) {
+		pthread_mutex_unlock(&ds->worker_lock);
+		free(b);
+		goto done;
+	}
+	if (ds->batch_tail != NULL)
+		ds->batch_tail->next = b;
+	else
+		ds->batch_head = b;
+	ds->batch_tail = b;
+	pthread_cond_broadcast(&ds->worker_cond);
+	pthread_mutex_unlock(&ds->worker_lock);
+
+done:
+	ds->nsink_lines = 0;
+	ds->sink_bytes = 0;
+}
+
+/*
+ * Let every worker finish what's been published and stop them.
+ */
+void
+debug_worker_shutdown(struct debug_instance *ds)
+{
+	struct debug_batch *b;
+	int id;
+
+	for (id = 0; id < DEBUG_SINK_MAX; id++)
+		debug_worker_unregister(ds, id);
+
+	while ((b = ds->batch_head) != NULL) {
+		ds->batch_head = b->next;
+		free(b);
+	}
+	ds->batch_tail = NULL;
+	ds->syslog_worker = -1;
+	free(ds->sink_lines);
+	ds->sink_lines = NULL;
+	ds->nsink_lines = ds->sink_lines_size = 0;
+	ds->sink_bytes = 0;
+	pthread_cond_destroy(&ds->worker_cond);
+	pthread_mutex_destroy(&ds->worker_lock);
+}
@@ -0,0 +1,52 @@
+#ifndef	__OS_THREAD_H__
+#define	__OS_THREAD_H__
+
+/*
+ * Return a numeric id for the calling thread, for use in file names
+ * and log output.
+ */
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+
+static inline long
+OS_gettid(void)
+{
+
+	return (syscall(SYS_gettid));
+}
+#elif defined(__APPLE__)
+#include <stdint.h>
+#include <pthread.h>
+
+static inline long
+OS_gettid(void)
+{
+	uint64_t tid;
+
+	(void) pthread_threadid_np(NULL, &tid);
+	return ((long) tid);
+}
+#elif defined(__FreeBSD__)
+#include <pthread.h>
+#include <pthread_np.h>
+
+static inline long
+OS_gettid(void)
+{
+
+	return (pthread_getthreadid_np());
+}
+#else
+#include <stdint.h>
+#include <pthread.h>
+
+static inline long
+OS_gettid(void)
+{
+
+	return ((long) (uintptr_t) pthread_self());
+}
+#endif
+
+#endif	/* __OS_THREAD_H__ */
@@ -1,6 +1,8 @@
 #ifndef	__OS_TIME_H__
 #define	__OS_TIME_H__
 
+#include <stdint.h>
+
 /*
  * Since this library may end up being included by other things that
  * implement their own POSIX shims, let's avoid namespace clashes.
@@ -13,9 +15,66 @@
 #include "os/apple/time.h"
 #else
 #include <sys/time.h>
+#include <time.h>
 
 #define	OS_clock_gettime	clock_gettime
 
 #endif
 
+/*
+ * Clock ids for the timestamp sources; the coarse clock falls back
+ * to the normal realtime clock where there isn't one.
+ */
+#define	OS_CLOCK_REALTIME	CLOCK_REALTIME
+#define	OS_CLOCK_MONOTONIC	CLOCK_MONOTONIC
+#if defined(CLOCK_REALTIME_COARSE)
+#define	OS_CLOCK_REALTIME_COARSE	CLOCK_REALTIME_COARSE
+#elif defined(CLOCK_REALTIME_FAST)
+#define	OS_CLOCK_REALTIME_COARSE	CLOCK_REALTIME_FAST
+#else
+#define	OS_CLOCK_REALTIME_COARSE	CLOCK_REALTIME
+#endif
+
+static inline uint64_t
+OS_clock_gettime_ns(int clk_id)
+{
+	struct timespec ts;
+
+	(void) OS_clock_gettime(clk_id, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Raw cycle counter.  OS_HAVE_TSC is defined if there is one; it
+ * needs calibrating against the wall clock before use.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define	OS_HAVE_TSC	1
+
+static inline uint64_t
+OS_tsc_read(void)
+{
+
+	return (__builtin_ia32_rdtsc());
+}
+#elif defined(__aarch64__)
+#define	OS_HAVE_TSC	1
+
+static inline uint64_t
+OS_tsc_read(void)
+{
+	uint64_t v;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (v));
+	return (v);
+}
+#else
+static inline uint64_t
+OS_tsc_read(void)
+{
+
+	return (0);
+}
+#endif
+
 #endif
@@ -0,0 +1,400 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * libdebug benchmarks.
+ *
+ * Measures the cost of a disabled DEBUG() call, the latency of an
+ * enabled one, sustained throughput to the log file with 1 to N
+ * producer threads and the drop rate at various queue limits, and
+ * prints the results as JSON on stdout.
+ *
+ * Each run gets a fresh debug_init()/debug_shutdown(), and what made
+ * it out is counted by reading the log file back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+
+#include <pthread.h>
+
+#include "os/time.h"
+
+#include "debug.h"
+
+#define	BENCH_MARK		"bench line "
+#define	BENCH_REPS		5
+
+struct bench_run {
+	int nthreads;
+	uint64_t nlines;		/* per thread */
+	pthread_barrier_t start;
+};
+
+static char logpath[] = "/tmp/debug_bench.XXXXXX";
+static debug_section_t bench_sec;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: debug_bench [-n lines] [-t threads]\n");
+	fprintf(stderr, "  -n  lines logged per thread per run "
+	    "(default 200000)\n");
+	fprintf(stderr, "  -t  maximum producer threads (default 4)\n");
+	exit(1);
+}
+
+static inline uint64_t
+bench_now_ns(void)
+{
+
+	return (OS_clock_gettime_ns(OS_CLOCK_MONOTONIC));
+}
+
+/*
+ * Cycle counter if there is one, else nanoseconds.
+ */
+static inline uint64_t
+bench_cycles(void)
+{
+
+#ifdef	OS_HAVE_TSC
+	return (OS_tsc_read());
+#else
+	return (bench_now_ns());
+#endif
+}
+
+/*
+ * Start a run logging section bench_sec at DEBUG_LVL_INFO to a fresh
+ * log file and nowhere else.
+ */
+static void
+bench_start(void)
+{
+
+	debug_init("debug_bench");
+	debug_syslog_disable();
+	bench_sec = debug_register("bench");
+	debug_setmask_str("bench", DEBUG_TYPE_PRINT, 0);
+	debug_setmask_str("bench", DEBUG_TYPE_LOG, DEBUG_LVL_INFO);
+	debug_set_filename(logpath);
+	debug_file_open();
+}
+
+/*
+ * Return the number of benchmark lines written out by a run which
+ * has been shut down, and remove the log file.
+ */
+static uint64_t
+bench_count(void)
+{
+	char *line = NULL;
+	size_t sz = 0;
+	uint64_t n = 0;
+	FILE *fp;
+
+	fp = fopen(logpath, "r");
+	if (fp == NULL)
+		err(1, "%s", logpath);
+	while (getline(&line, &sz, fp) > 0) {
+		if (strstr(line, BENCH_MARK) != NULL)
+			n++;
+	}
+	free(line);
+	fclose(fp);
+	(void) unlink(logpath);
+	return (n);
+}
+
+/*
+ * Finish a run and return the number of benchmark lines which were
+ * written out.
+ */
+static uint64_t
+bench_finish(void)
+{
+
+	debug_shutdown();
+	return (bench_count());
+}
+
+/*
+ * Cost of a DEBUG() call for a section/level which isn't enabled,
+ * less the cost of the loop itself.  The compiler barrier stops the
+ * mask test being hoisted out of the loop.  Each loop is timed
+ * BENCH_REPS times and the fastest run of each is used, which keeps
+ * an interrupted run from skewing the difference; a difference lost
+ * in the noise comes out as 0.
+ */
+static void
+bench_disabled(uint64_t n)
+{
+	uint64_t c0, c1, c2, t0, t1, i, cs, ce, base, dbg;
+	double cycles;
+	int r;
+
+	bench_start();
+	debug_setmask_str("bench", DEBUG_TYPE_LOG, 0);
+
+	base = dbg = UINT64_MAX;
+	t0 = bench_now_ns();
+	cs = bench_cycles();
+	for (r = 0; r < BENCH_REPS; r++) {
+		c0 = bench_cycles();
+		for (i = 0; i < n; i++) {
+			__asm__ __volatile__("" ::: "memory");
+		}
+		c1 = bench_cycles();
+		for (i = 0; i < n; i++) {
+			__asm__ __volatile__("" ::: "memory");
+			DEBUG(bench_sec, DEBUG_LVL_INFO, BENCH_MARK "%llu\n",
+			    (unsigned long long) i);
+		}
+		c2 = bench_cycles();
+		if (c1 - c0 < base)
+			base = c1 - c0;
+		if (c2 - c1 < dbg)
+			dbg = c2 - c1;
+	}
+	ce = bench_cycles();
+	t1 = bench_now_ns();
+	(void) bench_finish();
+
+	cycles = ((double) dbg - (double) base) / n;
+	if (cycles < 0)
+		cycles = 0;
+	printf("  \"disabled\": {\n");
+	printf("    \"calls\": %llu,\n", (unsigned long long) n);
+	printf("    \"cycles_per_call\": %.3f,\n", cycles);
+	printf("    \"ns_per_call\": %.3f\n",
+	    ce != cs ? cycles * (double) (t1 - t0) / (ce - cs) : 0.0);
+	printf("  },\n");
+}
+
+static int
+bench_u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x < y ? -1 : (x > y));
+}
+
+/*
+ * Latency of an enabled DEBUG() call, from a single thread with a
+ * queue big enough that nothing is dropped.
+ */
+static void
+bench_latency(uint64_t n)
+{
+	uint64_t *s, c0, c1, t0, t1, i;
+	double ns_per_cycle;
+
+	s = calloc(n, sizeof(*s));
+	if (s == NULL)
+		err(1, "calloc");
+
+	bench_start();
+	debug_set_queue_limit(1 << 20, 64 * 1024 * 1024);
+	debug_set_overflow_policy(DEBUG_OVERFLOW_BLOCK, 1000);
+
+	t0 = bench_now_ns();
+	c0 = bench_cycles();
+	for (i = 0; i < n; i++) {
+		c1 = bench_cycles();
+		DEBUG(bench_sec, DEBUG_LVL_INFO, BENCH_MARK "%llu\n",
+		    (unsigned long long) i);
+		s[i] = bench_cycles() - c1;
+	}
+	c1 = bench_cycles();
+	t1 = bench_now_ns();
+	(void) bench_finish();
+
+	ns_per_cycle = c1 != c0 ? (double) (t1 - t0) / (c1 - c0) : 1.0;
+	qsort(s, n, sizeof(*s), bench_u64_cmp);
+
+#define	PCT(p)	((double) s[(uint64_t) ((n - 1) * (p))] * ns_per_cycle)
+	printf("  \"enqueue_latency_ns\": {\n");
+	printf("    \"samples\": %llu,\n", (unsigned long long) n);
+	printf("    \"p50\": %.1f,\n", PCT(0.50));
+	printf("    \"p99\": %.1f,\n", PCT(0.99));
+	printf("    \"p99_9\": %.1f,\n", PCT(0.999));
+	printf("    \"max\": %.1f\n", PCT(1.0));
+	printf("  },\n");
+#undef	PCT
+
+	free(s);
+}
+
+static void *
+bench_producer(void *arg)
+{
+	struct bench_run *br = arg;
+	uint64_t i;
+
+	pthread_barrier_wait(&br->start);
+	for (i = 0; i < br->nlines; i++)
+		DEBUG(bench_sec, DEBUG_LVL_INFO, BENCH_MARK "%llu\n",
+		    (unsigned long long) i);
+	return (NULL);
+}
+
+/*
+ * Run nthreads producers logging nlines each; returns the lines
+ * written, and the time taken including writing them all out (but
+ * not counting them afterwards.)
+ */
+static uint64_t
+bench_producers(int nthreads, uint64_t nlines, uint64_t *elapsed)
+{
+	struct bench_run br;
+	pthread_t *t;
+	uint64_t t0, written;
+	int i;
+
+	t = calloc(nthreads, sizeof(*t));
+	if (t == NULL)
+		err(1, "calloc");
+	br.nthreads = nthreads;
+	br.nlines = nlines;
+	pthread_barrier_init(&br.start, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&t[i], NULL, bench_producer, &br) != 0)
+			err(1, "pthread_create");
+	}
+
+	pthread_barrier_wait(&br.start);
+	t0 = bench_now_ns();
+	for (i = 0; i < nthreads; i++)
+		pthread_join(t[i], NULL);
+	debug_shutdown();
+	*elapsed = bench_now_ns() - t0;
+	written = bench_count();
+
+	pthread_barrier_destroy(&br.start);
+	free(t);
+	return (written);
+}
+
+/*
+ * Sustained throughput to the log file.  The producers block when
+ * their queues fill, so this is how fast the logger keeps up.
+ */
+static void
+bench_throughput(int maxthreads, uint64_t nlines)
+{
+	uint64_t written, elapsed;
+	int n;
+
+	printf("  \"throughput\": [\n");
+	for (n = 1; n <= maxthreads; n = (n * 2 > maxthreads && n != maxthreads) ?
+	    maxthreads : n * 2) {
+		bench_start();
+		debug_set_overflow_policy(DEBUG_OVERFLOW_BLOCK, 1000);
+		written = bench_producers(n, nlines, &elapsed);
+		printf("    { \"threads\": %d, \"lines\": %llu, "
+		    "\"seconds\": %.6f, \"lines_per_sec\": %.0f, "
+		    "\"dropped\": %llu }%s\n",
+		    n, (unsigned long long) written,
+		    (double) elapsed / 1e9,
+		    (double) written * 1e9 / elapsed,
+		    (unsigned long long) (n * nlines - written),
+		    n == maxthreads ? "" : ",");
+	}
+	printf("  ],\n");
+}
+
+/*
+ * Drop rate with the default drop-newest policy at various queue
+ * entry limits, with every producer logging flat out.
+ */
+static void
+bench_drops(int nthreads, uint64_t nlines)
+{
+	static const int limits[] = { 16, 128, 1024, 8192 };
+	uint64_t written, elapsed, offered;
+	size_t i;
+
+	offered = nthreads * nlines;
+	printf("  \"drops\": [\n");
+	for (i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+		bench_start();
+		debug_set_queue_limit(limits[i], 64 * 1024 * 1024);
+		written = bench_producers(nthreads, nlines, &elapsed);
+		printf("    { \"queue_limit\": %d, \"threads\": %d, "
+		    "\"offered\": %llu, \"written\": %llu, "
+		    "\"drop_rate\": %.6f }%s\n",
+		    limits[i], nthreads,
+		    (unsigned long long) offered,
+		    (unsigned long long) written,
+		    (double) (offered - written) / offered,
+		    i == sizeof(limits) / sizeof(limits[0]) - 1 ? "" : ",");
+	}
+	printf("  ]\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t nlines = 200000;
+	int ch, fd, nthreads = 4;
+
+	while ((ch = getopt(argc, argv, "n:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nlines = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nlines == 0 || nthreads <= 0)
+		usage();
+
+	fd = mkstemp(logpath);
+	if (fd < 0)
+		err(1, "mkstemp");
+	close(fd);
+
+	printf("{\n");
+	bench_disabled(nlines * 50);
+	bench_latency(nlines);
+	bench_throughput(nthreads, nlines);
+	bench_drops(nthreads, nlines);
+	printf("}\n");
+
+	exit(0);
+}
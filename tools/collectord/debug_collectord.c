@@ -0,0 +1,597 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Collector for processes logging through shared memory regions
+ * (debug_shm_init()).
+ *
+ * Watches a directory for region files, drains every region, merges
+ * the lines in timestamp order and writes them to a single log file,
+ * stderr and/or syslog, so the processes need neither a logger thread
+ * nor a log file of their own.  Regions are removed once their
+ * process has shut down or died and they've been drained.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <err.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#include "os/time.h"
+
+#include "debug.h"
+#include "debug_internal.h"
+#include "debug_trace.h"
+
+#define	COLLECTORD_TAG_SIZE		(DEBUG_TRACE_NAME_LEN + 32)
+#define	COLLECTORD_SCAN_MS		250
+
+struct region {
+	TAILQ_ENTRY(region) r;
+	char *path;
+	struct debug_shm_hdr *hdr;
+	char *data;
+	size_t maplen;
+	uint64_t rd;			/* read up to; released after writing */
+	uint64_t drops;			/* drops reported so far */
+	char tag[COLLECTORD_TAG_SIZE];	/* "progname[pid]: " */
+	int taglen;
+};
+
+struct line {
+	uint64_t ts;
+	struct region *rg;
+	const struct debug_shm_rec *rec;
+	int seq;
+	char pfx[DEBUG_TS_PREFIX_SIZE];
+	int pfxlen;
+};
+
+static TAILQ_HEAD(, region) regions = TAILQ_HEAD_INITIALIZER(regions);
+static struct line *lines;
+static int nlines, lines_size;
+static struct iovec *iov;
+static int niov, iov_size;
+
+static struct debug_logfile logfile;
+static const char *dir;
+static int do_stderr, do_syslog;
+
+static volatile sig_atomic_t got_exit, got_hup;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: libdebug-collectord [-es] [-f logfile] "
+	    "[-z gzip|zstd] [-r nbytes] [-n ngen] [-i msec] dir\n");
+	fprintf(stderr, "  -e  write lines enabled for stderr to stderr\n");
+	fprintf(stderr, "  -s  write lines enabled for syslog to syslog\n");
+	fprintf(stderr, "  -f  write lines enabled for the log file to "
+	    "logfile\n");
+	fprintf(stderr, "  -z  compress the log file\n");
+	fprintf(stderr, "  -r  rotate the log file every nbytes\n");
+	fprintf(stderr, "  -n  keep ngen rotated log files\n");
+	fprintf(stderr, "  -i  poll the regions every msec (default 10)\n");
+	exit(1);
+}
+
+static void
+sig_handler(int sig)
+{
+
+	if (sig == SIGHUP)
+		got_hup = 1;
+	else
+		got_exit = 1;
+}
+
+static int
+region_known(const char *path)
+{
+	struct region *rg;
+
+	TAILQ_FOREACH(rg, &regions, r) {
+		if (strcmp(rg->path, path) == 0)
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Map a region file.  Files which aren't (yet) valid regions are
+ * skipped and looked at again on the next scan.
+ */
+static void
+region_add(const char *path)
+{
+	struct debug_shm_hdr *h;
+	struct region *rg;
+	struct stat sb;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &sb) < 0 || (size_t) sb.st_size < sizeof(*h)) {
+		close(fd);
+		return;
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return;
+
+	h = p;
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != DEBUG_SHM_MAGIC ||
+	    h->version != DEBUG_SHM_VERSION ||
+	    h->size == 0 || (h->size & (h->size - 1)) != 0 ||
+	    (uint64_t) h->data_offset + h->size > (uint64_t) sb.st_size) {
+		munmap(p, sb.st_size);
+		return;
+	}
+
+	rg = calloc(1, sizeof(*rg));
+	if (rg == NULL || (rg->path = strdup(path)) == NULL) {
+		free(rg);
+		munmap(p, sb.st_size);
+		return;
+	}
+	rg->hdr = h;
+	rg->data = (char *) p + h->data_offset;
+	rg->maplen = sb.st_size;
+	rg->rd = __atomic_load_n(&h->ridx, __ATOMIC_ACQUIRE);
+	rg->taglen = snprintf(rg->tag, sizeof(rg->tag), "%.*s[%lld]: ",
+	    DEBUG_TRACE_NAME_LEN, h->progname, (long long) h->pid);
+	if (rg->taglen >= (int) sizeof(rg->tag))
+		rg->taglen = sizeof(rg->tag) - 1;
+	TAILQ_INSERT_TAIL(&regions, rg, r);
+}
+
+static void
+region_remove(struct region *rg)
+{
+
+	TAILQ_REMOVE(&regions, rg, r);
+	(void) unlink(rg->path);
+	munmap(rg->hdr, rg->maplen);
+	free(rg->path);
+	free(rg);
+}
+
+/*
+ * Pick up any new region files.
+ */
+static void
+scan_dir(void)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	size_t l;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (dp == NULL) {
+		warn("%s", dir);
+		return;
+	}
+	while ((d = readdir(dp)) != NULL) {
+		l = strlen(d->d_name);
+		if (l < 4 || strcmp(d->d_name + l - 4, ".shm") != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+		if (! region_known(path))
+			region_add(path);
+	}
+	closedir(dp);
+}
+
+static struct line *
+line_alloc(void)
+{
+	struct line *n;
+	int sz;
+
+	if (nlines == lines_size) {
+		sz = lines_size ? lines_size * 2 : 1024;
+		n = realloc(lines, sz * sizeof(*n));
+		if (n == NULL)
+			return (NULL);
+		lines = n;
+		lines_size = sz;
+	}
+	n = &lines[nlines];
+	n->seq = nlines++;
+	return (n);
+}
+
+/*
+ * Stage the committed records in a region, stopping at the first
+ * one which is still being written.
+ */
+static void
+region_collect(struct region *rg)
+{
+	const struct debug_shm_rec *rec;
+	struct line *l;
+	uint64_t w;
+	uint32_t c;
+
+	w = __atomic_load_n(&rg->hdr->widx, __ATOMIC_ACQUIRE);
+	while (rg->rd != w) {
+		rec = (const struct debug_shm_rec *)
+		    (rg->data + (rg->rd & (rg->hdr->size - 1)));
+		c = __atomic_load_n(&rec->commit, __ATOMIC_ACQUIRE);
+		if (c == 0)
+			break;
+		rg->rd += c & ~DEBUG_SHM_PAD;
+		if (c & DEBUG_SHM_PAD)
+			continue;
+		l = line_alloc();
+		if (l == NULL)
+			continue;
+		l->ts = rec->ts;
+		l->rg = rg;
+		l->rec = rec;
+	}
+}
+
+/*
+ * Zero what's been written out and hand the space back.
+ */
+static void
+region_release(struct region *rg)
+{
+	uint64_t r = __atomic_load_n(&rg->hdr->ridx, __ATOMIC_RELAXED);
+	uint32_t off, n, mask = rg->hdr->size - 1;
+
+	while (r != rg->rd) {
+		off = r & mask;
+		n = rg->rd - r;
+		if (n > rg->hdr->size - off)
+			n = rg->hdr->size - off;
+		memset(rg->data + off, 0, n);
+		r += n;
+	}
+	__atomic_store_n(&rg->hdr->ridx, r, __ATOMIC_RELEASE);
+}
+
+static int
+line_cmp(const void *a, const void *b)
+{
+	const struct line *la = a, *lb = b;
+
+	if (la->ts != lb->ts)
+		return (la->ts < lb->ts ? -1 : 1);
+	return (la->seq < lb->seq ? -1 : (la->seq > lb->seq));
+}
+
+/*
+ * The default libdebug prefix; localtime_r()/strftime() only run
+ * when the second changes.
+ */
+static int
+ts_prefix(uint64_t ns, char *buf)
+{
+	static char head[DEBUG_TS_HEAD_SIZE];
+	static time_t head_sec = -1;
+	static int headlen;
+	time_t sec = ns / 1000000000ULL;
+	struct tm t;
+	int n;
+
+	if (sec != head_sec) {
+		localtime_r(&sec, &t);
+		headlen = strftime(head, sizeof(head), "%Y-%m-%d %H:%M:%S (",
+		    &t);
+		headlen += debug_u64toa(head + headlen, sec, 10, 0);
+		head[headlen++] = '.';
+		head_sec = sec;
+	}
+	memcpy(buf, head, headlen);
+	n = headlen + debug_u64toa(buf + headlen, (ns / 1000) % 1000000, 10, 6);
+	memcpy(buf + n, ")| ", 3);
+	return (n + 3);
+}
+
+static int
+iov_add(const void *base, size_t len)
+{
+	struct iovec *n;
+	int sz;
+
+	if (niov == iov_size) {
+		sz = iov_size ? iov_size * 2 : 1024;
+		n = realloc(iov, sz * sizeof(*n));
+		if (n == NULL)
+			return (-1);
+		iov = n;
+		iov_size = sz;
+	}
+	iov[niov].iov_base = (void *) (uintptr_t) base;
+	iov[niov].iov_len = len;
+	niov++;
+	return (0);
+}
+
+/*
+ * Write the staged lines enabled for one destination.
+ */
+static void
+write_lines(int type)
+{
+	const struct debug_shm_rec *rec;
+	struct line *l;
+	int i;
+
+	niov = 0;
+	for (i = 0; i < nlines; i++) {
+		l = &lines[i];
+		rec = l->rec;
+		if ((rec->types & (1 << type)) == 0)
+			continue;
+		if (type == DEBUG_TYPE_SYSLOG) {
+			syslog(debug_syslog_prio(rec->mask), "%.*s%.*s",
+			    l->rg->taglen, l->rg->tag, (int) rec->msglen,
+			    rec->msg);
+			continue;
+		}
+		if (iov_add(l->pfx, l->pfxlen) < 0 ||
+		    iov_add(l->rg->tag, l->rg->taglen) < 0 ||
+		    iov_add(rec->msg, rec->msglen) < 0)
+			break;
+	}
+	if (niov == 0)
+		return;
+	if (type == DEBUG_TYPE_LOG)
+		debug_logfile_writev(&logfile, iov, niov);
+	else
+		(void) debug_sink_writev(STDERR_FILENO, iov, niov);
+}
+
+/*
+ * Write a collector line of our own to the file and/or stderr.
+ */
+static void
+note(const char *fmt, ...)
+{
+	char pfx[DEBUG_TS_PREFIX_SIZE], buf[256];
+	struct iovec v[2];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n >= (int) sizeof(buf))
+		n = sizeof(buf) - 1;
+
+	v[0].iov_base = pfx;
+	v[0].iov_len = ts_prefix(OS_clock_gettime_ns(OS_CLOCK_REALTIME), pfx);
+	v[1].iov_base = buf;
+	v[1].iov_len = n;
+	if (logfile.fd >= 0)
+		debug_logfile_writev(&logfile, v, 2);
+	if (do_stderr) {
+		v[0].iov_base = pfx;
+		(void) debug_sink_writev(STDERR_FILENO, v, 2);
+	}
+}
+
+/*
+ * Drain every region once.  Returns the number of lines written.
+ */
+static int
+drain(void)
+{
+	struct region *rg;
+	struct line *l;
+	uint64_t d;
+	int i;
+
+	nlines = 0;
+	TAILQ_FOREACH(rg, &regions, r)
+		region_collect(rg);
+
+	if (nlines > 1)
+		qsort(lines, nlines, sizeof(*lines), line_cmp);
+	for (i = 0; i < nlines; i++) {
+		l = &lines[i];
+		l->pfxlen = ts_prefix(l->ts, l->pfx);
+	}
+	if (logfile.fd >= 0)
+		write_lines(DEBUG_TYPE_LOG);
+	if (do_stderr)
+		write_lines(DEBUG_TYPE_PRINT);
+	if (do_syslog)
+		write_lines(DEBUG_TYPE_SYSLOG);
+
+	TAILQ_FOREACH(rg, &regions, r) {
+		region_release(rg);
+		d = __atomic_load_n(&rg->hdr->drops, __ATOMIC_RELAXED);
+		if (d != rg->drops) {
+			note("libdebug-collectord: %llu messages dropped by "
+			    "%.*s\n", (unsigned long long) (d - rg->drops),
+			    rg->taglen - 2, rg->tag);
+			rg->drops = d;
+		}
+	}
+	return (nlines);
+}
+
+/*
+ * Is a region finished with?  That's once its process has shut down
+ * or died and everything it finished writing has been written out.
+ *
+ * XXX TODO: a thread which dies half way through writing a record
+ * stalls the region until the process exits.
+ */
+static int
+region_done(struct region *rg)
+{
+	const struct debug_shm_rec *rec;
+	int dead;
+
+	dead = kill(rg->hdr->pid, 0) < 0 && errno == ESRCH;
+	if (! dead && ! __atomic_load_n(&rg->hdr->closed, __ATOMIC_ACQUIRE))
+		return (0);
+	if (rg->rd == __atomic_load_n(&rg->hdr->widx, __ATOMIC_ACQUIRE))
+		return (1);
+
+	/* A record left half written by a process which died */
+	rec = (const struct debug_shm_rec *)
+	    (rg->data + (rg->rd & (rg->hdr->size - 1)));
+	return (dead && __atomic_load_n(&rec->commit, __ATOMIC_ACQUIRE) == 0);
+}
+
+static void
+reap(void)
+{
+	struct region *rg, *rn;
+
+	for (rg = TAILQ_FIRST(&regions); rg != NULL; rg = rn) {
+		rn = TAILQ_NEXT(rg, r);
+		if (region_done(rg))
+			region_remove(rg);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	const char *filename = NULL;
+	uint64_t last_scan = 0, now;
+	struct timespec ts;
+	int ch, interval = 10;
+
+	debug_logfile_init(&logfile);
+	while ((ch = getopt(argc, argv, "ef:i:n:r:sz:")) != -1) {
+		switch (ch) {
+		case 'e':
+			do_stderr = 1;
+			break;
+		case 'f':
+			filename = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'n':
+			logfile.ngen = atoi(optarg);
+			break;
+		case 'r':
+			logfile.rotate_bytes = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			do_syslog = 1;
+			break;
+		case 'z':
+			if (strcmp(optarg, "gzip") == 0)
+				logfile.compress = DEBUG_COMPRESS_GZIP;
+			else if (strcmp(optarg, "zstd") == 0)
+				logfile.compress = DEBUG_COMPRESS_ZSTD;
+			else
+				usage();
+			if (! debug_logfile_compress_ok(logfile.compress))
+				errx(1, "%s compression isn't available",
+				    optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || interval <= 0)
+		usage();
+	dir = argv[0];
+
+	if (filename != NULL && debug_logfile_open(&logfile, filename) < 0)
+		err(1, "%s", filename);
+	if (do_syslog)
+		openlog("libdebug-collectord", LOG_NDELAY, LOG_DAEMON);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_handler;
+	sigemptyset(&sa.sa_mask);
+	(void) sigaction(SIGHUP, &sa, NULL);
+	(void) sigaction(SIGINT, &sa, NULL);
+	(void) sigaction(SIGTERM, &sa, NULL);
+
+	ts.tv_sec = interval / 1000;
+	ts.tv_nsec = (interval % 1000) * 1000000L;
+	for (;;) {
+		now = OS_clock_gettime_ns(OS_CLOCK_MONOTONIC) / 1000000ULL;
+		if (now - last_scan >= COLLECTORD_SCAN_MS) {
+			reap();
+			scan_dir();
+			last_scan = now;
+		}
+
+		/* SIGHUP reopens the log file, after external rotation */
+		if (got_hup) {
+			got_hup = 0;
+			if (filename != NULL) {
+				debug_logfile_close(&logfile);
+				if (debug_logfile_open(&logfile, filename) < 0)
+					warn("%s", filename);
+			}
+		}
+
+		if (drain() == 0) {
+			if (got_exit)
+				break;
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	debug_logfile_close(&logfile);
+	debug_logfile_free(&logfile);
+	exit(0);
+}
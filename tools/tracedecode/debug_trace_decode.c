@@ -0,0 +1,222 @@
+/*-
+ * Copyright (c) 2013 Netflix, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Netflix, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Offline decoder for the libdebug binary trace ring files.
+ *
+ * Prints the records in each ring file, oldest first, in the same
+ * timestamp format as the text log, naming the sections from the
+ * table stored in the ring header.  Crash buffer files are recognised
+ * by their magic and their lines printed oldest first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "debug_trace.h"
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: libdebug-tracedecode [-d] file ...\n");
+	fprintf(stderr, "  -d  print arguments in decimal rather than hex\n");
+	exit(1);
+}
+
+static void
+decode_rec(const struct debug_trace_hdr *h, const struct debug_trace_rec *r,
+    int decimal)
+{
+	char buf[128];
+	struct tm t;
+	time_t tt;
+	int i, nargs;
+
+	tt = r->ts / 1000000000ULL;
+	localtime_r(&tt, &t);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &t);
+
+	printf("%s (%llu.%09llu)| ", buf,
+	    (unsigned long long) (r->ts / 1000000000ULL),
+	    (unsigned long long) (r->ts % 1000000000ULL));
+
+	if (r->section < h->nsections &&
+	    h->section_names[r->section][0] != '\0')
+		printf("%.*s", DEBUG_TRACE_NAME_LEN,
+		    h->section_names[r->section]);
+	else
+		printf("section %u", r->section);
+
+	printf(": trace %u:", r->id);
+	nargs = r->nargs;
+	if (nargs > DEBUG_TRACE_MAX_ARGS)
+		nargs = DEBUG_TRACE_MAX_ARGS;
+	for (i = 0; i < nargs; i++) {
+		if (decimal)
+			printf(" %llu", (unsigned long long) r->args[i]);
+		else
+			printf(" 0x%llx", (unsigned long long) r->args[i]);
+	}
+	printf("\n");
+}
+
+static int
+decode_crash_file(const char *path, const void *p, size_t len)
+{
+	const struct debug_crash_hdr *h = p;
+	const char *l;
+	uint64_t w, i;
+	size_t ll;
+
+	if ( h->version != DEBUG_CRASH_VERSION ||
+	    h->line_size == 0 ||
+	    h->nlines == 0 || (h->nlines & (h->nlines - 1)) != 0 ||
+	    (uint64_t) h->line_offset + (uint64_t) h->nlines * h->line_size >
+	    (uint64_t) len) {
+		warnx("%s: bad crash buffer header", path);
+		return (-1);
+	}
+
+	w = h->widx;
+	printf("# %s: crash buffer, pid %lld, %llu lines written\n",
+	    path, (long long) h->pid, (unsigned long long) w);
+
+	i = (w > h->nlines) ? w - h->nlines : 0;
+	for (; i < w; i++) {
+		l = (const char *) p + h->line_offset +
+		    (i & (h->nlines - 1)) * h->line_size;
+		ll = strnlen(l, h->line_size);
+		printf("%.*s", (int) ll, l);
+		if (ll == 0 || l[ll - 1] != '\n')
+			printf("\n");
+	}
+	return (0);
+}
+
+static int
+decode_file(const char *path, int decimal)
+{
+	const struct debug_trace_hdr *h;
+	const struct debug_trace_rec *recs;
+	struct stat sb;
+	uint64_t w, i;
+	void *p;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		warn("%s", path);
+		return (-1);
+	}
+	if (fstat(fd, &sb) < 0 ||
+	    (size_t) sb.st_size < sizeof(struct debug_crash_hdr)) {
+		warnx("%s: too short", path);
+		close(fd);
+		return (-1);
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		warn("%s: mmap", path);
+		return (-1);
+	}
+
+	h = p;
+	if (h->magic == DEBUG_CRASH_MAGIC) {
+		ret = decode_crash_file(path, p, sb.st_size);
+		munmap(p, sb.st_size);
+		return (ret);
+	}
+	if ((size_t) sb.st_size < sizeof(*h) ||
+	    h->magic != DEBUG_TRACE_MAGIC ||
+	    h->version != DEBUG_TRACE_VERSION ||
+	    h->rec_size != sizeof(struct debug_trace_rec) ||
+	    h->nrecs == 0 || (h->nrecs & (h->nrecs - 1)) != 0 ||
+	    h->nsections > DEBUG_SECTION_MAX ||
+	    (uint64_t) h->rec_offset + (uint64_t) h->nrecs * h->rec_size >
+	    (uint64_t) sb.st_size) {
+		warnx("%s: not a libdebug trace file (or a different version)",
+		    path);
+		munmap(p, sb.st_size);
+		return (-1);
+	}
+
+	recs = (const struct debug_trace_rec *)
+	    ((const char *) p + h->rec_offset);
+	w = __atomic_load_n(&h->widx, __ATOMIC_ACQUIRE);
+
+	printf("# %s: %.*s pid %lld tid %lld, %llu records written\n",
+	    path, DEBUG_TRACE_NAME_LEN, h->progname,
+	    (long long) h->pid, (long long) h->tid,
+	    (unsigned long long) w);
+
+	i = (w > h->nrecs) ? w - h->nrecs : 0;
+	for (; i < w; i++)
+		decode_rec(h, &recs[i & (h->nrecs - 1)], decimal);
+
+	munmap(p, sb.st_size);
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ch, decimal = 0, ret = 0;
+
+	while ((ch = getopt(argc, argv, "d")) != -1) {
+		switch (ch) {
+		case 'd':
+			decimal = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		usage();
+
+	for (; argc > 0; argc--, argv++) {
+		if (decode_file(*argv, decimal) < 0)
+			ret = 1;
+	}
+
+	exit(ret);
+}